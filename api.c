@@ -0,0 +1,225 @@
+/*
+ * api.c
+ *		In-process C API of ptrack for other extensions
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/api.c
+ *
+ * Extensions running inside the server (verification, mirroring, prewarm)
+ * can look up changed blocks directly in the map through PtrackApi instead
+ * of calling ptrack_get_pagemapset() via SPI and decoding bytea bitmaps.
+ * All lookups go through the same segment scan as SQL functions, so hot
+ * segments and cost-based delay are taken into account.  Exact map of hot
+ * segment is pinned only inside a single call, never between the calls, so
+ * consumer may do whatever it wants between them.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrack_api_register() --- publish PtrackApi in the rendezvous variable
+ *
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "utils/memutils.h"
+
+#include "datapagemap.h"
+#include "engine.h"
+#include "ptrack.h"
+#include "ptrack_api.h"
+
+struct PtrackFileIter
+{
+	PtBlockId	bid;
+	BlockNumber nblocks;
+	XLogRecPtr	lsn;
+	/* Context of the iterator, where pagemap is allocated */
+	MemoryContext mcxt;
+	/* Changed blocks of the current segment */
+	datapagemap_t pagemap;
+	datapagemap_iterator_t *pagemap_iter;
+	/* Number of the current segment */
+	BlockNumber segno;
+};
+
+static XLogRecPtr ptrack_api_init_lsn(void);
+static bool ptrack_api_block_changed_since(RelFileNode rnode, ForkNumber forknum,
+										   BlockNumber blkno, XLogRecPtr lsn);
+static void ptrack_api_blocks_changed_since(RelFileNode rnode, ForkNumber forknum,
+											const BlockNumber *blknos, int nblocks,
+											XLogRecPtr lsn, bool *changed);
+static PtrackFileIter * ptrack_api_file_begin(RelFileNode rnode, ForkNumber forknum,
+											  BlockNumber nblocks, XLogRecPtr lsn);
+static bool ptrack_api_file_next(PtrackFileIter * iter, BlockNumber *blkno);
+static void ptrack_api_file_end(PtrackFileIter * iter);
+
+static PtrackApi ptrack_api = {
+	PTRACK_API_VERSION,
+	ptrack_api_init_lsn,
+	ptrack_api_block_changed_since,
+	ptrack_api_blocks_changed_since,
+	ptrack_api_file_begin,
+	ptrack_api_file_next,
+	ptrack_api_file_end
+};
+
+/*
+ * Called from _PG_init().
+ */
+void
+ptrack_api_register(void)
+{
+	PtrackApi **api_p = (PtrackApi * *) find_rendezvous_variable(PTRACK_API_RENDEZVOUS);
+
+	*api_p = &ptrack_api;
+}
+
+static inline void
+ptrack_api_make_bid(PtBlockId * bid, RelFileNode rnode, ForkNumber forknum,
+					BlockNumber blkno)
+{
+	bid->relnode = rnode;
+	bid->forknum = forknum;
+	bid->blocknum = blkno;
+}
+
+static XLogRecPtr
+ptrack_api_init_lsn(void)
+{
+	if (ptrack_map == NULL)
+		return InvalidXLogRecPtr;
+
+	return pg_atomic_read_u64(&ptrack_map->init_lsn);
+}
+
+static bool
+ptrack_api_block_changed_since(RelFileNode rnode, ForkNumber forknum,
+							   BlockNumber blkno, XLogRecPtr lsn)
+{
+	bool		changed;
+
+	ptrack_api_blocks_changed_since(rnode, forknum, &blkno, 1, lsn, &changed);
+
+	return changed;
+}
+
+static void
+ptrack_api_blocks_changed_since(RelFileNode rnode, ForkNumber forknum,
+								const BlockNumber *blknos, int nblocks,
+								XLogRecPtr lsn, bool *changed)
+{
+	PtSegScan	segscan;
+	BlockNumber segno = InvalidBlockNumber;
+	int			i;
+
+	ptrack_check_start_lsn(lsn, NULL);
+
+	for (i = 0; i < nblocks; i++)
+	{
+		if (blknos[i] / RELSEG_SIZE != segno)
+		{
+			PtBlockId	bid;
+
+			if (segno != InvalidBlockNumber)
+				ptrack_segscan_end(&segscan);
+
+			segno = blknos[i] / RELSEG_SIZE;
+			ptrack_api_make_bid(&bid, rnode, forknum, segno * RELSEG_SIZE);
+			ptrack_segscan_begin(&segscan, bid, lsn);
+		}
+
+		changed[i] = (ptrack_segscan_get(&segscan, blknos[i]) >= lsn);
+	}
+
+	if (segno != InvalidBlockNumber)
+		ptrack_segscan_end(&segscan);
+}
+
+static PtrackFileIter *
+ptrack_api_file_begin(RelFileNode rnode, ForkNumber forknum,
+					  BlockNumber nblocks, XLogRecPtr lsn)
+{
+	PtrackFileIter *iter;
+
+	ptrack_check_start_lsn(lsn, NULL);
+
+	iter = palloc0(sizeof(PtrackFileIter));
+	ptrack_api_make_bid(&iter->bid, rnode, forknum, 0);
+	iter->nblocks = nblocks;
+	iter->lsn = lsn;
+	iter->mcxt = CurrentMemoryContext;
+	iter->segno = InvalidBlockNumber;
+
+	return iter;
+}
+
+/*
+ * Changed blocks are collected a whole segment at a time, so that exact map
+ * of a hot segment is not pinned between the calls.
+ */
+static bool
+ptrack_api_file_next(PtrackFileIter * iter, BlockNumber *blkno)
+{
+	for (;;)
+	{
+		BlockNumber start;
+		BlockNumber end;
+		BlockNumber i;
+		PtSegScan	segscan;
+		MemoryContext oldcontext;
+
+		if (iter->pagemap_iter != NULL &&
+			datapagemap_next(iter->pagemap_iter, blkno))
+		{
+			*blkno += iter->segno * RELSEG_SIZE;
+			return true;
+		}
+
+		if (iter->pagemap_iter != NULL)
+		{
+			pfree(iter->pagemap_iter);
+			iter->pagemap_iter = NULL;
+		}
+		if (iter->pagemap.bitmap != NULL)
+		{
+			pfree(iter->pagemap.bitmap);
+			iter->pagemap.bitmap = NULL;
+			iter->pagemap.bitmapsize = 0;
+		}
+
+		iter->segno = (iter->segno == InvalidBlockNumber) ? 0 : iter->segno + 1;
+		start = iter->segno * RELSEG_SIZE;
+		if (start >= iter->nblocks)
+			return false;
+		end = Min(iter->nblocks, start + RELSEG_SIZE);
+
+		oldcontext = MemoryContextSwitchTo(iter->mcxt);
+
+		iter->bid.blocknum = start;
+		ptrack_segscan_begin(&segscan, iter->bid, iter->lsn);
+
+		for (i = start; i < end; i++)
+		{
+			if (ptrack_segscan_get(&segscan, i) >= iter->lsn)
+				datapagemap_add(&iter->pagemap, i - start);
+		}
+
+		ptrack_segscan_end(&segscan);
+
+		iter->pagemap_iter = datapagemap_iterate(&iter->pagemap);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+}
+
+static void
+ptrack_api_file_end(PtrackFileIter * iter)
+{
+	if (iter->pagemap_iter != NULL)
+		pfree(iter->pagemap_iter);
+	if (iter->pagemap.bitmap != NULL)
+		pfree(iter->pagemap.bitmap);
+	pfree(iter);
+}
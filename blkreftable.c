@@ -0,0 +1,371 @@
+/*
+ * blkreftable.c
+ *		Export of ptrack changes as block reference tables
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/blkreftable.c
+ *
+ * Block reference table is the format of WAL summaries of PostgreSQL 17,
+ * which are consumed by its native incremental backup instead of scanning
+ * WAL.  Table is built in memory from changed blocks found by the map scan
+ * and then serialized into a file, so that the same changeset can be fed
+ * to the tools understanding this format.
+ *
+ * Each relation fork keeps a bitmap per chunk of PTRACK_BRT_BLOCKS_PER_CHUNK
+ * blocks, allocated on the first changed block of the chunk.  Sparse chunks
+ * are turned into arrays of block offsets only on write.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrack_brt_create()  --- create empty table in the current context
+ *	  ptrack_brt_mark()    --- add changed block
+ *	  ptrack_brt_write()   --- durably write table into a file
+ *	  ptrack_brt_destroy() --- free all memory of the table
+ *
+ */
+
+#include "postgres.h"
+
+#include <unistd.h>
+
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "blkreftable.h"
+
+typedef struct PtrackBrtKey
+{
+	RelFileNode relnode;
+	ForkNumber	forknum;
+}			PtrackBrtKey;
+
+typedef struct PtrackBrtEntry
+{
+	PtrackBrtKey key;
+	uint32		nchunks;
+	/* Bitmaps of chunks, NULL for chunks without changed blocks */
+	uint16	  **chunks;
+}			PtrackBrtEntry;
+
+struct PtrackBlockRefTable
+{
+	MemoryContext mcxt;
+	HTAB	   *entries;
+};
+
+/* Buffered writer computing CRC of everything written */
+typedef struct PtrackBrtWriter
+{
+	int			fd;
+	const char *path;
+	pg_crc32c	crc;
+	int			used;
+	char		data[BLCKSZ];
+}			PtrackBrtWriter;
+
+PtrackBlockRefTable *
+ptrack_brt_create(void)
+{
+	PtrackBlockRefTable *brt;
+	MemoryContext mcxt;
+	HASHCTL		ctl;
+
+	mcxt = AllocSetContextCreate(CurrentMemoryContext,
+								 "ptrack block reference table",
+								 ALLOCSET_DEFAULT_SIZES);
+
+	brt = MemoryContextAllocZero(mcxt, sizeof(PtrackBlockRefTable));
+	brt->mcxt = mcxt;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(PtrackBrtKey);
+	ctl.entrysize = sizeof(PtrackBrtEntry);
+	ctl.hcxt = mcxt;
+	brt->entries = hash_create("ptrack block reference table", 1024, &ctl,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	return brt;
+}
+
+void
+ptrack_brt_mark(PtrackBlockRefTable * brt, RelFileNode relnode,
+				ForkNumber forknum, BlockNumber blkno)
+{
+	PtrackBrtKey key;
+	PtrackBrtEntry *entry;
+	bool		found;
+	uint32		chunkno = blkno / PTRACK_BRT_BLOCKS_PER_CHUNK;
+	uint32		offset = blkno % PTRACK_BRT_BLOCKS_PER_CHUNK;
+
+	/* Key is hashed as a blob, so clear the padding, if any */
+	MemSet(&key, 0, sizeof(key));
+	key.relnode = relnode;
+	key.forknum = forknum;
+
+	entry = hash_search(brt->entries, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->nchunks = 0;
+		entry->chunks = NULL;
+	}
+
+	if (chunkno >= entry->nchunks)
+	{
+		uint32		nchunks = Max(chunkno + 1, entry->nchunks * 2);
+
+		if (entry->chunks == NULL)
+			entry->chunks = MemoryContextAllocZero(brt->mcxt,
+												   nchunks * sizeof(uint16 *));
+		else
+		{
+			entry->chunks = repalloc(entry->chunks, nchunks * sizeof(uint16 *));
+			MemSet(entry->chunks + entry->nchunks, 0,
+				   (nchunks - entry->nchunks) * sizeof(uint16 *));
+		}
+		entry->nchunks = nchunks;
+	}
+
+	if (entry->chunks[chunkno] == NULL)
+		entry->chunks[chunkno] =
+			MemoryContextAllocZero(brt->mcxt,
+								   PTRACK_BRT_MAX_ENTRIES_PER_CHUNK * sizeof(uint16));
+
+	entry->chunks[chunkno][offset / PTRACK_BRT_BLOCKS_PER_ENTRY] |=
+		1 << (offset % PTRACK_BRT_BLOCKS_PER_ENTRY);
+}
+
+void
+ptrack_brt_destroy(PtrackBlockRefTable * brt)
+{
+	MemoryContextDelete(brt->mcxt);
+}
+
+static void
+ptrack_brt_flush(PtrackBrtWriter * writer)
+{
+	errno = 0;
+	if (write(writer->fd, writer->data, writer->used) != writer->used)
+	{
+		/* If write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not write file \"%s\": %m", writer->path)));
+	}
+
+	writer->used = 0;
+}
+
+static void
+ptrack_brt_append(PtrackBrtWriter * writer, const void *data, int len)
+{
+	const char *p = data;
+
+	COMP_CRC32C(writer->crc, data, len);
+
+	while (len > 0)
+	{
+		int			n = Min(len, (int) sizeof(writer->data) - writer->used);
+
+		memcpy(writer->data + writer->used, p, n);
+		writer->used += n;
+		p += n;
+		len -= n;
+
+		if (writer->used == sizeof(writer->data))
+			ptrack_brt_flush(writer);
+	}
+}
+
+/* Entries are written in the same order as by PostgreSQL */
+static int
+ptrack_brt_entry_cmp(const void *a, const void *b)
+{
+	const PtrackBrtEntry *ea = *(PtrackBrtEntry * const *) a;
+	const PtrackBrtEntry *eb = *(PtrackBrtEntry * const *) b;
+
+	if (ea->key.relnode.spcNode != eb->key.relnode.spcNode)
+		return ea->key.relnode.spcNode > eb->key.relnode.spcNode ? 1 : -1;
+	if (ea->key.relnode.dbNode != eb->key.relnode.dbNode)
+		return ea->key.relnode.dbNode > eb->key.relnode.dbNode ? 1 : -1;
+	if (ea->key.relnode.relNode != eb->key.relnode.relNode)
+		return ea->key.relnode.relNode > eb->key.relnode.relNode ? 1 : -1;
+	if (ea->key.forknum != eb->key.forknum)
+		return ea->key.forknum > eb->key.forknum ? 1 : -1;
+	return 0;
+}
+
+static uint16
+ptrack_brt_chunk_usage(const uint16 *chunk)
+{
+	int			nblocks = 0;
+	int			i;
+
+	if (chunk == NULL)
+		return 0;
+
+	for (i = 0; i < PTRACK_BRT_MAX_ENTRIES_PER_CHUNK; i++)
+	{
+		uint16		word = chunk[i];
+
+		/* Bit utils are not available in all supported versions */
+		while (word != 0)
+		{
+			word &= word - 1;
+			nblocks++;
+		}
+	}
+
+	return Min(nblocks, PTRACK_BRT_MAX_ENTRIES_PER_CHUNK);
+}
+
+static void
+ptrack_brt_write_entry(PtrackBrtWriter * writer, PtrackBrtEntry * entry)
+{
+	PtrackBrtSerializedEntry sentry;
+	uint16	   *usage;
+	uint16	   *offsets;
+	uint32		nchunks = entry->nchunks;
+	uint32		i;
+
+	/* Do not write trailing empty chunks */
+	while (nchunks > 0 && entry->chunks[nchunks - 1] == NULL)
+		nchunks--;
+
+	MemSet(&sentry, 0, sizeof(sentry));
+	sentry.relnode = entry->key.relnode;
+	sentry.forknum = entry->key.forknum;
+
+	/*
+	 * Map does not know about truncations.  That is fine, since all blocks
+	 * appearing again after truncation are marked by mdextend_hook, and
+	 * incremental backup never takes blocks beyond the current relation size
+	 * from the older backups.
+	 */
+	sentry.limit_block = InvalidBlockNumber;
+	sentry.nchunks = nchunks;
+	ptrack_brt_append(writer, &sentry, sizeof(sentry));
+
+	if (nchunks == 0)
+		return;
+
+	usage = palloc(nchunks * sizeof(uint16));
+	for (i = 0; i < nchunks; i++)
+		usage[i] = ptrack_brt_chunk_usage(entry->chunks[i]);
+	ptrack_brt_append(writer, usage, nchunks * sizeof(uint16));
+
+	offsets = palloc(PTRACK_BRT_MAX_ENTRIES_PER_CHUNK * sizeof(uint16));
+	for (i = 0; i < nchunks; i++)
+	{
+		const uint16 *chunk = entry->chunks[i];
+		int			n = 0;
+		int			w;
+
+		if (usage[i] == 0)
+			continue;
+
+		if (usage[i] == PTRACK_BRT_MAX_ENTRIES_PER_CHUNK)
+		{
+			ptrack_brt_append(writer, chunk,
+							  PTRACK_BRT_MAX_ENTRIES_PER_CHUNK * sizeof(uint16));
+			continue;
+		}
+
+		/* Sparse chunk is stored as an array of offsets */
+		for (w = 0; w < PTRACK_BRT_MAX_ENTRIES_PER_CHUNK; w++)
+		{
+			int			bit;
+
+			if (chunk[w] == 0)
+				continue;
+
+			for (bit = 0; bit < PTRACK_BRT_BLOCKS_PER_ENTRY; bit++)
+			{
+				if (chunk[w] & (1 << bit))
+					offsets[n++] = w * PTRACK_BRT_BLOCKS_PER_ENTRY + bit;
+			}
+		}
+
+		Assert(n == usage[i]);
+		ptrack_brt_append(writer, offsets, n * sizeof(uint16));
+	}
+
+	pfree(offsets);
+	pfree(usage);
+}
+
+/*
+ * Write table into 'path' through a temporary file, so that readers never
+ * see a partially written one.
+ */
+void
+ptrack_brt_write(PtrackBlockRefTable * brt, const char *path)
+{
+	PtrackBrtWriter *writer;
+	PtrackBrtSerializedEntry zentry;
+	PtrackBrtEntry **sorted;
+	PtrackBrtEntry *entry;
+	HASH_SEQ_STATUS status;
+	char		path_tmp[MAXPGPATH];
+	uint32		magic = PTRACK_BRT_MAGIC;
+	pg_crc32c	crc;
+	long		nentries;
+	long		i = 0;
+
+	nentries = hash_get_num_entries(brt->entries);
+	sorted = palloc(Max(nentries, 1) * sizeof(PtrackBrtEntry *));
+
+	hash_seq_init(&status, brt->entries);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		sorted[i++] = entry;
+	qsort(sorted, nentries, sizeof(PtrackBrtEntry *), ptrack_brt_entry_cmp);
+
+	snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", path);
+
+	writer = palloc0(sizeof(PtrackBrtWriter));
+	writer->path = path_tmp;
+	INIT_CRC32C(writer->crc);
+
+	writer->fd = OpenTransientFile(path_tmp, O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY);
+	if (writer->fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not create file \"%s\": %m", path_tmp)));
+
+	ptrack_brt_append(writer, &magic, sizeof(magic));
+
+	for (i = 0; i < nentries; i++)
+	{
+		ptrack_brt_write_entry(writer, sorted[i]);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	MemSet(&zentry, 0, sizeof(zentry));
+	ptrack_brt_append(writer, &zentry, sizeof(zentry));
+
+	/* CRC covers everything before it, so finalize a copy */
+	crc = writer->crc;
+	FIN_CRC32C(crc);
+	ptrack_brt_append(writer, &crc, sizeof(crc));
+	ptrack_brt_flush(writer);
+
+	if (pg_fsync(writer->fd) != 0)
+		ereport(data_sync_elevel(ERROR),
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not fsync file \"%s\": %m", path_tmp)));
+
+	if (CloseTransientFile(writer->fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not close file \"%s\": %m", path_tmp)));
+
+	durable_rename(path_tmp, path, ERROR);
+
+	pfree(writer);
+	pfree(sorted);
+}
@@ -0,0 +1,56 @@
+/*-------------------------------------------------------------------------
+ *
+ * blkreftable.h
+ *	  header for export of ptrack changes as block reference tables
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/blkreftable.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_BLKREFTABLE_H
+#define PTRACK_BLKREFTABLE_H
+
+#include "storage/block.h"
+#include "storage/relfilenode.h"
+
+/* Directory of WAL summaries, relative to PGDATA */
+#define PTRACK_SUMMARY_DIR "pg_wal/summaries"
+
+/*
+ * On-disk format of PostgreSQL 17 block reference table, see
+ * src/common/blkreftable.c there.  File starts with the magic number and is
+ * followed by serialized entries sorted by relation fork.  Each entry is
+ * followed by 'nchunks' chunk sizes and contents of non-empty chunks.  Chunk
+ * covers PTRACK_BRT_BLOCKS_PER_CHUNK blocks and is either an array of uint16
+ * block offsets or, if its size is PTRACK_BRT_MAX_ENTRIES_PER_CHUNK, a bitmap.
+ * Zeroed entry terminates the list and is followed by CRC-32C of everything
+ * written before it.
+ */
+#define PTRACK_BRT_MAGIC 0x652b137b
+#define PTRACK_BRT_BLOCKS_PER_CHUNK (1 << 16)
+#define PTRACK_BRT_BLOCKS_PER_ENTRY (BITS_PER_BYTE * sizeof(uint16))
+#define PTRACK_BRT_MAX_ENTRIES_PER_CHUNK \
+	(PTRACK_BRT_BLOCKS_PER_CHUNK / PTRACK_BRT_BLOCKS_PER_ENTRY)
+
+typedef struct PtrackBrtSerializedEntry
+{
+	RelFileNode relnode;
+	ForkNumber	forknum;
+	/* Blocks at or above it were truncated, InvalidBlockNumber if none */
+	BlockNumber limit_block;
+	uint32		nchunks;
+}			PtrackBrtSerializedEntry;
+
+typedef struct PtrackBlockRefTable PtrackBlockRefTable;
+
+extern PtrackBlockRefTable * ptrack_brt_create(void);
+extern void ptrack_brt_mark(PtrackBlockRefTable * brt, RelFileNode relnode,
+							ForkNumber forknum, BlockNumber blkno);
+extern void ptrack_brt_write(PtrackBlockRefTable * brt, const char *path);
+extern void ptrack_brt_destroy(PtrackBlockRefTable * brt);
+
+#endif							/* PTRACK_BLKREFTABLE_H */
@@ -0,0 +1,192 @@
+/*
+ * coarse.c
+ *		Coarse index of ptrack map groups
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/coarse.c
+ *
+ * Map is usually much larger than the last level cache, so every lookup of
+ * a cold block is a cache miss (and with the hashed layout also a random
+ * page access), even if nothing has changed since the start of the scan.
+ * To avoid touching the map for blocks, which are obviously unchanged, we
+ * keep a small index with one entry per PTRACK_COARSE_GROUP_SLOTS slots of
+ * the map.  Entry holds the last checkpoint 'epoch', in which any slot of
+ * the group was advanced.  Mark path only writes it once per group and
+ * checkpoint, when epoch changes, so it stays a read-mostly structure.
+ *
+ * Checkpointer starts a new epoch and remembers the end of WAL at that
+ * moment.  Scan since 'start_lsn' finds the last epoch, which started
+ * before it: groups, which were not advanced since then, hold only changes
+ * older than 'start_lsn' and are rejected without reading the map.
+ *
+ * Entry stores the whole 4-byte epoch, since a single byte would wrap
+ * around after 256 checkpoints and there are no 1-byte atomics in
+ * PostgreSQL.  Groups are made large enough to keep the index small anyway.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrackCoarseShmemSize()    --- shared memory size required for the index
+ *	  ptrackCoarseShmemInit()    --- allocate the index in shared memory
+ *	  ptrack_coarse_mark()       --- note that map slot was advanced
+ *	  ptrack_coarse_checkpoint() --- start new epoch
+ *	  ptrack_coarse_max_epoch()  --- find epochs older than the scan start
+ *	  ptrack_coarse_skip()       --- check whether map slot may be skipped
+ *
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "storage/shmem.h"
+
+#include "ptrack.h"
+#include "engine.h"
+#include "coarse.h"
+
+#define PtrackCoarseNgroups \
+		((PtrackContentNblocks + PTRACK_COARSE_GROUP_SLOTS - 1) / PTRACK_COARSE_GROUP_SLOTS)
+
+PtrackCoarseCtlData *ptrack_coarse = NULL;
+
+/*
+ * Greatest LSN put into the map by postmaster, either restored from disk by
+ * ptrack_map_file_decode() or marked by ptrack_coarse_mark()
+ */
+XLogRecPtr	ptrack_coarse_init_lsn = InvalidXLogRecPtr;
+
+Size
+ptrackCoarseShmemSize(void)
+{
+	if (ptrack_map_size == 0)
+		return 0;
+
+	return add_size(offsetof(PtrackCoarseCtlData, groups),
+					mul_size(PtrackCoarseNgroups, sizeof(pg_atomic_uint32)));
+}
+
+/*
+ * Allocate the index in shared memory.  Nothing is allocated if ptrack is
+ * disabled, so ptrack_coarse stays NULL.
+ */
+void
+ptrackCoarseShmemInit(void)
+{
+	bool		found;
+	bool		reinit = (ptrack_coarse != NULL);
+	uint64		i;
+
+	if (ptrack_map_size == 0)
+		return;
+
+	ptrack_coarse = ShmemInitStruct("ptrack coarse index",
+									ptrackCoarseShmemSize(),
+									&found);
+
+	if (!found)
+	{
+		/*
+		 * Shared memory is reinitialized after a crash of backend, but the
+		 * map keeps all marks made since start, so find the greatest one.
+		 */
+		if (reinit)
+		{
+			for (i = 0; i < PtrackContentNblocks; i++)
+				ptrack_coarse_init_lsn = Max(ptrack_coarse_init_lsn,
+											 ptrack_map_entry_read(i));
+		}
+
+		/*
+		 * Everything loaded by postmaster goes to epoch 0, which ends right
+		 * after the greatest loaded LSN.
+		 */
+		pg_atomic_init_u32(&ptrack_coarse->epoch, 1);
+		pg_atomic_init_u32(&ptrack_coarse->known_epoch, 1);
+
+		for (i = 0; i < PTRACK_COARSE_HISTORY; i++)
+			pg_atomic_init_u64(&ptrack_coarse->start_lsn[i], PG_UINT64_MAX);
+		pg_atomic_write_u64(&ptrack_coarse->start_lsn[1], ptrack_coarse_init_lsn + 1);
+
+		for (i = 0; i < PtrackCoarseNgroups; i++)
+			pg_atomic_init_u32(&ptrack_coarse->groups[i], 0);
+	}
+}
+
+/*
+ * Start new epoch.  Called by checkpointer before the map is written, so
+ * epochs of groups are bounded by the number of checkpoints.
+ */
+void
+ptrack_coarse_checkpoint(void)
+{
+	uint32		epoch;
+	XLogRecPtr	lsn;
+
+	if (ptrack_coarse == NULL)
+		return;
+
+	/*
+	 * Every mark, which still sees the previous epoch, took its LSN before
+	 * this increment and so before the LSN we take below.
+	 */
+	epoch = pg_atomic_add_fetch_u32(&ptrack_coarse->epoch, 1);
+
+	if (RecoveryInProgress())
+		lsn = GetXLogReplayRecPtr(NULL);
+	else
+		lsn = GetXLogInsertRecPtr();
+
+	pg_atomic_write_u64(&ptrack_coarse->start_lsn[epoch % PTRACK_COARSE_HISTORY],
+						lsn + 1);
+	pg_write_barrier();
+	pg_atomic_write_u32(&ptrack_coarse->known_epoch, epoch);
+
+	elog(DEBUG1, "ptrack coarse index: epoch %u started at %X/%X",
+		 epoch, (uint32) (lsn >> 32), (uint32) lsn);
+}
+
+/*
+ * Return the greatest epoch, which groups hold only changes older than
+ * 'start_lsn', or -1 if there is no such epoch.  Scans usually check many
+ * segments with the same 'start_lsn', so the last answer is cached.
+ */
+int64
+ptrack_coarse_max_epoch(XLogRecPtr start_lsn)
+{
+	static XLogRecPtr cached_lsn = InvalidXLogRecPtr;
+	static uint32 cached_known_epoch = 0;
+	static int64 cached_max_epoch = -1;
+	uint32		known_epoch;
+	uint32		epoch;
+
+	if (ptrack_coarse == NULL || start_lsn == InvalidXLogRecPtr)
+		return -1;
+
+	known_epoch = pg_atomic_read_u32(&ptrack_coarse->known_epoch);
+	pg_read_barrier();
+
+	if (start_lsn == cached_lsn && known_epoch == cached_known_epoch)
+		return cached_max_epoch;
+
+	cached_lsn = start_lsn;
+	cached_known_epoch = known_epoch;
+	cached_max_epoch = -1;
+
+	/*
+	 * Start LSNs grow with epochs, so search for the last one not above
+	 * 'start_lsn'.  Slot may be concurrently overwritten by a newer epoch,
+	 * but it only makes the answer more conservative.
+	 */
+	for (epoch = known_epoch;
+		 epoch > 0 && known_epoch - epoch < PTRACK_COARSE_HISTORY;
+		 epoch--)
+	{
+		if (pg_atomic_read_u64(&ptrack_coarse->start_lsn[epoch % PTRACK_COARSE_HISTORY]) <= start_lsn)
+		{
+			cached_max_epoch = (int64) epoch - 1;
+			break;
+		}
+	}
+
+	return cached_max_epoch;
+}
@@ -0,0 +1,91 @@
+/*-------------------------------------------------------------------------
+ *
+ * coarse.h
+ *	  header for coarse index of ptrack map groups
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/coarse.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_COARSE_H
+#define PTRACK_COARSE_H
+
+#include "access/xlogdefs.h"
+#include "port/atomics.h"
+
+/*
+ * Number of adjacent map slots sharing one entry of the index, i.e. one
+ * 4 KB page of the map.  Index is 1024 times smaller than the map.
+ */
+#define PTRACK_COARSE_GROUP_SLOTS 512
+
+/* Number of last checkpoint epochs, which start LSNs are remembered */
+#define PTRACK_COARSE_HISTORY 256
+
+/*
+ * Shared state of the coarse index.  Epoch is advanced by every checkpoint,
+ * start_lsn[e % PTRACK_COARSE_HISTORY] is the end of WAL at the moment, when
+ * epoch 'e' started.  groups[g] is the last epoch, in which any slot of the
+ * group 'g' was advanced, so all changes stored in the group happened before
+ * the start of epoch groups[g] + 1.
+ */
+typedef struct PtrackCoarseCtlData
+{
+	pg_atomic_uint32 epoch;
+	/* Last epoch, which start LSN is already stored */
+	pg_atomic_uint32 known_epoch;
+	pg_atomic_uint64 start_lsn[PTRACK_COARSE_HISTORY];
+	pg_atomic_uint32 groups[FLEXIBLE_ARRAY_MEMBER];
+}			PtrackCoarseCtlData;
+
+extern PtrackCoarseCtlData * ptrack_coarse;
+extern XLogRecPtr ptrack_coarse_init_lsn;
+
+extern Size ptrackCoarseShmemSize(void);
+extern void ptrackCoarseShmemInit(void);
+extern void ptrack_coarse_checkpoint(void);
+extern int64 ptrack_coarse_max_epoch(XLogRecPtr start_lsn);
+
+/*
+ * Note that map slot was advanced to 'lsn'.  Postmaster loads and replays
+ * the map before the index is created, so it only remembers the greatest
+ * LSN to start the first epoch with.
+ */
+static inline void
+ptrack_coarse_mark(size_t slot, XLogRecPtr lsn)
+{
+	pg_atomic_uint32 *group;
+	uint32		epoch;
+	uint32		old_epoch;
+
+	if (unlikely(ptrack_coarse == NULL))
+	{
+		ptrack_coarse_init_lsn = Max(ptrack_coarse_init_lsn, lsn);
+		return;
+	}
+
+	group = &ptrack_coarse->groups[slot / PTRACK_COARSE_GROUP_SLOTS];
+	epoch = pg_atomic_read_u32(&ptrack_coarse->epoch);
+	old_epoch = pg_atomic_read_u32(group);
+
+	/* Written only once per group and checkpoint, so usually just a read */
+	while (old_epoch < epoch &&
+		   !pg_atomic_compare_exchange_u32(group, &old_epoch, epoch));
+}
+
+/*
+ * Whether all changes of the map slot are known to be older than the scan
+ * start, see ptrack_coarse_max_epoch() for 'max_epoch'.
+ */
+static inline bool
+ptrack_coarse_skip(size_t slot, int64 max_epoch)
+{
+	return max_epoch >= 0 &&
+		pg_atomic_read_u32(&ptrack_coarse->groups[slot / PTRACK_COARSE_GROUP_SLOTS]) <= max_epoch;
+}
+
+#endif							/* PTRACK_COARSE_H */
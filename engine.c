@@ -10,10 +10,23 @@
  * INTERFACE ROUTINES (PostgreSQL side)
  *	  ptrackMapInit()          --- allocate new shared ptrack_map
  *	  ptrackMapAttach()        --- attach to the existing ptrack_map
+ *	  ptrackMapShmemInit()     --- allocate stats and striped locks of ptrack_map
+ *	  ptrack_map_get_stats()   --- get residency and fault stats of ptrack_map
  *	  assign_ptrack_map_size() --- ptrack_map_size GUC assign callback
+ *	  ptrack_opendir()         --- open directory for reading with ptrack_readdir()
+ *	  ptrack_readdir()         --- read next entry of directory with its type
+ *	  ptrack_closedir()        --- close directory
  *	  ptrack_walkdir()         --- walk directory and mark all blocks of all
  *	                               data files in ptrack_map
  *	  ptrack_mark_block()      --- mark single page in ptrack_map
+ *	  ptrack_mark_block_at()   --- mark single page changed at the given LSN
+ *	  ptrack_set_init_lsn()    --- set init_lsn of ptrack_map if not set yet
+ *	  ptrack_check_start_lsn() --- check that ptrack_map covers changes since LSN
+ *	  ptrack_map_advance()     --- move LSN of ptrack_map slot forward
+ *	  ptrack_segscan_begin()   --- start lookup of changes of relation segment
+ *	  ptrack_segscan_get()     --- get LSN of the last change of block
+ *	  ptrack_segscan_end()     --- finish lookup of relation segment
+ *	  ptrack_scan_delay_point() --- sleep if scan has exceeded its cost limit
  *
  */
 
@@ -24,27 +37,103 @@
 
 #ifndef WIN32
 #include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
 #endif
 
 #include "access/htup_details.h"
 #include "access/parallel.h"
 #include "access/xlog.h"
 #include "catalog/pg_tablespace.h"
+#include "common/controldata_utils.h"
+#include "common/pg_lzcompress.h"
 #include "miscadmin.h"
 #include "port/pg_crc32c.h"
 #include "storage/copydir.h"
+#include "storage/fd.h"
 #if PG_VERSION_NUM >= 120000
 #include "storage/md.h"
 #include "storage/sync.h"
 #endif
 #include "storage/reinit.h"
+#include "storage/shmem.h"
 #include "storage/smgr.h"
+#include "storage/spin.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/pg_lsn.h"
 
 #include "ptrack.h"
 #include "engine.h"
+#include "coarse.h"
+#include "hot.h"
+#include "skipwal.h"
+#include "snapshot.h"
+#include "standby.h"
+#include "trace.h"
+#include "walmap.h"
+
+/*
+ * On Linux we read directories with getdents64() directly to use much
+ * larger buffer, than readdir() does.
+ */
+#if defined(__linux__) && defined(SYS_getdents64)
+#define PTRACK_USE_GETDENTS
+
+struct ptrack_dirent64
+{
+	uint64		d_ino;
+	int64		d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char		d_name[FLEXIBLE_ARRAY_MEMBER];
+};
+#endif
+
+struct PtrackDir
+{
+	char	   *path;
+#ifdef PTRACK_USE_GETDENTS
+	int			fd;
+	int			open_errno;
+	char	   *buf;
+	long		len;
+	long		pos;
+#else
+	DIR		   *dir;
+#endif
+	char		subpath[MAXPGPATH * 2];
+};
+
+/* Cost-based delay of ptrack scans, see ptrack_scan_delay_point() */
+double		ptrack_scan_cost_delay = 0;
+int			ptrack_scan_cost_limit = 200;
+int			ptrack_scan_cost_balance = 0;
+int			ptrack_mark_mode = PTRACK_MARK_WRITE;
+int			ptrack_map_layout = PTRACK_LAYOUT_HASHED;
+
+/* Memory options of the mapping, see ptrack_map_prepare() */
+bool		ptrack_map_prefault = false;
+bool		ptrack_map_lock = false;
+bool		ptrack_map_random_access = false;
+
+/* Taken by postmaster in ptrackMapInit() and copied into shared memory */
+static PtrackMapStats ptrack_map_init_stats;
+static PtrackMapStats *ptrack_map_stats = NULL;
+
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+/* Padded to avoid false sharing of neighbouring locks */
+typedef union PtrackMapLock
+{
+	slock_t		lock;
+	char		pad[PG_CACHE_LINE_SIZE];
+}			PtrackMapLock;
+
+/* Locks of map entries, NULL in postmaster before shared memory is created */
+static PtrackMapLock * ptrack_map_locks = NULL;
+#endif
 
 /*
  * Check that path is accessible by us and return true if it is
@@ -68,14 +157,25 @@ ptrack_file_exists(const char *path)
 }
 
 /*
- * Write a piece of ptrack map to file and update CRC32 value.
+ * Buffered writer of ptrack.map, so that small compressed chunks are
+ * written to disk in large pieces.
  */
-static void
-ptrack_write_chunk(int fd, pg_crc32c *crc, char *chunk, size_t size)
+typedef struct PtrackMapWriter
 {
-	COMP_CRC32C(*crc, (char *) chunk, size);
+	int			fd;
+	char	   *buf;
+	size_t		len;
+}			PtrackMapWriter;
 
-	if (write(fd, chunk, size) != size)
+/*
+ * Write out everything buffered in 'writer'.
+ */
+static void
+ptrack_write_flush(PtrackMapWriter * writer)
+{
+	errno = 0;
+	if (writer->len > 0 &&
+		write(writer->fd, writer->buf, writer->len) != (ssize_t) writer->len)
 	{
 		/* If write didn't set errno, assume problem is no disk space */
 		if (errno == 0)
@@ -85,6 +185,107 @@ ptrack_write_chunk(int fd, pg_crc32c *crc, char *chunk, size_t size)
 				(errcode_for_file_access(),
 				 errmsg("could not write file \"%s\": %m", PTRACK_PATH_TMP)));
 	}
+
+	writer->len = 0;
+}
+
+/*
+ * Write a piece of ptrack map to file.
+ */
+static void
+ptrack_write_chunk(PtrackMapWriter * writer, char *chunk, size_t size)
+{
+	if (writer->len + size > PTRACK_IO_BUF_SIZE)
+		ptrack_write_flush(writer);
+
+	/* We never write pieces larger than buffer, but be safe */
+	if (size > PTRACK_IO_BUF_SIZE)
+	{
+		memcpy(writer->buf, chunk, PTRACK_IO_BUF_SIZE);
+		writer->len = PTRACK_IO_BUF_SIZE;
+		ptrack_write_flush(writer);
+		ptrack_write_chunk(writer, chunk + PTRACK_IO_BUF_SIZE, size - PTRACK_IO_BUF_SIZE);
+		return;
+	}
+
+	memcpy(writer->buf + writer->len, chunk, size);
+	writer->len += size;
+}
+
+/*
+ * Upper bound of the on-disk size of a chunk of PTRACK_BUF_SIZE entries.
+ * PGLZ_MAX_OUTPUT() is also enough for entries stored uncompressed.
+ */
+#define PTRACK_CHUNK_MAX_SIZE \
+	(sizeof(PtrackMapChunkHdr) + \
+	 PGLZ_MAX_OUTPUT(PTRACK_BUF_SIZE * PTRACK_VARINT_MAX_SIZE))
+
+/*
+ * Return room for 'size' bytes at the end of the write buffer, so that the
+ * caller can produce data right there instead of copying it.  The caller
+ * advances writer->len by the number of bytes actually used.
+ */
+static char *
+ptrack_write_reserve(PtrackMapWriter * writer, size_t size)
+{
+	Assert(size <= PTRACK_IO_BUF_SIZE);
+
+	if (writer->len + size > PTRACK_IO_BUF_SIZE)
+		ptrack_write_flush(writer);
+
+	return writer->buf + writer->len;
+}
+
+/*
+ * Encode 'n' entries relative to 'base' into chunk at 'dst', which has room
+ * for PTRACK_CHUNK_MAX_SIZE bytes.  Entries are compressed straight to their
+ * place after the header and CRC is computed right away, while the output is
+ * still in cache.  'rawbuf' is a scratch space for varint-encoded entries.
+ * Returns the size of the chunk.
+ */
+static size_t
+ptrack_chunk_encode(const uint64 *entries, uint32 n, XLogRecPtr base,
+					char *rawbuf, char *dst)
+{
+	PtrackMapChunkHdr chdr;
+	char	   *data = dst + sizeof(chdr);
+	int32		rawsize = 0;
+	int32		compsize;
+	uint32		datasize;
+	uint32		j;
+
+	for (j = 0; j < n; j++)
+		rawsize += ptrack_varint_encode(rawbuf + rawsize,
+										entries[j] == InvalidXLogRecPtr ? 0 : entries[j] - base + 1);
+
+	compsize = pglz_compress(rawbuf, rawsize, data, PGLZ_strategy_default);
+
+	MemSet(&chdr, 0, sizeof(chdr));
+	chdr.nentries = n;
+	chdr.rawsize = rawsize;
+	chdr.compsize = compsize > 0 ? compsize : 0;
+	chdr.base = base;
+
+	if (chdr.compsize > 0)
+		datasize = chdr.compsize;
+	else
+	{
+		memcpy(data, rawbuf, rawsize);
+		datasize = rawsize;
+	}
+
+	INIT_CRC32C(chdr.crc);
+	COMP_CRC32C(chdr.crc, (char *) &chdr, offsetof(PtrackMapChunkHdr, crc));
+	COMP_CRC32C(chdr.crc, data, datasize);
+	FIN_CRC32C(chdr.crc);
+
+	/* Chunks follow each other unaligned in the buffer */
+	memcpy(dst, &chdr, sizeof(chdr));
+
+	elog(DEBUG5, "ptrack checkpoint: chunk of %u entries, rawsize %d, compsize %d",
+		 n, rawsize, compsize);
+
+	return sizeof(chdr) + datasize;
 }
 
 /*
@@ -112,6 +313,9 @@ ptrackCleanFilesAndMap(void)
 	if (ptrack_file_exists(ptrack_path))
 		durable_unlink(ptrack_path, LOG);
 
+	ptrack_snapshot_clean();
+	ptrack_skipwal_clean();
+
 	if (ptrack_map != NULL)
 	{
 #ifdef WIN32
@@ -129,8 +333,463 @@ ptrackCleanFilesAndMap(void)
 }
 
 /*
- * Copy PTRACK_PATH file to special temporary file PTRACK_MMAP_PATH used for mapping,
- * or create new file, if there was no PTRACK_PATH file on disk.
+ * Check that the map read from disk can be trusted by this cluster.
+ *
+ * ptrack.map is copied into base backups as is, so restored or cloned
+ * cluster may start with a map of another cluster or with a map older than
+ * the point, from which its recovery starts.  Changes made before that point
+ * are not replayed and would never be marked, so they must be in the map
+ * already.  Changes made after it are marked again during replay.
+ */
+static bool
+ptrack_map_is_valid(const char *ptrack_path)
+{
+	ControlFileData *control_file;
+	bool		crc_ok;
+	XLogRecPtr	start_lsn;
+	char		label_path[MAXPGPATH];
+	FILE	   *lfp;
+	bool		result = false;
+
+#if PG_VERSION_NUM >= 120000
+	control_file = get_controlfile(DataDir, &crc_ok);
+#else
+	control_file = get_controlfile(DataDir, NULL, &crc_ok);
+#endif
+
+	if (!crc_ok)
+	{
+		elog(WARNING, "ptrack init: cannot validate map \"%s\" against control file with incorrect checksum",
+			 ptrack_path);
+		pfree(control_file);
+		return false;
+	}
+
+	/* Restored cluster starts recovery from the backup start LSN */
+	start_lsn = control_file->checkPointCopy.redo;
+
+	snprintf(label_path, MAXPGPATH, "%s/%s", DataDir, BACKUP_LABEL_FILE);
+	lfp = AllocateFile(label_path, "r");
+	if (lfp != NULL)
+	{
+		uint32		hi;
+		uint32		lo;
+
+		if (fscanf(lfp, "START WAL LOCATION: %X/%X", &hi, &lo) != 2)
+		{
+			elog(WARNING, "ptrack init: could not parse start WAL location in \"%s\"",
+				 label_path);
+			FreeFile(lfp);
+			pfree(control_file);
+			return false;
+		}
+
+		start_lsn = (uint64) hi << 32 | lo;
+		FreeFile(lfp);
+	}
+	else if (errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack init: could not read file \"%s\": %m", label_path)));
+
+	if (ptrack_map->system_identifier != control_file->system_identifier)
+		elog(WARNING, "ptrack init: map \"%s\" belongs to another database system " UINT64_FORMAT ", expected " UINT64_FORMAT,
+			 ptrack_path, ptrack_map->system_identifier,
+			 control_file->system_identifier);
+	else if (ptrack_map->redo_lsn < start_lsn)
+		elog(WARNING, "ptrack init: map \"%s\" was written at %X/%X, before recovery start point %X/%X",
+			 ptrack_path,
+			 (uint32) (ptrack_map->redo_lsn >> 32), (uint32) ptrack_map->redo_lsn,
+			 (uint32) (start_lsn >> 32), (uint32) start_lsn);
+	else
+		result = true;
+
+	pfree(control_file);
+
+	return result;
+}
+
+static void
+ptrack_map_corrupted(const char *path, const char *detail)
+{
+	/* Only the main map is required to start the server */
+	bool		is_map = strstr(path, PTRACK_PATH) != NULL;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("ptrack: corrupted map file \"%s\"", path),
+			 errdetail_internal("%s", detail),
+			 is_map ? errhint("Delete \"%s\" and start the server again.", path) : 0));
+}
+
+/*
+ * Check that map file header 'hdr' of the file 'path' has a known format
+ * and matches ptrack.map_size and ptrack.map_layout.  Reports the mismatch
+ * at 'elevel' otherwise.
+ */
+static bool
+ptrack_map_hdr_compatible(const char *path, const PtrackMapFileHdr * hdr, int elevel)
+{
+	if (hdr->version_num < PTRACK_MAP_COMPAT_VERSION_NUM)
+	{
+		elog(elevel, "ptrack: map \"%s\" of version %u has incompatible format",
+			 path, hdr->version_num);
+		return false;
+	}
+
+	if (hdr->nentries != PtrackContentNblocks)
+	{
+		elog(elevel, "ptrack: map \"%s\" of " UINT64_FORMAT " entries does not match ptrack.map_size",
+			 path, hdr->nentries);
+		return false;
+	}
+
+	/* Entries of another layout are in other slots */
+	if (memcmp(hdr->magic, PTRACK_FILE_MAGIC_CURRENT, sizeof(PTRACK_FILE_MAGIC)) != 0)
+	{
+		elog(elevel, "ptrack: map \"%s\" does not match ptrack.map_layout", path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Open the on-disk copy of the map and read its header.  Returns NULL if
+ * file has an incompatible format or was written for another map size.
+ */
+static FILE *
+ptrack_map_file_open(const char *path, PtrackMapFileHdr * hdr)
+{
+	FILE	   *fp;
+	pg_crc32c	crc;
+
+	fp = AllocateFile(path, PG_BINARY_R);
+	if (fp == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not open file \"%s\": %m", path)));
+
+	setvbuf(fp, NULL, _IOFBF, PTRACK_IO_BUF_SIZE);
+
+	if (fread(hdr, sizeof(PtrackMapFileHdr), 1, fp) != 1 ||
+		(memcmp(hdr->magic, PTRACK_FILE_MAGIC, sizeof(PTRACK_FILE_MAGIC)) != 0 &&
+		 memcmp(hdr->magic, PTRACK_FILE_MAGIC_SEGMENT, sizeof(PTRACK_FILE_MAGIC_SEGMENT)) != 0))
+	{
+		elog(WARNING, "ptrack: wrong map format of file \"%s\"", path);
+		FreeFile(fp);
+		return NULL;
+	}
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) hdr, offsetof(PtrackMapFileHdr, crc));
+	FIN_CRC32C(crc);
+
+	if (!EQ_CRC32C(crc, hdr->crc))
+		ptrack_map_corrupted(path, "incorrect header checksum");
+
+	if (!ptrack_map_hdr_compatible(path, hdr, WARNING))
+	{
+		FreeFile(fp);
+		return NULL;
+	}
+
+	if (hdr->chunk_entries == 0 || hdr->chunk_entries > PTRACK_BUF_SIZE)
+		ptrack_map_corrupted(path, "invalid number of entries per chunk");
+
+	return fp;
+}
+
+/*
+ * Decode entries of the map file opened by ptrack_map_file_open() either
+ * into the shared map 'map_entries' or into plain array 'entries'.
+ *
+ * File is read in large sequential pieces and decompressed chunk by chunk
+ * right into the destination.  Shared map is written without atomics,
+ * since postmaster is the only user at that moment.
+ */
+static void
+ptrack_map_file_decode(FILE *fp, const char *path, const PtrackMapFileHdr * hdr,
+					   PtrackMapEntry * map_entries, uint64 *entries)
+{
+	pg_crc32c	crc;
+	char	   *rawbuf;
+	char	   *compbuf;
+	uint32		rawmax;
+	uint64		i = 0;
+
+	rawmax = hdr->chunk_entries * PTRACK_VARINT_MAX_SIZE;
+	rawbuf = palloc(rawmax);
+	compbuf = palloc(PGLZ_MAX_OUTPUT(rawmax));
+
+	while (i < hdr->nentries)
+	{
+		PtrackMapChunkHdr chdr;
+		const char *pos;
+		const char *end;
+		uint32		j;
+
+		if (fread(&chdr, sizeof(chdr), 1, fp) != 1)
+			ptrack_map_corrupted(path, "unexpected end of file");
+
+		if (chdr.nentries == 0 || chdr.nentries > hdr->chunk_entries ||
+			chdr.nentries > hdr->nentries - i ||
+			chdr.rawsize > rawmax || chdr.compsize > PGLZ_MAX_OUTPUT(rawmax))
+			ptrack_map_corrupted(path, "invalid chunk header");
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, (char *) &chdr, offsetof(PtrackMapChunkHdr, crc));
+
+		if (chdr.compsize > 0)
+		{
+			if (fread(compbuf, 1, chdr.compsize, fp) != chdr.compsize)
+				ptrack_map_corrupted(path, "unexpected end of file");
+
+			COMP_CRC32C(crc, compbuf, chdr.compsize);
+			FIN_CRC32C(crc);
+			if (!EQ_CRC32C(crc, chdr.crc))
+				ptrack_map_corrupted(path, "incorrect chunk checksum");
+
+#if PG_VERSION_NUM >= 120000
+			if (pglz_decompress(compbuf, chdr.compsize, rawbuf, chdr.rawsize, true) != chdr.rawsize)
+#else
+			if (pglz_decompress(compbuf, chdr.compsize, rawbuf, chdr.rawsize) != chdr.rawsize)
+#endif
+				ptrack_map_corrupted(path, "could not decompress chunk");
+		}
+		else
+		{
+			if (fread(rawbuf, 1, chdr.rawsize, fp) != chdr.rawsize)
+				ptrack_map_corrupted(path, "unexpected end of file");
+
+			COMP_CRC32C(crc, rawbuf, chdr.rawsize);
+			FIN_CRC32C(crc);
+			if (!EQ_CRC32C(crc, chdr.crc))
+				ptrack_map_corrupted(path, "incorrect chunk checksum");
+		}
+
+		pos = rawbuf;
+		end = rawbuf + chdr.rawsize;
+
+		for (j = 0; j < chdr.nentries; j++)
+		{
+			uint64		delta;
+			XLogRecPtr	lsn;
+
+			pos = ptrack_varint_decode(pos, end, &delta);
+			if (pos == NULL)
+				ptrack_map_corrupted(path, "malformed chunk entries");
+
+			lsn = delta == 0 ? InvalidXLogRecPtr : chdr.base + delta - 1;
+			if (map_entries != NULL)
+			{
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+				map_entries[i + j] = lsn;
+#else
+				map_entries[i + j].value = lsn;
+#endif
+				/* Restored entries go to the first epoch of coarse index */
+				ptrack_coarse_init_lsn = Max(ptrack_coarse_init_lsn, lsn);
+			}
+			else
+				entries[i + j] = lsn;
+		}
+
+		if (pos != end)
+			ptrack_map_corrupted(path, "malformed chunk entries");
+
+		i += chdr.nentries;
+	}
+
+	pfree(rawbuf);
+	pfree(compbuf);
+}
+
+/*
+ * Restore content of the map from the compressed on-disk copy.  Returns
+ * false if file has an incompatible format, was written for another map
+ * size or cannot be trusted by this cluster (see ptrack_map_is_valid()).
+ * Nothing but the header is changed in that case.
+ */
+static bool
+ptrack_map_read(const char *ptrack_path)
+{
+	FILE	   *fp;
+	PtrackMapFileHdr hdr;
+
+	fp = ptrack_map_file_open(ptrack_path, &hdr);
+	if (fp == NULL)
+		return false;
+
+	memcpy(ptrack_map->magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE);
+	ptrack_map->version_num = hdr.version_num;
+	ptrack_map->system_identifier = hdr.system_identifier;
+	ptrack_map->redo_lsn = hdr.redo_lsn;
+	ptrack_map->init_lsn.value = hdr.init_lsn;
+
+	if (!ptrack_map_is_valid(ptrack_path))
+	{
+		FreeFile(fp);
+		return false;
+	}
+
+	ptrack_map_file_decode(fp, ptrack_path, &hdr, ptrack_map->entries, NULL);
+	FreeFile(fp);
+
+	elog(DEBUG1, "ptrack init: read map with init_lsn %X/%X",
+		 (uint32) (hdr.init_lsn >> 32), (uint32) hdr.init_lsn);
+
+	return true;
+}
+
+/*
+ * Check whether the on-disk copy of the map at 'path' can be used with the
+ * current map by its header only.  Unlike ptrack_map_file_open(), it never
+ * errors out.  File, which cannot be read, is not reported as incompatible.
+ */
+bool
+ptrack_map_file_compatible(const char *path)
+{
+	FILE	   *fp;
+	PtrackMapFileHdr hdr;
+	pg_crc32c	crc;
+	bool		result;
+
+	fp = AllocateFile(path, PG_BINARY_R);
+	if (fp == NULL)
+		return true;
+
+	if (fread(&hdr, sizeof(PtrackMapFileHdr), 1, fp) != 1 ||
+		(memcmp(hdr.magic, PTRACK_FILE_MAGIC, sizeof(PTRACK_FILE_MAGIC)) != 0 &&
+		 memcmp(hdr.magic, PTRACK_FILE_MAGIC_SEGMENT, sizeof(PTRACK_FILE_MAGIC_SEGMENT)) != 0))
+	{
+		elog(LOG, "ptrack: wrong map format of file \"%s\"", path);
+		FreeFile(fp);
+		return false;
+	}
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) &hdr, offsetof(PtrackMapFileHdr, crc));
+	FIN_CRC32C(crc);
+
+	if (!EQ_CRC32C(crc, hdr.crc))
+	{
+		elog(LOG, "ptrack: incorrect header checksum of map \"%s\"", path);
+		result = false;
+	}
+	else
+		result = ptrack_map_hdr_compatible(path, &hdr, LOG);
+
+	FreeFile(fp);
+
+	return result;
+}
+
+/*
+ * Load all entries of the on-disk copy of the map at 'path' (e.g. of a
+ * snapshot) into a palloc'ed array and fill its header.  Errors out, if
+ * the file cannot be used with the current map.
+ */
+uint64 *
+ptrack_map_file_load(const char *path, PtrackMapFileHdr * hdr)
+{
+	FILE	   *fp;
+	uint64	   *entries;
+
+	fp = ptrack_map_file_open(path, hdr);
+	if (fp == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("ptrack: map file \"%s\" cannot be used with the current map", path)));
+
+	entries = MemoryContextAllocHuge(CurrentMemoryContext,
+									 hdr->nentries * sizeof(uint64));
+	ptrack_map_file_decode(fp, path, hdr, NULL, entries);
+	FreeFile(fp);
+
+	return entries;
+}
+
+/*
+ * Get number of page faults taken by this process so far.
+ */
+static void
+ptrack_get_faults(int64 *major_faults, int64 *minor_faults)
+{
+#ifndef WIN32
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+	{
+		*major_faults = ru.ru_majflt;
+		*minor_faults = ru.ru_minflt;
+		return;
+	}
+#endif
+	*major_faults = 0;
+	*minor_faults = 0;
+}
+
+/*
+ * Apply ptrack.map_* memory options to the mapping of this process.
+ *
+ * Only postmaster prefaults and locks the map.  Pages locked by it stay
+ * resident for all backends, so marks never wait for reads of
+ * PTRACK_MMAP_PATH from disk.  Backends still take a minor fault on the
+ * first touch of each page, since page tables of shared mappings are not
+ * copied by fork().  Flags set by madvise() are inherited by fork(), so
+ * with EXEC_BACKEND they are set by every backend.
+ */
+static void
+ptrack_map_prepare(bool postmaster)
+{
+#ifndef WIN32
+#ifdef MADV_RANDOM
+	/* Map is hashed, so readahead around a faulting page is useless */
+	if (ptrack_map_random_access &&
+		madvise((void *) ptrack_map, PtrackActualSize, MADV_RANDOM) != 0)
+		elog(WARNING, "ptrack: could not set random access to the map: %m");
+#endif
+
+	if (!postmaster)
+		return;
+
+	if (ptrack_map_prefault)
+	{
+		volatile char *p = (volatile char *) ptrack_map;
+		long		pagesize = sysconf(_SC_PAGESIZE);
+		uint64		off;
+
+#ifdef MADV_WILLNEED
+		(void) madvise((void *) ptrack_map, PtrackActualSize, MADV_WILLNEED);
+#endif
+
+		/*
+		 * Touch every page for write, so that neither reads from disk nor
+		 * block allocation in the sparse file happen on the write path later.
+		 * Postmaster is the only user of the map yet.
+		 */
+		for (off = 0; off < PtrackActualSize; off += pagesize)
+			p[off] = p[off];
+
+		ptrack_map_init_stats.prefaulted = true;
+	}
+
+	if (ptrack_map_lock)
+	{
+		if (mlock((void *) ptrack_map, PtrackActualSize) == 0)
+			ptrack_map_init_stats.locked = true;
+		else
+			ereport(WARNING,
+					(errmsg("ptrack: could not lock map in memory: %m"),
+					 errhint("Raise the limit of locked memory of postmaster (ulimit -l).")));
+	}
+#endif
+}
+
+/*
+ * Create special temporary file PTRACK_MMAP_PATH used for mapping and
+ * restore its content from PTRACK_PATH file, if there is one on disk.
  *
  * Map the content of PTRACK_MMAP_PATH file into memory structure 'ptrack_map' using mmap.
  */
@@ -138,12 +797,11 @@ void
 ptrackMapInit(void)
 {
 	int			ptrack_fd;
-	pg_crc32c	crc;
-	pg_crc32c  *file_crc;
 	char		ptrack_path[MAXPGPATH];
 	char		ptrack_mmap_path[MAXPGPATH];
-	struct stat stat_buf;
 	bool		is_new_map = true;
+	int64		major_faults;
+	int64		minor_faults;
 
 	elog(DEBUG1, "ptrack init");
 
@@ -153,6 +811,8 @@ ptrackMapInit(void)
 	if (ptrack_map_size == 0)
 		return;
 
+	ptrack_get_faults(&major_faults, &minor_faults);
+
 	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_PATH);
 	sprintf(ptrack_mmap_path, "%s/%s", DataDir, PTRACK_MMAP_PATH);
 
@@ -160,33 +820,10 @@ ptrackMapInit(void)
 	if (ptrack_file_exists(ptrack_mmap_path))
 		durable_unlink(ptrack_mmap_path, LOG);
 
-	if (stat(ptrack_path, &stat_buf) == 0 &&
-		stat_buf.st_size != PtrackActualSize)
-	{
-		elog(WARNING, "ptrack init: unexpected \"%s\" file size %zu != " UINT64_FORMAT ", deleting",
-			 ptrack_path, (Size) stat_buf.st_size, PtrackActualSize);
-		durable_unlink(ptrack_path, LOG);
-	}
-
-	/*
-	 * If on-disk PTRACK_PATH file is present and has expected size, copy it
-	 * to read and restore state.
-	 */
-	if (stat(ptrack_path, &stat_buf) == 0)
-	{
-		copy_file(ptrack_path, ptrack_mmap_path);
-		is_new_map = false;		/* flag to check checksum */
-		ptrack_fd = BasicOpenFile(ptrack_mmap_path, O_RDWR | PG_BINARY);
-		if (ptrack_fd < 0)
-			elog(ERROR, "ptrack init: failed to open map file \"%s\": %m", ptrack_mmap_path);
-	}
-	else
-	{
-		/* Create new file for PTRACK_MMAP_PATH */
-		ptrack_fd = BasicOpenFile(ptrack_mmap_path, O_RDWR | O_CREAT | PG_BINARY);
-		if (ptrack_fd < 0)
-			elog(ERROR, "ptrack init: failed to open map file \"%s\": %m", ptrack_mmap_path);
-	}
+	/* Create new file for PTRACK_MMAP_PATH */
+	ptrack_fd = BasicOpenFile(ptrack_mmap_path, O_RDWR | O_CREAT | PG_BINARY);
+	if (ptrack_fd < 0)
+		elog(ERROR, "ptrack init: failed to open map file \"%s\": %m", ptrack_mmap_path);
 
 #ifdef WIN32
 	{
@@ -211,54 +848,61 @@ ptrackMapInit(void)
 	if (ftruncate(ptrack_fd, PtrackActualSize) < 0)
 		elog(ERROR, "ptrack init: failed to truncate file: %m");
 
-	ptrack_map = (PtrackMap) mmap(NULL, PtrackActualSize,
-								  PROT_READ | PROT_WRITE, MAP_SHARED,
-								  ptrack_fd, 0);
-	if (ptrack_map == MAP_FAILED)
-		elog(ERROR, "ptrack init: failed to mmap file: %m");
-#endif
-
-	if (!is_new_map)
 	{
-		XLogRecPtr	init_lsn;
+		int			flags = MAP_SHARED;
 
-		/* Check PTRACK_MAGIC */
-		if (strcmp(ptrack_map->magic, PTRACK_MAGIC) != 0)
-			elog(ERROR, "ptrack init: wrong map format of file \"%s\"", ptrack_path);
-
-		/* Check ptrack version inside old ptrack map */
-		/* No-op for now, but may be used for future compatibility checks */
-
-		/* Check CRC */
-		INIT_CRC32C(crc);
-		COMP_CRC32C(crc, (char *) ptrack_map, PtrackCrcOffset);
-		FIN_CRC32C(crc);
-
-		file_crc = (pg_crc32c *) ((char *) ptrack_map + PtrackCrcOffset);
+#ifdef MAP_POPULATE
+		if (ptrack_map_prefault)
+			flags |= MAP_POPULATE;
+#endif
 
-		/*
-		 * Read ptrack map values without atomics during initialization, since
-		 * postmaster is the only user right now.
-		 */
-		init_lsn = ptrack_map->init_lsn.value;
-		elog(DEBUG1, "ptrack init: crc %u, file_crc %u, init_lsn %X/%X",
-			 crc, *file_crc, (uint32) (init_lsn >> 32), (uint32) init_lsn);
+		ptrack_map = (PtrackMap) mmap(NULL, PtrackActualSize,
+									  PROT_READ | PROT_WRITE, flags,
+									  ptrack_fd, 0);
+		if (ptrack_map == MAP_FAILED)
+			elog(ERROR, "ptrack init: failed to mmap file: %m");
+	}
+#endif
 
-		/* TODO: Handle this error. Probably we can just recreate the file */
-		if (!EQ_CRC32C(*file_crc, crc))
+	/*
+	 * If on-disk PTRACK_PATH file is present, restore state from it.  Start
+	 * from scratch, as if there were no map on disk, if we cannot trust it.
+	 * Otherwise, init_lsn and all entries are kept, so incremental backups
+	 * can be taken immediately after restore.
+	 */
+	if (ptrack_file_exists(ptrack_path))
+	{
+		if (ptrack_map_read(ptrack_path))
+			is_new_map = false;
+		else
 		{
-			ereport(ERROR,
-					(errcode(ERRCODE_DATA_CORRUPTED),
-					 errmsg("ptrack init: incorrect checksum of file \"%s\"", ptrack_path),
-					 errhint("Delete \"%s\" and start the server again.", ptrack_path)));
+			elog(WARNING, "ptrack init: map \"%s\" is reinitialized", ptrack_path);
+
+			/* Entries are restored only after all checks, so reset header */
+			MemSet(ptrack_map, 0, offsetof(PtrackMapHdr, entries));
 		}
 	}
-	else
+
+	if (is_new_map)
 	{
 		memcpy(ptrack_map->magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE);
 		ptrack_map->version_num = PTRACK_VERSION_NUM;
+
+		/* Journal cannot make a new map any more complete */
+		ptrack_skipwal_clean();
 	}
+	else
+		ptrack_skipwal_replay();
 
+	ptrack_snapshot_check();
+
+	ptrack_map_prepare(true);
+
+	/* Faults of restore and prefault are not taken on the write path later */
+	ptrack_get_faults(&ptrack_map_init_stats.major_faults,
+					  &ptrack_map_init_stats.minor_faults);
+	ptrack_map_init_stats.major_faults -= major_faults;
+	ptrack_map_init_stats.minor_faults -= minor_faults;
 }
 
 /*
@@ -305,22 +949,146 @@ ptrackMapAttach(void)
 										   (DWORD) PtrackActualSize,
 										   NULL);
 
-		if (mh == NULL)
-			elog(ERROR, "ptrack attach: failed to create file mapping: %m");
+		if (mh == NULL)
+			elog(ERROR, "ptrack attach: failed to create file mapping: %m");
+
+		ptrack_map = (PtrackMap) MapViewOfFile(mh, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if (ptrack_map == NULL)
+		{
+			CloseHandle(mh);
+			elog(ERROR, "ptrack attach: failed to mmap ptrack file: %m");
+		}
+	}
+#else
+	ptrack_map = (PtrackMap) mmap(NULL, PtrackActualSize,
+								  PROT_READ | PROT_WRITE, MAP_SHARED,
+								  ptrack_fd, 0);
+	if (ptrack_map == MAP_FAILED)
+		elog(ERROR, "ptrack attach: failed to mmap ptrack file: %m");
+#endif
+
+	ptrack_map_prepare(false);
+}
+
+Size
+ptrackMapShmemSize(void)
+{
+	Size		size = MAXALIGN(sizeof(PtrackMapStats));
+
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+	size = add_size(size, mul_size(PTRACK_MAP_NLOCKS, sizeof(PtrackMapLock)));
+#endif
+
+	return size;
+}
+
+/*
+ * Allocate (or attach to) stats and striped locks of map entries.  Map
+ * itself lives outside of shared memory, see ptrackMapInit().  Must be
+ * called with AddinShmemInitLock held.
+ */
+void
+ptrackMapShmemInit(void)
+{
+	bool		found;
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+	int			i;
+#endif
+
+	ptrack_map_stats = ShmemInitStruct("ptrack map stats",
+									   sizeof(PtrackMapStats), &found);
+
+	/* Postmaster has already initialized the map */
+	if (!found)
+		*ptrack_map_stats = ptrack_map_init_stats;
+
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+	ptrack_map_locks = ShmemInitStruct("ptrack map locks",
+									   ptrackMapShmemSize(), &found);
+
+	if (!found)
+	{
+		for (i = 0; i < PTRACK_MAP_NLOCKS; i++)
+			SpinLockInit(&ptrack_map_locks[i].lock);
+	}
+#endif
+}
+
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+/*
+ * Read LSN of the ptrack_map slot on platforms, where 8-byte reads may be
+ * torn by concurrent writes.
+ */
+XLogRecPtr
+ptrack_map_entry_read_locked(size_t slot)
+{
+	volatile slock_t *lock;
+	XLogRecPtr	lsn;
+
+	if (ptrack_map_locks == NULL)
+		return ptrack_map->entries[slot];
+
+	lock = &ptrack_map_locks[slot % PTRACK_MAP_NLOCKS].lock;
+
+	SpinLockAcquire(lock);
+	lsn = ((volatile uint64 *) ptrack_map->entries)[slot];
+	SpinLockRelease(lock);
+
+	return lsn;
+}
+#endif
+
+/*
+ * Get stats of ptrack_map memory.  Number of its pages resident in memory
+ * is -1, if it cannot be determined.
+ */
+void
+ptrack_map_get_stats(PtrackMapStats * stats, int64 *npages, int64 *nresident)
+{
+	long		pagesize;
+
+#ifndef WIN32
+	pagesize = sysconf(_SC_PAGESIZE);
+#else
+	{
+		SYSTEM_INFO sysinfo;
+
+		GetSystemInfo(&sysinfo);
+		pagesize = sysinfo.dwPageSize;
+	}
+#endif
 
-		ptrack_map = (PtrackMap) MapViewOfFile(mh, FILE_MAP_ALL_ACCESS, 0, 0, 0);
-		if (ptrack_map == NULL)
+	*stats = *ptrack_map_stats;
+	*npages = (PtrackActualSize + pagesize - 1) / pagesize;
+	*nresident = -1;
+
+#if !defined(WIN32) && (defined(__linux__) || defined(__FreeBSD__) || defined(__APPLE__))
+	{
+		/* Check residency in pieces to keep the vector small */
+		int64		piece = 64 * 1024;
+		unsigned char *vec = palloc(piece);
+		int64		i;
+
+		*nresident = 0;
+		for (i = 0; i < *npages; i += piece)
 		{
-			CloseHandle(mh);
-			elog(ERROR, "ptrack attach: failed to mmap ptrack file: %m");
+			int64		n = Min(piece, *npages - i);
+			int64		j;
+
+			if (mincore((char *) ptrack_map + i * pagesize,
+						Min((uint64) n * pagesize, PtrackActualSize - i * pagesize),
+						(void *) vec) != 0)
+			{
+				*nresident = -1;
+				break;
+			}
+
+			for (j = 0; j < n; j++)
+				*nresident += vec[j] & 1;
 		}
+
+		pfree(vec);
 	}
-#else
-	ptrack_map = (PtrackMap) mmap(NULL, PtrackActualSize,
-								  PROT_READ | PROT_WRITE, MAP_SHARED,
-								  ptrack_fd, 0);
-	if (ptrack_map == MAP_FAILED)
-		elog(ERROR, "ptrack attach: failed to mmap ptrack file: %m");
 #endif
 }
 
@@ -330,26 +1098,25 @@ ptrackMapAttach(void)
 void
 ptrackCheckpoint(void)
 {
-	int			ptrack_tmp_fd;
-	pg_crc32c	crc;
+	PtrackMapWriter writer;
+	PtrackMapFileHdr hdr;
 	char		ptrack_path[MAXPGPATH];
 	char		ptrack_path_tmp[MAXPGPATH];
 	XLogRecPtr	init_lsn;
-	pg_atomic_uint64 buf[PTRACK_BUF_SIZE];
-	struct stat stat_buf;
+	uint64	   *buf;
+	char	   *rawbuf;
+	char	   *empty_chunk = NULL;
+	size_t		empty_chunk_size = 0;
+	uint64		nentries;
 	uint64		i = 0;
-	uint64		j = 0;
+	uint64		written = 0;
+	PtrackHotEntry *hot;
+	uint64		nhot;
+	uint64		k = 0;
+	PtrackWalMap *walmap;
 
 	elog(DEBUG1, "ptrack checkpoint");
 
-	/*
-	 * Set the buffer to all zeros for sanity.  Otherwise, if atomics
-	 * simulation via spinlocks is used (e.g. with --disable-atomics) we could
-	 * write garbage into the sema field of pg_atomic_uint64, which will cause
-	 * spinlocks to stuck after restart.
-	 */
-	MemSet(buf, 0, sizeof(buf));
-
 	/* Delete ptrack_map and all related files, if ptrack was switched off */
 	if (ptrack_map_size == 0)
 	{
@@ -364,26 +1131,31 @@ ptrackCheckpoint(void)
 
 	elog(DEBUG1, "ptrack checkpoint: started");
 
-	/* Map content is protected with CRC */
-	INIT_CRC32C(crc);
+	/* Marks made from now on go to the next epoch of the coarse index */
+	ptrack_coarse_checkpoint();
 
-	ptrack_tmp_fd = BasicOpenFile(ptrack_path_tmp,
-								  O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY);
+	/* Changes replayed by deferred standby are going to be in the map */
+	ptrack_standby_checkpoint();
 
-	if (ptrack_tmp_fd < 0)
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("ptrack checkpoint: could not create file \"%s\": %m", ptrack_path_tmp)));
+	/* Marks of relations synced without WAL are going to be in the map */
+	ptrack_skipwal_checkpoint_begin();
 
 	/*
-	 * We are writing ptrack map values to file, but we want to simply map it
-	 * into the memory with mmap after a crash/restart. That way, we have to
-	 * write values taking into account all paddings/allignments.
-	 *
-	 * Write both magic and varsion_num at once.
+	 * Blocks of hot segments are not marked in the hashed map, so collect
+	 * them to merge into the on-disk copy.  After restart they are tracked
+	 * by the hashed map until promoted again.
 	 */
-	ptrack_write_chunk(ptrack_tmp_fd, &crc, (char *) &ptrack_map->magic,
-					   offsetof(PtrackMapHdr, init_lsn));
+	ptrack_hot_checkpoint();
+	hot = ptrack_hot_collect(&nhot);
+
+	writer.fd = BasicOpenFile(ptrack_path_tmp,
+							  O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY);
+	writer.len = 0;
+
+	if (writer.fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not create file \"%s\": %m", ptrack_path_tmp)));
 
 	init_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
 
@@ -401,79 +1173,125 @@ ptrackCheckpoint(void)
 		init_lsn = new_init_lsn;
 	}
 
-	/* Put init_lsn in the same buffer */
-	buf[j].value = init_lsn;
-	j++;
+	/*
+	 * Let cluster restored from a base backup containing this file check,
+	 * whether it can trust the map, see ptrack_map_is_valid().  We are the
+	 * only writer of these fields.
+	 */
+	ptrack_map->system_identifier = GetSystemIdentifier();
+	ptrack_map->redo_lsn = GetRedoRecPtr();
+
+	nentries = PtrackContentNblocks;
+
+	MemSet(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PTRACK_FILE_MAGIC_CURRENT, sizeof(PTRACK_FILE_MAGIC));
+	hdr.version_num = ptrack_map->version_num;
+	hdr.system_identifier = ptrack_map->system_identifier;
+	hdr.redo_lsn = ptrack_map->redo_lsn;
+	hdr.init_lsn = init_lsn;
+	hdr.nentries = nentries;
+	hdr.chunk_entries = PTRACK_BUF_SIZE;
+
+	INIT_CRC32C(hdr.crc);
+	COMP_CRC32C(hdr.crc, (char *) &hdr, offsetof(PtrackMapFileHdr, crc));
+	FIN_CRC32C(hdr.crc);
+
+	writer.buf = palloc(PTRACK_IO_BUF_SIZE);
+	buf = palloc(PTRACK_BUF_SIZE * sizeof(uint64));
+	rawbuf = palloc(PTRACK_BUF_SIZE * PTRACK_VARINT_MAX_SIZE);
+
+	ptrack_write_chunk(&writer, (char *) &hdr, sizeof(hdr));
+
+	/* Standbys receive the same content, see walmap.c */
+	walmap = ptrack_walmap_begin(init_lsn);
 
 	/*
-	 * Iterate over ptrack map actual content and sync it to file.  It's
+	 * Iterate over ptrack map actual content and sync it to file chunk by
+	 * chunk.  Each entry is read exactly once straight from the mapped region,
+	 * merged with hot entries and fed to walmap in the same pass.  It's
 	 * essential to read each element atomically to avoid partial reads, since
-	 * map can be updated concurrently without any lock.
+	 * map can be updated concurrently without any lock, but on platforms with
+	 * single-copy 8-byte atomicity ptrack_map_entry_read() is a plain aligned
+	 * load.  Chunks are then encoded right into the write buffer, see
+	 * ptrack_chunk_encode().
 	 */
-	while (i < PtrackContentNblocks)
+	while (i < nentries)
 	{
-		XLogRecPtr	lsn;
+		uint32		n = Min(PTRACK_BUF_SIZE, nentries - i);
+		XLogRecPtr	base = PG_UINT64_MAX;
+		size_t		size;
+		uint32		j;
 
-		/*
-		 * We store LSN values as pg_atomic_uint64 in the ptrack map, but
-		 * pg_atomic_read_u64() returns uint64.  That way, we have to put this
-		 * lsn into the buffer array of pg_atomic_uint64's.  We are the only
-		 * one who write into this buffer, so we do it without locks.
-		 *
-		 * TODO: is it safe and can we do any better?
-		 */
-		lsn = pg_atomic_read_u64(&ptrack_map->entries[i]);
-		buf[j].value = lsn;
+		for (j = 0; j < n; j++)
+		{
+			XLogRecPtr	lsn = ptrack_map_entry_read(i + j);
 
-		i++;
-		j++;
+			/* Both are sorted by slot, so merge them in the same pass */
+			while (k < nhot && hot[k].slot == i + j)
+			{
+				lsn = Max(lsn, hot[k].lsn);
+				k++;
+			}
 
-		if (j == PTRACK_BUF_SIZE)
-		{
-			size_t		writesz = sizeof(buf); /* Up to ~2 GB for buffer size seems
-												* to be more than enough, so never
-												* going to overflow. */
+			buf[j] = lsn;
+			if (lsn != InvalidXLogRecPtr && lsn < base)
+				base = lsn;
+
+			if (walmap != NULL)
+				ptrack_walmap_add(walmap, i + j, lsn);
+		}
+
+		/* Chunk without any changes */
+		if (base == PG_UINT64_MAX)
+			base = InvalidXLogRecPtr;
 
+		if (base == InvalidXLogRecPtr && n == PTRACK_BUF_SIZE)
+		{
 			/*
-			 * We should not have any allignment issues here, since sizeof()
-			 * takes into account all paddings for us.
+			 * Full chunks without any changes, which dominate sparse maps, are
+			 * all the same, so encode and checksum such a chunk only once.
 			 */
-			ptrack_write_chunk(ptrack_tmp_fd, &crc, (char *) buf, writesz);
-			elog(DEBUG5, "ptrack checkpoint: i " UINT64_FORMAT ", j " UINT64_FORMAT ", writesz %zu PtrackContentNblocks " UINT64_FORMAT,
-				 i, j, writesz, (uint64) PtrackContentNblocks);
-
-			j = 0;
+			if (empty_chunk == NULL)
+			{
+				empty_chunk = palloc(PTRACK_CHUNK_MAX_SIZE);
+				empty_chunk_size = ptrack_chunk_encode(buf, n, base, rawbuf,
+													   empty_chunk);
+			}
+
+			size = empty_chunk_size;
+			ptrack_write_chunk(&writer, empty_chunk, size);
 		}
-	}
+		else
+		{
+			char	   *dst = ptrack_write_reserve(&writer, PTRACK_CHUNK_MAX_SIZE);
 
-	/* Write if anythig left */
-	if ((i + 1) % PTRACK_BUF_SIZE != 0)
-	{
-		size_t		writesz = sizeof(pg_atomic_uint64) * j;
+			size = ptrack_chunk_encode(buf, n, base, rawbuf, dst);
+			writer.len += size;
+		}
 
-		ptrack_write_chunk(ptrack_tmp_fd, &crc, (char *) buf, writesz);
-		elog(DEBUG5, "ptrack checkpoint: final i " UINT64_FORMAT ", j " UINT64_FORMAT ", writesz %zu PtrackContentNblocks " UINT64_FORMAT,
-			 i, j, writesz, (uint64) PtrackContentNblocks);
+		written += size;
+		i += n;
 	}
 
-	FIN_CRC32C(crc);
+	ptrack_write_flush(&writer);
 
-	if (write(ptrack_tmp_fd, &crc, sizeof(crc)) != sizeof(crc))
-	{
-		/* If write didn't set errno, assume problem is no disk space */
-		if (errno == 0)
-			errno = ENOSPC;
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("ptrack checkpoint: could not write file \"%s\": %m", ptrack_path_tmp)));
-	}
+	if (walmap != NULL)
+		ptrack_walmap_end(walmap);
+
+	pfree(writer.buf);
+	pfree(buf);
+	pfree(rawbuf);
+	if (empty_chunk != NULL)
+		pfree(empty_chunk);
+	if (hot != NULL)
+		pfree(hot);
 
-	if (pg_fsync(ptrack_tmp_fd) != 0)
+	if (pg_fsync(writer.fd) != 0)
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				 errmsg("ptrack checkpoint: could not fsync file \"%s\": %m", ptrack_path_tmp)));
 
-	if (close(ptrack_tmp_fd) != 0)
+	if (close(writer.fd) != 0)
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				 errmsg("ptrack checkpoint: could not close file \"%s\": %m", ptrack_path_tmp)));
@@ -481,14 +1299,13 @@ ptrackCheckpoint(void)
 	/* And finally replace old file with the new one */
 	durable_rename(ptrack_path_tmp, ptrack_path, ERROR);
 
-	/* Sanity check */
-	if (stat(ptrack_path, &stat_buf) == 0 &&
-		stat_buf.st_size != PtrackActualSize)
-	{
-		elog(ERROR, "ptrack checkpoint: stat_buf.st_size != ptrack_map_size %zu != " UINT64_FORMAT,
-			 (Size) stat_buf.st_size, PtrackActualSize);
-	}
-	elog(DEBUG1, "ptrack checkpoint: completed");
+	ptrack_skipwal_checkpoint_end();
+
+	/* Retain it for queries of changes between two LSNs, if requested */
+	ptrack_snapshot_checkpoint(ptrack_path, ptrack_map->redo_lsn);
+
+	elog(DEBUG1, "ptrack checkpoint: completed, " UINT64_FORMAT " bytes of " UINT64_FORMAT " written",
+		 (uint64) (sizeof(hdr) + written), (uint64) PtrackActualSize);
 }
 
 void
@@ -514,11 +1331,6 @@ assign_ptrack_map_size(int newval, void *extra)
 		return;
 	}
 
-	if (newval != 0 && !XLogIsNeeded())
-		ereport(ERROR,
-				(errmsg("assign_ptrack_map_size: cannot use ptrack if wal_level is minimal"),
-				 errdetail("Set wal_level to \"replica\" or higher, or turn off ptrack with \"ptrack.map_size=0\"")));
-
 	if (DataDir != NULL &&
 		!IsBootstrapProcessingMode() &&
 		!InitializingParallelWorker)
@@ -584,6 +1396,155 @@ ptrack_mark_file(Oid dbOid, Oid tablespaceOid,
 		ptrack_mark_block(rnode, forknum, blkno);
 }
 
+/*
+ * Open directory for reading with ptrack_readdir().  Like AllocateDir(),
+ * it does not fail, errors are reported by ptrack_readdir() instead.
+ */
+PtrackDir *
+ptrack_opendir(const char *path)
+{
+	PtrackDir  *dir = (PtrackDir *) palloc0(sizeof(PtrackDir));
+
+	dir->path = pstrdup(path);
+
+#ifdef PTRACK_USE_GETDENTS
+	dir->fd = OpenTransientFile(path, O_RDONLY | O_DIRECTORY | PG_BINARY);
+	dir->open_errno = errno;
+	if (dir->fd >= 0)
+		dir->buf = palloc(PTRACK_DIR_BUF_SIZE);
+#else
+	dir->dir = AllocateDir(path);
+#endif
+
+	return dir;
+}
+
+/*
+ * Return name of the next entry of directory (except "." and "..") or NULL
+ * if there are no more entries or an error occured, which is reported with
+ * 'elevel'.  Type of entry is taken from the directory itself whenever
+ * filesystem provides it, so most entries do not need lstat() at all.
+ * Otherwise, lstat() error is reported with 'elevel' and type is set to
+ * PTRACK_DIRENT_ERROR.
+ */
+const char *
+ptrack_readdir(PtrackDir * dir, PtrackDirentType * type, int elevel)
+{
+	const char *name;
+	int			d_type;
+	struct stat fst;
+
+	for (;;)
+	{
+#ifdef PTRACK_USE_GETDENTS
+		struct ptrack_dirent64 *de;
+
+		if (dir->fd < 0)
+		{
+			errno = dir->open_errno;
+			ereport(elevel,
+					(errcode_for_file_access(),
+					 errmsg("could not open directory \"%s\": %m", dir->path)));
+			return NULL;
+		}
+
+		if (dir->pos >= dir->len)
+		{
+			dir->len = syscall(SYS_getdents64, dir->fd, dir->buf, PTRACK_DIR_BUF_SIZE);
+			ptrack_scan_charge(PTRACK_SCAN_COST_STAT);
+
+			if (dir->len < 0)
+			{
+				ereport(elevel,
+						(errcode_for_file_access(),
+						 errmsg("could not read directory \"%s\": %m", dir->path)));
+				return NULL;
+			}
+			else if (dir->len == 0)
+				return NULL;
+
+			dir->pos = 0;
+		}
+
+		de = (struct ptrack_dirent64 *) (dir->buf + dir->pos);
+		dir->pos += de->d_reclen;
+		name = de->d_name;
+		d_type = de->d_type;
+#else
+		struct dirent *de = ReadDirExtended(dir->dir, dir->path, elevel);
+
+		if (de == NULL)
+			return NULL;
+
+		name = de->d_name;
+#if defined(DT_UNKNOWN) && !defined(WIN32)
+		d_type = de->d_type;
+#else
+		d_type = -1;
+#endif
+#endif							/* PTRACK_USE_GETDENTS */
+
+		if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+			break;
+	}
+
+	snprintf(dir->subpath, sizeof(dir->subpath), "%s/%s", dir->path, name);
+
+#if defined(DT_UNKNOWN) && !defined(WIN32)
+	if (d_type == DT_REG)
+		*type = PTRACK_DIRENT_REG;
+	else if (d_type == DT_DIR)
+		*type = PTRACK_DIRENT_DIR;
+	else if (d_type == DT_LNK)
+		*type = PTRACK_DIRENT_LNK;
+	else if (d_type != DT_UNKNOWN && d_type != -1)
+		*type = PTRACK_DIRENT_OTHER;
+	else
+#endif
+	{
+		ptrack_scan_charge(PTRACK_SCAN_COST_STAT);
+
+		if (lstat(dir->subpath, &fst) < 0)
+		{
+			ereport(elevel,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", dir->subpath)));
+			*type = PTRACK_DIRENT_ERROR;
+		}
+		else if (S_ISREG(fst.st_mode))
+			*type = PTRACK_DIRENT_REG;
+		else if (S_ISDIR(fst.st_mode))
+			*type = PTRACK_DIRENT_DIR;
+		/* TODO: is it enough to properly check symlink support? */
+#ifndef WIN32
+		else if (S_ISLNK(fst.st_mode))
+#else
+		else if (pgwin32_is_junction(dir->subpath))
+#endif
+			*type = PTRACK_DIRENT_LNK;
+		else
+			*type = PTRACK_DIRENT_OTHER;
+	}
+
+	return name;
+}
+
+void
+ptrack_closedir(PtrackDir * dir)
+{
+#ifdef PTRACK_USE_GETDENTS
+	if (dir->fd >= 0)
+	{
+		CloseTransientFile(dir->fd);
+		pfree(dir->buf);
+	}
+#else
+	FreeDir(dir->dir);			/* we ignore any error here */
+#endif
+	pfree(dir->path);
+	pfree(dir);
+}
+
 /*
  * Mark all files in the given directory in ptrack_map.
  * For use in functions that copy directories bypassing buffer manager.
@@ -591,8 +1552,9 @@ ptrack_mark_file(Oid dbOid, Oid tablespaceOid,
 void
 ptrack_walkdir(const char *path, Oid tablespaceOid, Oid dbOid)
 {
-	DIR		   *dir;
-	struct dirent *de;
+	PtrackDir  *dir;
+	const char *name;
+	PtrackDirentType type;
 
 	/* Do not walk during bootstrap and if ptrack is disabled */
 	if (ptrack_map_size == 0
@@ -601,88 +1563,301 @@ ptrack_walkdir(const char *path, Oid tablespaceOid, Oid dbOid)
 		|| InitializingParallelWorker)
 		return;
 
-	dir = AllocateDir(path);
+	dir = ptrack_opendir(path);
 
-	while ((de = ReadDirExtended(dir, path, LOG)) != NULL)
+	while ((name = ptrack_readdir(dir, &type, LOG)) != NULL)
 	{
 		char		subpath[MAXPGPATH * 2];
-		struct stat fst;
-		int			sret;
 
 		CHECK_FOR_INTERRUPTS();
 
-		if (strcmp(de->d_name, ".") == 0 ||
-			strcmp(de->d_name, "..") == 0)
+		if (type != PTRACK_DIRENT_REG)
 			continue;
 
-		snprintf(subpath, sizeof(subpath), "%s/%s", path, de->d_name);
+		snprintf(subpath, sizeof(subpath), "%s/%s", path, name);
+		ptrack_mark_file(dbOid, tablespaceOid, subpath, name);
+	}
+
+	ptrack_closedir(dir);
+}
 
-		sret = lstat(subpath, &fst);
+/*
+ * Set init_lsn of the map to 'new_lsn' if it is not set yet and return
+ * the resulting value.
+ */
+XLogRecPtr
+ptrack_set_init_lsn(XLogRecPtr new_lsn)
+{
+	/* See ptrack_mark_block() for why we use pg_atomic_uint64 here */
+	pg_atomic_uint64	old_init_lsn;
 
-		if (sret < 0)
-		{
-			ereport(LOG,
-					(errcode_for_file_access(),
-					 errmsg("ptrack_walkdir: could not stat file \"%s\": %m", subpath)));
-			continue;
-		}
+	old_init_lsn.value = ptrack_read_init_lsn();
+
+	if (old_init_lsn.value == InvalidXLogRecPtr)
+	{
+		elog(DEBUG1, "ptrack_set_init_lsn: init_lsn " UINT64_FORMAT " <- " UINT64_FORMAT, old_init_lsn.value, new_lsn);
+
+		while (old_init_lsn.value < new_lsn &&
+			   !pg_atomic_compare_exchange_u64(&ptrack_map->init_lsn, (uint64 *) &old_init_lsn.value, new_lsn));
 
-		if (S_ISREG(fst.st_mode))
-			ptrack_mark_file(dbOid, tablespaceOid, subpath, de->d_name);
+		/* Somebody else could set it concurrently, so re-read */
+		old_init_lsn.value = pg_atomic_read_u64(&ptrack_map->init_lsn);
 	}
 
-	FreeDir(dir);				/* we ignore any error here */
+	return old_init_lsn.value;
 }
 
 /*
- * Mark modified block in ptrack_map.
+ * Error out if map cannot tell which blocks were changed since 'lsn', i.e.
+ * it was not initialized yet or was reinitialized after 'lsn'.  'hint', if
+ * not NULL, tells the caller how to proceed.
  */
 void
-ptrack_mark_block(RelFileNodeBackend smgr_rnode,
-				  ForkNumber forknum, BlockNumber blocknum)
+ptrack_check_start_lsn(XLogRecPtr lsn, const char *hint)
 {
-	size_t		hash;
-	XLogRecPtr	new_lsn;
-	PtBlockId	bid;
+	XLogRecPtr	init_lsn;
+
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	init_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
+	if (init_lsn == InvalidXLogRecPtr || lsn < init_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("LSN %X/%X precedes ptrack init LSN %X/%X",
+						(uint32) (lsn >> 32), (uint32) lsn,
+						(uint32) (init_lsn >> 32), (uint32) init_lsn),
+				 hint ? errhint("%s", hint) : 0));
+}
+
+/*
+ * Atomically move LSN of the ptrack_map slot forward to 'new_lsn'.
+ */
+void
+ptrack_map_advance(size_t slot, XLogRecPtr new_lsn)
+{
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+	volatile uint64 *entry = &ptrack_map->entries[slot];
+	volatile slock_t *lock;
+
+	/* Entries only grow, so most marks of hot blocks stop here */
+	if (ptrack_map_entry_read(slot) >= new_lsn)
+		return;
+
+	/* Postmaster replays journals alone, before shared memory is created */
+	if (ptrack_map_locks == NULL)
+		*entry = new_lsn;
+	else
+	{
+		lock = &ptrack_map_locks[slot % PTRACK_MAP_NLOCKS].lock;
+
+		SpinLockAcquire(lock);
+		if (*entry < new_lsn)
+			*entry = new_lsn;
+		SpinLockRelease(lock);
+	}
+#else
+
 	/*
 	 * We use pg_atomic_uint64 here only for alignment purposes, because
 	 * pg_atomic_uint64 is forcely aligned on 8 bytes during the MSVC build.
 	 */
 	pg_atomic_uint64	old_lsn;
-	pg_atomic_uint64	old_init_lsn;
+
+	old_lsn.value = pg_atomic_read_u64(&ptrack_map->entries[slot]);
+
+	elog(DEBUG3, "ptrack_map_advance: map[%zu]=" UINT64_FORMAT " <- " UINT64_FORMAT, slot, old_lsn.value, new_lsn);
+
+	while (old_lsn.value < new_lsn &&
+		   !pg_atomic_compare_exchange_u64(&ptrack_map->entries[slot], (uint64 *) &old_lsn.value, new_lsn));
+	elog(DEBUG3, "ptrack_map_advance: map[%zu]=" UINT64_FORMAT, slot, pg_atomic_read_u64(&ptrack_map->entries[slot]));
+#endif
+
+	ptrack_coarse_mark(slot, new_lsn);
+}
+
+/*
+ * Mark modified block in ptrack_map.
+ */
+void
+ptrack_mark_block(RelFileNodeBackend smgr_rnode,
+				  ForkNumber forknum, BlockNumber blocknum)
+{
+	XLogRecPtr	new_lsn;
 
 	if (ptrack_map_size != 0 && (ptrack_map != NULL) &&
 		smgr_rnode.backend == InvalidBackendId) /* do not track temporary
 												 * relations */
 	{
-		bid.relnode = smgr_rnode.node;
-		bid.forknum = forknum;
-		bid.blocknum = blocknum;
-		hash = BID_HASH_FUNC(bid);
-
 		if (RecoveryInProgress())
 			new_lsn = GetXLogReplayRecPtr(NULL);
 		else
 			new_lsn = GetXLogInsertRecPtr();
 
-		old_lsn.value = pg_atomic_read_u64(&ptrack_map->entries[hash]);
-
 		/* Atomically assign new init LSN value */
-		old_init_lsn.value = pg_atomic_read_u64(&ptrack_map->init_lsn);
+		ptrack_set_init_lsn(new_lsn);
+
+		ptrack_mark_block_at(smgr_rnode.node, forknum, blocknum, new_lsn);
+	}
+}
+
+/*
+ * Mark block changed at 'new_lsn' in ptrack_map.  Used directly by the
+ * summary of replayed WAL, which knows LSNs of changes, see standby.c.
+ */
+void
+ptrack_mark_block_at(RelFileNode rnode, ForkNumber forknum,
+					 BlockNumber blocknum, XLogRecPtr new_lsn)
+{
+	PtBlockId	bid;
+
+	bid.relnode = rnode;
+	bid.forknum = forknum;
+	bid.blocknum = blocknum;
+
+	if (unlikely(ptrack_trace_active))
+		ptrack_trace_mark(bid, new_lsn);
+
+	/* Blocks of hot segments are tracked exactly outside of the map */
+	if (ptrack_hot_mark(rnode, forknum, blocknum, new_lsn))
+		return;
+
+	ptrack_map_advance(BID_HASH_FUNC(bid), new_lsn);
+}
+
+/*
+ * Start lookup of changes since 'start_lsn' in the relation segment,
+ * which contains block 'bid'.  All lookups of the segment must go through
+ * ptrack_segscan_get() until ptrack_segscan_end() is called, since exact
+ * map of hot segment stays pinned in between.
+ */
+void
+ptrack_segscan_begin(PtSegScan * scan, PtBlockId bid, XLogRecPtr start_lsn)
+{
+	XLogRecPtr	promoted_lsn = InvalidXLogRecPtr;
+
+	scan->bid = bid;
+	scan->hot_slot = ptrack_hot_lookup_begin(bid.relnode, bid.forknum,
+											 bid.blocknum / RELSEG_SIZE,
+											 &promoted_lsn);
+
+	/*
+	 * Marks of hot segment made after promoted_lsn are only in its exact map,
+	 * but earlier ones are still in the hashed map.
+	 */
+	scan->use_map = (scan->hot_slot < 0 || start_lsn <= promoted_lsn);
+
+	if (ptrack_map_layout == PTRACK_LAYOUT_SEGMENT)
+		scan->seg_slot = ptrack_segment_slot(bid);
+
+	scan->coarse_epoch = ptrack_coarse_max_epoch(start_lsn);
+	scan->pending_lsn = ptrack_standby_pending_lsn();
+}
+
+/*
+ * Return LSN of the last change of the block 'blocknum' of the segment.
+ * It is never less than the actual LSN, but may be greater.  Blocks, which
+ * are known to be unchanged since the start LSN of the scan, may return
+ * InvalidXLogRecPtr without reading the map, see coarse.c.  While replayed
+ * WAL is not summarized into the map yet, all blocks are reported as
+ * changed, see standby.c.
+ */
+XLogRecPtr
+ptrack_segscan_get(PtSegScan * scan, BlockNumber blocknum)
+{
+	XLogRecPtr	update_lsn = InvalidXLogRecPtr;
+
+	if (scan->use_map && ptrack_map_layout == PTRACK_LAYOUT_SEGMENT)
+	{
+		/* Blocks of the segment are read sequentially without hashing */
+		size_t		slot = (scan->seg_slot + blocknum % RELSEG_SIZE) % PtrackContentNblocks;
+
+		if (!ptrack_coarse_skip(slot, scan->coarse_epoch))
+		{
+			update_lsn = ptrack_map_entry_read(slot);
+
+			if (blocknum % (PG_CACHE_LINE_SIZE / sizeof(PtrackMapEntry)) == 0)
+				ptrack_scan_charge(PTRACK_SCAN_COST_MAP);
+		}
+	}
+	else if (scan->use_map)
+	{
+		size_t		slot;
 
-		if (old_init_lsn.value == InvalidXLogRecPtr)
+		scan->bid.blocknum = blocknum;
+		slot = BID_HASH_FUNC(scan->bid);
+
+		if (!ptrack_coarse_skip(slot, scan->coarse_epoch))
 		{
-			elog(DEBUG1, "ptrack_mark_block: init_lsn " UINT64_FORMAT " <- " UINT64_FORMAT, old_init_lsn.value, new_lsn);
+			update_lsn = ptrack_map_entry_read(slot);
 
-			while (old_init_lsn.value < new_lsn &&
-				   !pg_atomic_compare_exchange_u64(&ptrack_map->init_lsn, (uint64 *) &old_init_lsn.value, new_lsn));
+			/* Hashed map is accessed randomly, so every lookup is a cache line */
+			ptrack_scan_charge(PTRACK_SCAN_COST_MAP);
 		}
+	}
+
+	if (scan->hot_slot >= 0)
+	{
+		PtrackHotSegment *seg = &ptrack_hot->segments[scan->hot_slot];
+		uint32		epoch = pg_atomic_read_u32(&seg->epochs[blocknum % RELSEG_SIZE]);
+
+		update_lsn = Max(update_lsn, ptrack_hot_epoch_to_lsn(epoch));
+
+		if (blocknum % (PG_CACHE_LINE_SIZE / sizeof(pg_atomic_uint32)) == 0)
+			ptrack_scan_charge(PTRACK_SCAN_COST_MAP);
+	}
+	else
+	{
+		/*
+		 * Do not sleep while exact map of hot segment is pinned, since it
+		 * would block its demotion.  We will sleep in ptrack_segscan_end().
+		 */
+		ptrack_scan_delay_point();
+	}
+
+	if (unlikely(scan->pending_lsn != InvalidXLogRecPtr))
+		update_lsn = Max(update_lsn, scan->pending_lsn);
+
+	return update_lsn;
+}
+
+/*
+ * Finish lookup of the segment started by ptrack_segscan_begin().
+ */
+void
+ptrack_segscan_end(PtSegScan * scan)
+{
+	ptrack_hot_lookup_end(scan->hot_slot);
+	scan->hot_slot = -1;
+
+	ptrack_scan_delay_point();
+}
+
+/*
+ * Sleep for a while if accumulated cost of the scan exceeded
+ * ptrack.scan_cost_limit, the same way as vacuum_delay_point() does.
+ * Lets backups scan ptrack map and PGDATA continuously on a busy primary
+ * with bounded impact on the foreground latency.
+ */
+void
+ptrack_scan_delay_point(void)
+{
+	CHECK_FOR_INTERRUPTS();
+
+	if (ptrack_scan_cost_delay > 0 &&
+		ptrack_scan_cost_balance >= ptrack_scan_cost_limit)
+	{
+		double		msec;
+
+		msec = ptrack_scan_cost_delay * ptrack_scan_cost_balance / ptrack_scan_cost_limit;
+		if (msec > ptrack_scan_cost_delay * 4)
+			msec = ptrack_scan_cost_delay * 4;
 
-		elog(DEBUG3, "ptrack_mark_block: map[%zu]=" UINT64_FORMAT " <- " UINT64_FORMAT, hash, old_lsn.value, new_lsn);
+		pg_usleep((long) (msec * 1000));
 
-		/* Atomically assign new LSN value */
-		while (old_lsn.value < new_lsn &&
-			   !pg_atomic_compare_exchange_u64(&ptrack_map->entries[hash], (uint64 *) &old_lsn.value, new_lsn));
-		elog(DEBUG3, "ptrack_mark_block: map[%zu]=" UINT64_FORMAT, hash, pg_atomic_read_u64(&ptrack_map->entries[hash]));
+		ptrack_scan_cost_balance = 0;
+
+		/* Might have gotten an interrupt while sleeping */
+		CHECK_FOR_INTERRUPTS();
 	}
 }
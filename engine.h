@@ -23,6 +23,8 @@
 /*  #include "utils/relcache.h" */
 #include "access/hash.h"
 
+#include "ptrack.h"
+
 
 /* Working copy of ptrack.map */
 #define PTRACK_MMAP_PATH "global/ptrack.map.mmap"
@@ -43,6 +45,36 @@
 #define PTRACK_MAGIC "ptk"
 #define PTRACK_MAGIC_SIZE 4
 
+/* Magic bytes of the compressed on-disk copy of the map */
+#define PTRACK_FILE_MAGIC "ptz"
+/* The same for the map with segment layout, see ptrack_bid_slot() */
+#define PTRACK_FILE_MAGIC_SEGMENT "pts"
+
+/* Oldest PTRACK_VERSION_NUM with the current ptrack.map file format */
+#define PTRACK_MAP_COMPAT_VERSION_NUM 220
+
+/* Maximal size of varint-encoded LSN in ptrack.map */
+#define PTRACK_VARINT_MAX_SIZE 10
+
+/* Size of the buffer for streaming reads and writes of ptrack.map */
+#define PTRACK_IO_BUF_SIZE (1024 * 1024)
+
+/*
+ * Entry of ptrack map is pg_atomic_uint64, unless 64-bit atomics are
+ * emulated (e.g. with --disable-atomics).  Emulated atomic takes a spinlock
+ * even to read it, so marking and scanning of the map would serialize on
+ * spinlocks, and it doubles the size of the entry.  Plain uint64 is used
+ * then instead.  It is only advanced under one of PTRACK_MAP_NLOCKS spinlocks
+ * striped by slot, and read without lock, where 8-byte reads are atomic.
+ */
+#ifdef PG_HAVE_ATOMIC_U64_SIMULATION
+#define PTRACK_MAP_STRIPED_LOCKS
+#define PTRACK_MAP_NLOCKS 1024
+typedef uint64 PtrackMapEntry;
+#else
+typedef pg_atomic_uint64 PtrackMapEntry;
+#endif
+
 /*
  * Header of ptrack map.
  */
@@ -59,15 +91,20 @@ typedef struct PtrackMapHdr
 	 */
 	uint32		version_num;
 
+	/* System identifier of the cluster, which wrote the map. */
+	uint64		system_identifier;
+
+	/*
+	 * Redo LSN of the checkpoint, which wrote the map to disk.  All changes
+	 * before it are guaranteed to be in the map.
+	 */
+	XLogRecPtr	redo_lsn;
+
 	/* LSN of the moment, when map was last enabled. */
 	pg_atomic_uint64 init_lsn;
 
 	/* Followed by the actual map of LSNs */
-	pg_atomic_uint64 entries[FLEXIBLE_ARRAY_MEMBER];
-
-	/*
-	 * At the end of the map CRC of type pg_crc32c is stored.
-	 */
+	PtrackMapEntry entries[FLEXIBLE_ARRAY_MEMBER];
 }			PtrackMapHdr;
 
 typedef PtrackMapHdr * PtrackMap;
@@ -75,18 +112,81 @@ typedef PtrackMapHdr * PtrackMap;
 /* TODO: check MAXALIGN usage below */
 /* Number of elements in ptrack map (LSN array)  */
 #define PtrackContentNblocks \
-		((ptrack_map_size - offsetof(PtrackMapHdr, entries) - sizeof(pg_crc32c)) / sizeof(pg_atomic_uint64))
+		((ptrack_map_size - offsetof(PtrackMapHdr, entries)) / sizeof(PtrackMapEntry))
 
 /* Actual size of the ptrack map, that we are able to fit into ptrack_map_size */
 #define PtrackActualSize \
-		(offsetof(PtrackMapHdr, entries) + PtrackContentNblocks * sizeof(pg_atomic_uint64) + sizeof(pg_crc32c))
+		(offsetof(PtrackMapHdr, entries) + PtrackContentNblocks * sizeof(PtrackMapEntry))
+
+/*
+ * Header of the on-disk copy of ptrack map.  It is followed by chunks of
+ * up to 'chunk_entries' entries each.
+ */
+typedef struct PtrackMapFileHdr
+{
+	char		magic[PTRACK_MAGIC_SIZE];
+	uint32		version_num;
+	uint64		system_identifier;
+	XLogRecPtr	redo_lsn;
+	XLogRecPtr	init_lsn;
+	uint64		nentries;
+	uint32		chunk_entries;
+	/* CRC of everything above */
+	pg_crc32c	crc;
+}			PtrackMapFileHdr;
+
+/*
+ * Header of a chunk of the on-disk map.  Every entry is stored as a varint
+ * of its delta against 'base' (the smallest non-zero LSN of the chunk) plus
+ * one, or zero for unset entries.  LSNs of a chunk share long high-order
+ * prefixes, so most of them take 1-4 bytes.  The result is then compressed
+ * with pglz, unless it turns out incompressible.
+ */
+typedef struct PtrackMapChunkHdr
+{
+	uint32		nentries;
+	/* Size of varint-encoded entries */
+	uint32		rawsize;
+	/* Size of compressed entries or 0, if they are stored as is */
+	uint32		compsize;
+	XLogRecPtr	base;
+	/* CRC of this header (up to crc) and the data following it */
+	pg_crc32c	crc;
+}			PtrackMapChunkHdr;
+
+/*
+ * Costs of ptrack scan operations, which are accumulated in
+ * ptrack_scan_cost_balance, see ptrack_scan_delay_point().  Single stat()
+ * or directory entry read is charged as much as a number of map cache
+ * lines, since it may require a synchronous disk or network round-trip.
+ */
+#define PTRACK_SCAN_COST_STAT 10
+#define PTRACK_SCAN_COST_MAP 1
+
+/*
+ * Size of the buffer for directory entries read at once by ptrack_readdir().
+ * Large buffer saves round-trips on network filesystems for directories
+ * with hundreds of thousands of relation files.
+ */
+#define PTRACK_DIR_BUF_SIZE (256 * 1024)
+
+/*
+ * Type of directory entry returned by ptrack_readdir().
+ */
+typedef enum PtrackDirentType
+{
+	PTRACK_DIRENT_ERROR,
+	PTRACK_DIRENT_REG,
+	PTRACK_DIRENT_DIR,
+	PTRACK_DIRENT_LNK,
+	PTRACK_DIRENT_OTHER
+}			PtrackDirentType;
 
-/* CRC32 value offset in order to directly access it in the mmap'ed memory chunk */
-#define PtrackCrcOffset (PtrackActualSize - sizeof(pg_crc32c))
+/* Directory iterator, see ptrack_opendir() */
+typedef struct PtrackDir PtrackDir;
 
 /* Map block address 'bid' to map slot */
-#define BID_HASH_FUNC(bid) \
-		(size_t)(DatumGetUInt64(hash_any_extended((unsigned char *)&bid, sizeof(bid), 0)) % PtrackContentNblocks)
+#define BID_HASH_FUNC(bid) ptrack_bid_slot(bid)
 
 /*
  * Per process pointer to shared ptrack_map
@@ -100,14 +200,198 @@ extern PtrackMap ptrack_map;
 extern uint64 ptrack_map_size;
 extern int	ptrack_map_size_tmp;
 
+/*
+ * Values of ptrack.mark_mode.  With PTRACK_MARK_DIRTY blocks of shared
+ * buffers are marked by MarkBufferDirty_hook on the first modification since
+ * the last write, so their writes are not marked.  Writes bypassing shared
+ * buffers are marked as usual.
+ */
+typedef enum PtrackMarkMode
+{
+	PTRACK_MARK_WRITE,
+	PTRACK_MARK_DIRTY
+}			PtrackMarkMode;
+
+extern int	ptrack_mark_mode;
+
+/*
+ * Values of ptrack.map_layout.  With PTRACK_LAYOUT_HASHED every block is
+ * hashed to its own slot.  With PTRACK_LAYOUT_SEGMENT only relation segment
+ * is hashed to the slot of its first block and the following blocks take
+ * the following slots, wrapping around the end of the map.  Scan of a
+ * segment then reads the map sequentially and sequential writes mark
+ * adjacent slots, but the whole segments collide with each other.
+ */
+typedef enum PtrackMapLayout
+{
+	PTRACK_LAYOUT_HASHED,
+	PTRACK_LAYOUT_SEGMENT
+}			PtrackMapLayout;
+
+extern int	ptrack_map_layout;
+
+/* Magic bytes of the on-disk copy of the map with the current layout */
+#define PTRACK_FILE_MAGIC_CURRENT \
+	(ptrack_map_layout == PTRACK_LAYOUT_SEGMENT ? \
+	 PTRACK_FILE_MAGIC_SEGMENT : PTRACK_FILE_MAGIC)
+
+/*
+ * Slot of the first block of relation segment containing block 'bid' with
+ * segment layout.
+ */
+static inline size_t
+ptrack_segment_slot(PtBlockId bid)
+{
+	bid.blocknum /= RELSEG_SIZE;
+
+	return (size_t) (DatumGetUInt64(hash_any_extended((unsigned char *) &bid, sizeof(bid), 0)) %
+					 PtrackContentNblocks);
+}
+
+static inline size_t
+ptrack_bid_slot(PtBlockId bid)
+{
+	if (ptrack_map_layout == PTRACK_LAYOUT_SEGMENT)
+		return (ptrack_segment_slot(bid) + bid.blocknum % RELSEG_SIZE) %
+			PtrackContentNblocks;
+
+	return (size_t) (DatumGetUInt64(hash_any_extended((unsigned char *) &bid, sizeof(bid), 0)) %
+					 PtrackContentNblocks);
+}
+
+/*
+ * Memory stats of ptrack map.  Faults are the ones taken by postmaster to
+ * restore and prefault the map, so they are not taken on the write path.
+ */
+typedef struct PtrackMapStats
+{
+	bool		prefaulted;
+	bool		locked;
+	int64		major_faults;
+	int64		minor_faults;
+}			PtrackMapStats;
+
+extern bool ptrack_map_prefault;
+extern bool ptrack_map_lock;
+extern bool ptrack_map_random_access;
+
+extern double ptrack_scan_cost_delay;
+extern int	ptrack_scan_cost_limit;
+extern int	ptrack_scan_cost_balance;
+
+#ifdef PTRACK_MAP_STRIPED_LOCKS
+extern XLogRecPtr ptrack_map_entry_read_locked(size_t slot);
+#endif
+
+/*
+ * Read LSN of the ptrack_map slot.  Value may be stale, but never torn.
+ */
+static inline XLogRecPtr
+ptrack_map_entry_read(size_t slot)
+{
+#ifndef PTRACK_MAP_STRIPED_LOCKS
+	return pg_atomic_read_u64(&ptrack_map->entries[slot]);
+#elif defined(PG_HAVE_8BYTE_SINGLE_COPY_ATOMICITY)
+	return *((volatile uint64 *) &ptrack_map->entries[slot]);
+#else
+	return ptrack_map_entry_read_locked(slot);
+#endif
+}
+
+/*
+ * Read init_lsn of the map.  It is read by every mark, but changed rarely,
+ * so emulated atomic is read without its spinlock, where possible.
+ */
+static inline XLogRecPtr
+ptrack_read_init_lsn(void)
+{
+#if defined(PG_HAVE_ATOMIC_U64_SIMULATION) && defined(PG_HAVE_8BYTE_SINGLE_COPY_ATOMICITY)
+	return ((volatile pg_atomic_uint64 *) &ptrack_map->init_lsn)->value;
+#else
+	return pg_atomic_read_u64(&ptrack_map->init_lsn);
+#endif
+}
+
+/* Charge ptrack scan for 'cost', if cost-based delay is enabled */
+static inline void
+ptrack_scan_charge(int cost)
+{
+	if (ptrack_scan_cost_delay > 0)
+		ptrack_scan_cost_balance += cost;
+}
+
+/*
+ * Append 'value' to 'buf' as a varint and return number of bytes written.
+ */
+static inline int
+ptrack_varint_encode(char *buf, uint64 value)
+{
+	int			len = 0;
+
+	while (value >= 0x80)
+	{
+		buf[len++] = (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = (char) value;
+
+	return len;
+}
+
+/*
+ * Decode varint from 'buf' not crossing 'end'.  Returns pointer to the
+ * next varint or NULL, if varint is malformed.
+ */
+static inline const char *
+ptrack_varint_decode(const char *buf, const char *end, uint64 *value)
+{
+	int			shift = 0;
+
+	*value = 0;
+
+	while (buf < end && shift < 64)
+	{
+		unsigned char c = (unsigned char) *buf++;
+
+		*value |= (uint64) (c & 0x7F) << shift;
+		if ((c & 0x80) == 0)
+			return buf;
+		shift += 7;
+	}
+
+	return NULL;
+}
+
 extern void ptrackCheckpoint(void);
 extern void ptrackMapInit(void);
 extern void ptrackMapAttach(void);
+extern Size ptrackMapShmemSize(void);
+extern void ptrackMapShmemInit(void);
+extern void ptrack_map_get_stats(PtrackMapStats * stats, int64 *npages,
+								 int64 *nresident);
+extern bool ptrack_map_file_compatible(const char *path);
+extern uint64 *ptrack_map_file_load(const char *path, PtrackMapFileHdr * hdr);
 
 extern void assign_ptrack_map_size(int newval, void *extra);
 
+extern PtrackDir * ptrack_opendir(const char *path);
+extern const char *ptrack_readdir(PtrackDir * dir, PtrackDirentType * type, int elevel);
+extern void ptrack_closedir(PtrackDir * dir);
 extern void ptrack_walkdir(const char *path, Oid tablespaceOid, Oid dbOid);
 extern void ptrack_mark_block(RelFileNodeBackend smgr_rnode,
 							  ForkNumber forkno, BlockNumber blkno);
+extern void ptrack_mark_block_at(RelFileNode rnode, ForkNumber forknum,
+								 BlockNumber blocknum, XLogRecPtr new_lsn);
+extern XLogRecPtr ptrack_set_init_lsn(XLogRecPtr new_lsn);
+extern void ptrack_check_start_lsn(XLogRecPtr lsn, const char *hint);
+extern void ptrack_map_advance(size_t slot, XLogRecPtr new_lsn);
+
+extern void ptrack_segscan_begin(PtSegScan * scan, PtBlockId bid,
+								 XLogRecPtr start_lsn);
+extern XLogRecPtr ptrack_segscan_get(PtSegScan * scan, BlockNumber blocknum);
+extern void ptrack_segscan_end(PtSegScan * scan);
+extern void ptrack_scan_delay_point(void);
+
+extern void ptrack_api_register(void);
 
 #endif							/* PTRACK_ENGINE_H */
@@ -0,0 +1,484 @@
+/*
+ * hot.c
+ *		Exact tracking of the most frequently changed relation segments
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/hot.c
+ *
+ * Hashed ptrack map is shared by all blocks of the cluster, so a few
+ * heavily updated relations may fill most of its slots with fresh LSNs
+ * and make cold relations report false positives.  To avoid this we count
+ * marks of every relation segment (using a small array of counters hashed
+ * by segment) and promote segments, which cross ptrack.hot_threshold marks
+ * between two checkpoints, to a dedicated exact map with one entry per
+ * block.  Marks of hot segments do not touch the hashed map at all.
+ *
+ * After promotion all marks made before promoted_lsn are still in the
+ * hashed map, so lookups since earlier LSNs consult both maps, while
+ * lookups since later LSNs are answered from the exact map only.
+ *
+ * Segments, which stay cold for PTRACK_HOT_COLD_CYCLES checkpoints in a
+ * row, are demoted by checkpointer: their blocks are folded back into the
+ * hashed map and the exact map is reused for another segment.  Exact maps
+ * are not persisted separately, on checkpoint their content is merged into
+ * the on-disk copy of ptrack map instead, see ptrackCheckpoint().
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrackHotShmemSize()      --- shared memory size required for hot segments
+ *	  ptrackHotShmemInit()      --- allocate hot segments in shared memory
+ *	  ptrack_hot_mark()         --- mark block if its segment is hot
+ *	  ptrack_hot_lookup_begin() --- find hot segment and pin it for reading
+ *	  ptrack_hot_lookup_end()   --- unpin hot segment
+ *	  ptrack_hot_checkpoint()   --- demote cold segments and reset counters
+ *	  ptrack_hot_collect()      --- collect hot blocks to persist on checkpoint
+ *
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "storage/shmem.h"
+
+#include "ptrack.h"
+#include "engine.h"
+#include "hot.h"
+
+/* Number of checkpoints in a row with too few marks before demotion */
+#define PTRACK_HOT_COLD_CYCLES 2
+
+PtrackHotCtlData *ptrack_hot = NULL;
+int			ptrack_hot_segments;
+int			ptrack_hot_threshold;
+
+static void ptrack_hot_promote(const PtrackHotKey * key, uint32 bucket);
+static void ptrack_hot_demote(PtrackHotSegment * seg);
+
+static inline void
+ptrack_hot_make_key(PtrackHotKey * key, RelFileNode relnode,
+					ForkNumber forknum, BlockNumber segno)
+{
+	MemSet(key, 0, sizeof(PtrackHotKey));
+	key->relnode = relnode;
+	key->forknum = forknum;
+	key->segno = segno;
+}
+
+static inline uint32
+ptrack_hot_bucket(const PtrackHotKey * key)
+{
+	return DatumGetUInt32(hash_any((const unsigned char *) key,
+								   sizeof(PtrackHotKey))) % PTRACK_HOT_BUCKETS;
+}
+
+static inline bool
+ptrack_hot_key_equal(const PtrackHotKey * a, const PtrackHotKey * b)
+{
+	return memcmp(a, b, sizeof(PtrackHotKey)) == 0;
+}
+
+/*
+ * Shared memory size required for hot segments.
+ */
+Size
+ptrackHotShmemSize(void)
+{
+	if (ptrack_hot_segments == 0)
+		return 0;
+
+	return add_size(offsetof(PtrackHotCtlData, segments),
+					mul_size(ptrack_hot_segments, sizeof(PtrackHotSegment)));
+}
+
+/*
+ * Allocate hot segments in shared memory.  Nothing is allocated if
+ * ptrack.hot_segments is zero, so ptrack_hot stays NULL.
+ */
+void
+ptrackHotShmemInit(LWLock *lock)
+{
+	bool		found;
+	int			i;
+	uint32		blkno;
+
+	if (ptrack_hot_segments == 0)
+		return;
+
+	ptrack_hot = ShmemInitStruct("ptrack hot segments",
+								 ptrackHotShmemSize(),
+								 &found);
+
+	if (!found)
+	{
+		MemSet(ptrack_hot, 0, ptrackHotShmemSize());
+		ptrack_hot->lock = lock;
+
+		for (i = 0; i < PTRACK_HOT_BUCKETS; i++)
+		{
+			pg_atomic_init_u32(&ptrack_hot->counts[i], 0);
+			pg_atomic_init_u32(&ptrack_hot->hotrefs[i], 0);
+		}
+
+		for (i = 0; i < ptrack_hot_segments; i++)
+		{
+			PtrackHotSegment *seg = &ptrack_hot->segments[i];
+
+			pg_atomic_init_u32(&seg->state, PTRACK_HOT_FREE);
+			pg_atomic_init_u32(&seg->writers, 0);
+			pg_atomic_init_u32(&seg->marks, 0);
+
+			for (blkno = 0; blkno < RELSEG_SIZE; blkno++)
+				pg_atomic_init_u32(&seg->epochs[blkno], 0);
+		}
+	}
+}
+
+/*
+ * Mark block in the exact map of its segment.  Returns false if segment
+ * is not hot and block has to be marked in the hashed map by the caller.
+ *
+ * 'new_lsn' must be taken before the call, see ptrack_hot_promote().
+ */
+bool
+ptrack_hot_mark(RelFileNode relnode, ForkNumber forknum,
+				BlockNumber blocknum, XLogRecPtr new_lsn)
+{
+	PtrackHotKey key;
+	uint32		bucket;
+	uint32		count;
+	int			i;
+
+	if (ptrack_hot == NULL)
+		return false;
+
+	ptrack_hot_make_key(&key, relnode, forknum, blocknum / RELSEG_SIZE);
+	bucket = ptrack_hot_bucket(&key);
+
+	/* Pairs with the barrier in ptrack_hot_promote() */
+	pg_memory_barrier();
+
+	if (pg_atomic_read_u32(&ptrack_hot->hotrefs[bucket]) > 0)
+	{
+		for (i = 0; i < ptrack_hot_segments; i++)
+		{
+			PtrackHotSegment *seg = &ptrack_hot->segments[i];
+			pg_atomic_uint32 *epoch;
+			uint32		old_epoch;
+			uint32		new_epoch;
+
+			if (pg_atomic_read_u32(&seg->state) != PTRACK_HOT_ACTIVE)
+				continue;
+
+			pg_read_barrier();
+			if (!ptrack_hot_key_equal(&seg->key, &key))
+				continue;
+
+			/*
+			 * Announce ourselves and re-check, since segment could be demoted
+			 * and even reused for another key concurrently.  Demotion waits
+			 * for all announced writers, see ptrack_hot_demote().
+			 */
+			pg_atomic_fetch_add_u32(&seg->writers, 1);
+
+			if (pg_atomic_read_u32(&seg->state) != PTRACK_HOT_ACTIVE)
+			{
+				pg_atomic_fetch_sub_u32(&seg->writers, 1);
+				break;
+			}
+
+			pg_read_barrier();
+			if (!ptrack_hot_key_equal(&seg->key, &key))
+			{
+				pg_atomic_fetch_sub_u32(&seg->writers, 1);
+				break;
+			}
+
+			epoch = &seg->epochs[blocknum % RELSEG_SIZE];
+			new_epoch = ptrack_hot_lsn_to_epoch(new_lsn);
+			old_epoch = pg_atomic_read_u32(epoch);
+
+			/* Atomically assign new epoch value */
+			while (old_epoch < new_epoch &&
+				   !pg_atomic_compare_exchange_u32(epoch, &old_epoch, new_epoch));
+
+			pg_atomic_fetch_add_u32(&seg->marks, 1);
+			pg_atomic_fetch_sub_u32(&seg->writers, 1);
+
+			return true;
+		}
+	}
+
+	count = pg_atomic_add_fetch_u32(&ptrack_hot->counts[bucket], 1);
+
+	/* Retry on every multiple of threshold if promotion did not succeed */
+	if (count % ptrack_hot_threshold == 0)
+		ptrack_hot_promote(&key, bucket);
+
+	return false;
+}
+
+/*
+ * Promote segment to the exact map if there is a free one.  We are on the
+ * write path here, so we never wait for the lock.
+ *
+ * Marks, which did not see the segment in 'hotrefs', go to the hashed map.
+ * They take their LSN before checking 'hotrefs' and we take promoted_lsn
+ * after incrementing it, so none of them is newer than promoted_lsn.
+ */
+static void
+ptrack_hot_promote(const PtrackHotKey * key, uint32 bucket)
+{
+	PtrackHotSegment *seg = NULL;
+	int			i;
+
+	if (!LWLockConditionalAcquire(ptrack_hot->lock, LW_EXCLUSIVE))
+		return;
+
+	for (i = 0; i < ptrack_hot_segments; i++)
+	{
+		PtrackHotSegment *cur = &ptrack_hot->segments[i];
+		uint32		state = pg_atomic_read_u32(&cur->state);
+
+		if (state == PTRACK_HOT_ACTIVE && ptrack_hot_key_equal(&cur->key, key))
+		{
+			/* Already promoted by somebody else */
+			LWLockRelease(ptrack_hot->lock);
+			return;
+		}
+		else if (state == PTRACK_HOT_FREE && seg == NULL)
+			seg = cur;
+	}
+
+	if (seg == NULL)
+	{
+		LWLockRelease(ptrack_hot->lock);
+		return;
+	}
+
+	/* Epochs of free segment are already zeroed by demotion */
+	seg->key = *key;
+	seg->cold_cycles = 0;
+	pg_atomic_write_u32(&seg->marks, 0);
+
+	pg_write_barrier();
+	pg_atomic_write_u32(&seg->state, PTRACK_HOT_ACTIVE);
+
+	/* Full barrier, pairs with the one in ptrack_hot_mark() */
+	pg_atomic_fetch_add_u32(&ptrack_hot->hotrefs[bucket], 1);
+
+	if (RecoveryInProgress())
+		seg->promoted_lsn = GetXLogReplayRecPtr(NULL);
+	else
+		seg->promoted_lsn = GetXLogInsertRecPtr();
+
+	LWLockRelease(ptrack_hot->lock);
+
+	elog(DEBUG1, "ptrack: promoted segment %u of rel %u/%u/%u fork %d at %X/%X",
+		 key->segno, key->relnode.spcNode, key->relnode.dbNode,
+		 key->relnode.relNode, key->forknum,
+		 (uint32) (seg->promoted_lsn >> 32), (uint32) seg->promoted_lsn);
+}
+
+/*
+ * Fold exact map of the segment back into the hashed map and make it free.
+ * Must be called with exclusive ptrack_hot->lock, so there are no readers.
+ */
+static void
+ptrack_hot_demote(PtrackHotSegment * seg)
+{
+	PtBlockId	bid;
+	uint32		blkno;
+
+	pg_atomic_write_u32(&seg->state, PTRACK_HOT_DEMOTING);
+	pg_memory_barrier();
+
+	/*
+	 * New marks go to the hashed map from now on, but some of them could
+	 * already pass the state check.  They are short, so just wait.
+	 */
+	while (pg_atomic_read_u32(&seg->writers) > 0)
+		pg_usleep(10L);
+
+	pg_atomic_fetch_sub_u32(&ptrack_hot->hotrefs[ptrack_hot_bucket(&seg->key)], 1);
+
+	bid.relnode = seg->key.relnode;
+	bid.forknum = seg->key.forknum;
+
+	for (blkno = 0; blkno < RELSEG_SIZE; blkno++)
+	{
+		uint32		epoch = pg_atomic_read_u32(&seg->epochs[blkno]);
+
+		if (epoch == 0)
+			continue;
+
+		bid.blocknum = seg->key.segno * RELSEG_SIZE + blkno;
+		ptrack_map_advance(BID_HASH_FUNC(bid), ptrack_hot_epoch_to_lsn(epoch));
+		pg_atomic_write_u32(&seg->epochs[blkno], 0);
+	}
+
+	pg_write_barrier();
+	pg_atomic_write_u32(&seg->state, PTRACK_HOT_FREE);
+
+	elog(DEBUG1, "ptrack: demoted segment %u of rel %u/%u/%u fork %d",
+		 seg->key.segno, seg->key.relnode.spcNode, seg->key.relnode.dbNode,
+		 seg->key.relnode.relNode, seg->key.forknum);
+}
+
+/*
+ * Find hot segment and pin it for reading, so it cannot be demoted until
+ * ptrack_hot_lookup_end().  Returns -1 if segment is not hot, nothing is
+ * pinned in that case.
+ */
+int
+ptrack_hot_lookup_begin(RelFileNode relnode, ForkNumber forknum,
+						BlockNumber segno, XLogRecPtr *promoted_lsn)
+{
+	PtrackHotKey key;
+	int			i;
+
+	if (ptrack_hot == NULL)
+		return -1;
+
+	ptrack_hot_make_key(&key, relnode, forknum, segno);
+
+	LWLockAcquire(ptrack_hot->lock, LW_SHARED);
+
+	for (i = 0; i < ptrack_hot_segments; i++)
+	{
+		PtrackHotSegment *seg = &ptrack_hot->segments[i];
+
+		if (pg_atomic_read_u32(&seg->state) == PTRACK_HOT_ACTIVE &&
+			ptrack_hot_key_equal(&seg->key, &key))
+		{
+			*promoted_lsn = seg->promoted_lsn;
+			return i;
+		}
+	}
+
+	LWLockRelease(ptrack_hot->lock);
+
+	return -1;
+}
+
+void
+ptrack_hot_lookup_end(int hot_slot)
+{
+	if (hot_slot >= 0)
+		LWLockRelease(ptrack_hot->lock);
+}
+
+/*
+ * Demote segments, which stayed cold for several checkpoints, and start
+ * counting marks for the next cycle.  Called by checkpointer.
+ */
+void
+ptrack_hot_checkpoint(void)
+{
+	int			i;
+
+	if (ptrack_hot == NULL)
+		return;
+
+	LWLockAcquire(ptrack_hot->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < ptrack_hot_segments; i++)
+	{
+		PtrackHotSegment *seg = &ptrack_hot->segments[i];
+
+		if (pg_atomic_read_u32(&seg->state) != PTRACK_HOT_ACTIVE)
+			continue;
+
+		if (pg_atomic_exchange_u32(&seg->marks, 0) >= ptrack_hot_threshold)
+			seg->cold_cycles = 0;
+		else if (++seg->cold_cycles >= PTRACK_HOT_COLD_CYCLES)
+			ptrack_hot_demote(seg);
+	}
+
+	for (i = 0; i < PTRACK_HOT_BUCKETS; i++)
+		pg_atomic_write_u32(&ptrack_hot->counts[i], 0);
+
+	LWLockRelease(ptrack_hot->lock);
+}
+
+static int
+ptrack_hot_entry_cmp(const void *a, const void *b)
+{
+	uint64		slot_a = ((const PtrackHotEntry *) a)->slot;
+	uint64		slot_b = ((const PtrackHotEntry *) b)->slot;
+
+	if (slot_a < slot_b)
+		return -1;
+	else if (slot_a > slot_b)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Return all marked blocks of hot segments as hashed map slots with their
+ * LSNs sorted by slot, so checkpointer can merge them into the on-disk copy
+ * of ptrack map in a single pass.  Returns NULL if there are none.
+ */
+PtrackHotEntry *
+ptrack_hot_collect(uint64 *nentries)
+{
+	PtrackHotEntry *entries = NULL;
+	uint64		n = 0;
+	uint64		maxentries = 0;
+	PtBlockId	bid;
+	int			i;
+	uint32		blkno;
+
+	*nentries = 0;
+
+	if (ptrack_hot == NULL)
+		return NULL;
+
+	LWLockAcquire(ptrack_hot->lock, LW_SHARED);
+
+	for (i = 0; i < ptrack_hot_segments; i++)
+	{
+		PtrackHotSegment *seg = &ptrack_hot->segments[i];
+
+		if (pg_atomic_read_u32(&seg->state) != PTRACK_HOT_ACTIVE)
+			continue;
+
+		bid.relnode = seg->key.relnode;
+		bid.forknum = seg->key.forknum;
+
+		for (blkno = 0; blkno < RELSEG_SIZE; blkno++)
+		{
+			uint32		epoch = pg_atomic_read_u32(&seg->epochs[blkno]);
+
+			if (epoch == 0)
+				continue;
+
+			if (n == maxentries)
+			{
+				maxentries = Max(maxentries * 2, 1024);
+				if (entries == NULL)
+					entries = MemoryContextAllocHuge(CurrentMemoryContext,
+													 maxentries * sizeof(PtrackHotEntry));
+				else
+					entries = repalloc_huge(entries,
+											maxentries * sizeof(PtrackHotEntry));
+			}
+
+			bid.blocknum = seg->key.segno * RELSEG_SIZE + blkno;
+			entries[n].slot = BID_HASH_FUNC(bid);
+			entries[n].lsn = ptrack_hot_epoch_to_lsn(epoch);
+			n++;
+		}
+	}
+
+	LWLockRelease(ptrack_hot->lock);
+
+	if (n > 0)
+		qsort(entries, n, sizeof(PtrackHotEntry), ptrack_hot_entry_cmp);
+
+	*nentries = n;
+
+	return entries;
+}
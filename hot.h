@@ -0,0 +1,131 @@
+/*-------------------------------------------------------------------------
+ *
+ * hot.h
+ *	  header for exact tracking of the most frequently changed segments
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/hot.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_HOT_H
+#define PTRACK_HOT_H
+
+#include "access/xlogdefs.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/relfilenode.h"
+
+/*
+ * Hot segments store a coarse 'LSN epoch' per block instead of an LSN.
+ * Epoch is an LSN rounded up to the 64 KB of WAL, so 32 bits are enough
+ * for 256 TB of WAL.  Rounding up guarantees that we never report block
+ * as unchanged, if it was actually changed.
+ */
+#define PTRACK_HOT_LSN_SHIFT 16
+#define PTRACK_HOT_EPOCH_MAX PG_UINT32_MAX
+
+/* Number of mark counters used to find promotion candidates */
+#define PTRACK_HOT_BUCKETS 8192
+
+/* States of the hot segment */
+#define PTRACK_HOT_FREE		0
+#define PTRACK_HOT_ACTIVE	1
+#define PTRACK_HOT_DEMOTING	2
+
+/*
+ * Relation segment identifier.
+ */
+typedef struct PtrackHotKey
+{
+	RelFileNode relnode;
+	ForkNumber	forknum;
+	BlockNumber segno;
+}			PtrackHotKey;
+
+/*
+ * Dedicated exact map of a single hot relation segment.
+ *
+ * Key and promoted_lsn are changed only under exclusive ptrack_hot->lock,
+ * while marking is lockless: writer announces itself in 'writers' before
+ * checking 'state' and 'key', so demotion can wait for all in-progress
+ * marks before folding epochs back into the hashed map.
+ */
+typedef struct PtrackHotSegment
+{
+	pg_atomic_uint32 state;
+	pg_atomic_uint32 writers;
+	/* Number of marks since the last checkpoint */
+	pg_atomic_uint32 marks;
+	/* Number of checkpoints in a row with too few marks */
+	uint32		cold_cycles;
+	PtrackHotKey key;
+	/* All marks made after this LSN are stored only in 'epochs' */
+	XLogRecPtr	promoted_lsn;
+	pg_atomic_uint32 epochs[RELSEG_SIZE];
+}			PtrackHotSegment;
+
+/*
+ * Shared state of hot segments tracking.  'counts' are numbers of marks
+ * since the last checkpoint hashed by PtrackHotKey, 'hotrefs' are numbers
+ * of active hot segments in the same buckets, so the marking code can skip
+ * searching for hot segment, when there is none.
+ */
+typedef struct PtrackHotCtlData
+{
+	LWLock	   *lock;
+	pg_atomic_uint32 counts[PTRACK_HOT_BUCKETS];
+	pg_atomic_uint32 hotrefs[PTRACK_HOT_BUCKETS];
+	PtrackHotSegment segments[FLEXIBLE_ARRAY_MEMBER];
+}			PtrackHotCtlData;
+
+/*
+ * Map slot and LSN of a block of hot segment, which are merged into
+ * ptrack.map on checkpoint.
+ */
+typedef struct PtrackHotEntry
+{
+	uint64		slot;
+	XLogRecPtr	lsn;
+}			PtrackHotEntry;
+
+extern PtrackHotCtlData * ptrack_hot;
+extern int	ptrack_hot_segments;
+extern int	ptrack_hot_threshold;
+
+/* Convert LSN to hot segment epoch rounding it up */
+static inline uint32
+ptrack_hot_lsn_to_epoch(XLogRecPtr lsn)
+{
+	uint64		epoch = (lsn >> PTRACK_HOT_LSN_SHIFT) + 1;
+
+	return epoch >= PTRACK_HOT_EPOCH_MAX ? PTRACK_HOT_EPOCH_MAX : (uint32) epoch;
+}
+
+/* Convert hot segment epoch to the upper bound of LSN */
+static inline XLogRecPtr
+ptrack_hot_epoch_to_lsn(uint32 epoch)
+{
+	if (epoch == 0)
+		return InvalidXLogRecPtr;
+	else if (epoch == PTRACK_HOT_EPOCH_MAX)
+		return PG_UINT64_MAX;
+
+	return (XLogRecPtr) epoch << PTRACK_HOT_LSN_SHIFT;
+}
+
+extern Size ptrackHotShmemSize(void);
+extern void ptrackHotShmemInit(LWLock *lock);
+
+extern bool ptrack_hot_mark(RelFileNode relnode, ForkNumber forknum,
+							BlockNumber blocknum, XLogRecPtr new_lsn);
+extern int	ptrack_hot_lookup_begin(RelFileNode relnode, ForkNumber forknum,
+									BlockNumber segno, XLogRecPtr *promoted_lsn);
+extern void ptrack_hot_lookup_end(int hot_slot);
+extern void ptrack_hot_checkpoint(void);
+extern PtrackHotEntry *ptrack_hot_collect(uint64 *nentries);
+
+#endif							/* PTRACK_HOT_H */
@@ -0,0 +1,132 @@
+/* ptrack/ptrack--2.1--2.2.sql */
+
+-- Complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION ptrack UPDATE;" to load this file. \quit
+
+CREATE FUNCTION ptrack_create_slot(slot_name text, start_lsn pg_lsn DEFAULT NULL)
+RETURNS pg_lsn
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION ptrack_drop_slot(slot_name text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_advance_slot(slot_name text, upto_lsn pg_lsn)
+RETURNS pg_lsn
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_slot_get_pagemapset(slot_name text)
+RETURNS TABLE (path		text,
+			   pagemap	bytea)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_slots()
+RETURNS TABLE (slot_name		text,
+			   slot_lsn			pg_lsn,
+			   valid			bool,
+			   changed_pages	bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW ptrack_slots AS
+	SELECT * FROM ptrack_get_slots();
+
+CREATE FUNCTION ptrack_take_snapshot()
+RETURNS pg_lsn
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION ptrack_get_pagemapset(start_lsn pg_lsn, end_lsn pg_lsn)
+RETURNS TABLE (path		text,
+			   pagemap	bytea)
+AS 'MODULE_PATHNAME', 'ptrack_get_pagemapset_range'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_recent_blocks(start_lsn pg_lsn)
+RETURNS TABLE (database		oid,
+			   tablespace	oid,
+			   relfilenode	oid,
+			   forknum		int4,
+			   blocknum		int8)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_dump_prewarm(start_lsn pg_lsn)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_write_wal_summary(start_lsn pg_lsn)
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_map_stats(
+	OUT map_pages			bigint,
+	OUT resident_pages		bigint,
+	OUT prefaulted			bool,
+	OUT locked				bool,
+	OUT init_major_faults	bigint,
+	OUT init_minor_faults	bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_pagemapset_cursor(start_lsn pg_lsn, parts int4 DEFAULT 1,
+										 dboid oid DEFAULT 0)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_pagemapset_fetch(token text, max_files int4 DEFAULT 1000)
+RETURNS TABLE (path			text,
+			   pagemap		bytea,
+			   next_token	text)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_simulate_trace(trace_file text,
+									  map_sizes int4[],
+									  hashes text[] DEFAULT '{hash_any}',
+									  layouts text[] DEFAULT '{hashed}',
+									  start_lsn pg_lsn DEFAULT '0/0',
+									  scan_datadir bool DEFAULT false)
+RETURNS TABLE (map_size				int4,
+			   hash					text,
+			   layout				text,
+			   marks				bigint,
+			   changed_blocks		bigint,
+			   reported_blocks		bigint,
+			   false_positive_rate	float8,
+			   incremental_bytes	bigint,
+			   marks_per_sec		float8)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_changed_files(start_lsn pg_lsn, whole_file_blocks int4 DEFAULT 16)
+RETURNS TABLE (path			text,
+			   size			bigint,
+			   changed		bool,
+			   copy_whole	bool)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_estimate_changes(start_lsn pg_lsn, sample_fraction float8 DEFAULT 0.01)
+RETURNS TABLE (tablespace			oid,
+			   total_pages			bigint,
+			   sampled_pages		bigint,
+			   changed_pages		bigint,
+			   changed_pages_low	bigint,
+			   changed_pages_high	bigint,
+			   changed_bytes		bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_relation_blocks(rel regclass, start_lsn pg_lsn, fork text DEFAULT 'main',
+										   lookup text DEFAULT 'iterator')
+RETURNS SETOF bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
@@ -21,40 +21,89 @@
  * # ptrack_get_pagemapset('LSN')    --- returns a set of changed data files with
  * 										 bitmaps of changed blocks since specified LSN.
  * # ptrack_init_lsn                 --- returns LSN of the last ptrack map initialization.
+ * # ptrack_create_slot('name')      --- creates named persistent consumer position.
+ * # ptrack_drop_slot('name')        --- drops consumer position.
+ * # ptrack_slot_get_pagemapset('name') --- the same as ptrack_get_pagemapset(), but
+ * 										 since the slot position.
+ * # ptrack_advance_slot('name', 'LSN') --- moves slot position forward.
+ * # ptrack_get_slots                --- returns all slots with their lag in pages.
+ * # ptrack_get_recent_blocks('LSN') --- returns blocks written since specified LSN
+ * 										 in physical order for prewarming.
+ * # ptrack_dump_prewarm('LSN')      --- writes them to autoprewarm.blocks.
+ * # ptrack_take_snapshot            --- retains snapshot of the map at the current LSN.
+ * # ptrack_get_pagemapset('LSN', 'LSN') --- returns a set of data files changed
+ * 										 between two LSNs using retained snapshots.
+ * # ptrack_write_wal_summary('LSN') --- writes blocks changed since specified LSN
+ * 										 as a WAL summary file.
+ * # ptrack_get_map_stats            --- returns memory residency and fault stats of the map.
+ * # ptrack_pagemapset_cursor('LSN', parts, dboid) --- returns resume tokens of
+ * 										 pagemapset cursor split into parts.
+ * # ptrack_pagemapset_fetch('token', max_files) --- returns next chunk of changed
+ * 										 files of cursor with resume tokens.
+ * # ptrack_simulate_trace('file', sizes, hashes, layouts) --- replays trace of
+ * 										 marks against simulated maps.
+ * # ptrack_get_changed_files('LSN') --- returns all data files with their size
+ * 										 and whether they were changed since specified LSN.
+ * # ptrack_estimate_changes('LSN', fraction) --- estimates number of pages changed
+ * 										 since specified LSN by a sample of blocks.
+ * # ptrack_get_relation_blocks(rel, 'LSN', fork) --- returns blocks of relation
+ * 										 fork changed since specified LSN via C API.
+ *
+ * Extensions running inside the server may use C API of ptrack_api.h instead.
  *
  */
 
 #include "postgres.h"
 
+#include <math.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #if PG_VERSION_NUM < 120000
+#include "access/heapam.h"
 #include "access/htup_details.h"
+#else
+#include "access/relation.h"
 #endif
 #include "catalog/pg_tablespace.h"
 #include "catalog/pg_type.h"
+#include "common/controldata_utils.h"
 #include "funcapi.h"
+#include "lib/stringinfo.h"
 #include "miscadmin.h"
 #include "nodes/pg_list.h"
-#ifdef PGPRO_EE
-/* For file_is_in_cfs_tablespace() only. */
 #include "replication/basebackup.h"
-#endif
+#include "replication/message.h"
+#include "storage/bufmgr.h"
 #include "storage/copydir.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
 #include "storage/lmgr.h"
 #if PG_VERSION_NUM >= 120000
 #include "storage/md.h"
 #endif
 #include "storage/smgr.h"
 #include "storage/reinit.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
 #include "utils/pg_lsn.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
 
+#include "blkreftable.h"
+#include "coarse.h"
 #include "datapagemap.h"
 #include "engine.h"
+#include "hot.h"
 #include "ptrack.h"
+#include "ptrack_api.h"
+#include "skipwal.h"
+#include "slots.h"
+#include "snapshot.h"
+#include "standby.h"
+#include "trace.h"
+#include "walmap.h"
 
 PG_MODULE_MAGIC;
 
@@ -66,6 +115,29 @@ static copydir_hook_type prev_copydir_hook = NULL;
 static mdwrite_hook_type prev_mdwrite_hook = NULL;
 static mdextend_hook_type prev_mdextend_hook = NULL;
 static ProcessSyncRequests_hook_type prev_ProcessSyncRequests_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static basebackup_pagemap_hook_type prev_basebackup_pagemap_hook = NULL;
+static logicalmsg_redo_hook_type prev_logicalmsg_redo_hook = NULL;
+static MarkBufferDirty_hook_type prev_MarkBufferDirty_hook = NULL;
+static mdimmedsync_hook_type prev_mdimmedsync_hook = NULL;
+
+static const struct config_enum_entry ptrack_mark_mode_options[] = {
+	{"write", PTRACK_MARK_WRITE, false},
+	{"dirty", PTRACK_MARK_DIRTY, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry ptrack_map_layout_options[] = {
+	{"hashed", PTRACK_LAYOUT_HASHED, false},
+	{"segment", PTRACK_LAYOUT_SEGMENT, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry ptrack_standby_mode_options[] = {
+	{"immediate", PTRACK_STANDBY_IMMEDIATE, false},
+	{"deferred", PTRACK_STANDBY_DEFERRED, false},
+	{NULL, 0, false}
+};
 
 void		_PG_init(void);
 void		_PG_fini(void);
@@ -76,9 +148,25 @@ static void ptrack_mdwrite_hook(RelFileNodeBackend smgr_rnode,
 static void ptrack_mdextend_hook(RelFileNodeBackend smgr_rnode,
 								 ForkNumber forkno, BlockNumber blkno);
 static void ptrack_ProcessSyncRequests_hook(void);
+static void ptrack_shmem_startup_hook(void);
+static bool ptrack_basebackup_pagemap_hook(const char *path, BlockNumber nblocks,
+										   XLogRecPtr lsn, char **pagemap,
+										   int *pagemapsize);
+static void ptrack_logicalmsg_redo_hook(XLogReaderState *record);
+static void ptrack_MarkBufferDirty_hook(RelFileNode rnode, ForkNumber forknum,
+										BlockNumber blocknum);
+static void ptrack_mdimmedsync_hook(RelFileNodeBackend smgr_rnode,
+									ForkNumber forknum);
 
 static void ptrack_gather_filelist(List **filelist, char *path, Oid spcOid, Oid dbOid);
+static void ptrack_gather_datadir(List **filelist);
+static bool ptrack_parse_relpath(const char *path, PtBlockId * bid, int *segno);
+static int	ptrack_filelist_stat_next(PtScanCtx * ctx);
 static int	ptrack_filelist_getnext(PtScanCtx * ctx);
+static Datum ptrack_pagemapset_internal(FunctionCallInfo fcinfo, XLogRecPtr lsn,
+										 XLogRecPtr end_lsn);
+static Tuplestorestate *ptrack_materialize_init(FunctionCallInfo fcinfo,
+												TupleDesc *tupdesc);
 
 /*
  * Module load callback
@@ -98,7 +186,55 @@ _PG_init(void)
 	 * postmaster boot!  First, it is always called with bootValue, so we use
 	 * -1 as default value and no-op here.  Next, it is called with the actual
 	 * value from config.
+	 *
+	 * Memory options and layout of the map are defined before
+	 * ptrack.map_size, since the map is initialized by its assign hook.
 	 */
+	DefineCustomBoolVariable("ptrack.map_prefault",
+							 "Prefaults all pages of ptrack map at server start.",
+							 NULL,
+							 &ptrack_map_prefault,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("ptrack.map_lock",
+							 "Locks ptrack map in memory.",
+							 NULL,
+							 &ptrack_map_lock,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("ptrack.map_random_access",
+							 "Disables readahead of ptrack map pages on page faults.",
+							 NULL,
+							 &ptrack_map_random_access,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("ptrack.map_layout",
+							 "Sets how blocks are placed in ptrack map.",
+							 NULL,
+							 &ptrack_map_layout,
+							 PTRACK_LAYOUT_HASHED,
+							 ptrack_map_layout_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomIntVariable("ptrack.map_size",
 							"Sets the size of ptrack map in MB used for incremental backup (0 disabled).",
 							NULL,
@@ -111,6 +247,148 @@ _PG_init(void)
 							assign_ptrack_map_size,
 							NULL);
 
+	DefineCustomIntVariable("ptrack.max_slots",
+							"Sets the maximum number of named ptrack consumer positions.",
+							NULL,
+							&ptrack_max_slots,
+							10,
+							0, 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("ptrack.mark_mode",
+							 "Sets when blocks of shared buffers are marked in ptrack map.",
+							 NULL,
+							 &ptrack_mark_mode,
+							 PTRACK_MARK_WRITE,
+							 ptrack_mark_mode_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("ptrack.hot_segments",
+							"Sets the maximum number of relation segments tracked exactly.",
+							NULL,
+							&ptrack_hot_segments,
+							0,
+							0, 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("ptrack.hot_threshold",
+							"Sets the number of block writes between checkpoints, which makes relation segment hot.",
+							NULL,
+							&ptrack_hot_threshold,
+							10000,
+							1, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("ptrack.scan_cost_delay",
+							 "Sets the delay in milliseconds of ptrack scans, which exceeded the cost limit.",
+							 NULL,
+							 &ptrack_scan_cost_delay,
+							 0,
+							 0, 100,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("ptrack.scan_cost_limit",
+							"Sets the amount of work of ptrack scans, after which they sleep.",
+							NULL,
+							&ptrack_scan_cost_limit,
+							200,
+							1, 10000,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("ptrack.snapshots",
+							"Sets the maximum number of retained ptrack map snapshots.",
+							NULL,
+							&ptrack_snapshots,
+							0,
+							0, 1024,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("ptrack.snapshots_max_size",
+							"Sets the maximum total size of retained ptrack map snapshots (0 unlimited).",
+							NULL,
+							&ptrack_snapshots_max_size,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("ptrack.wal_log_map",
+							 "Writes changes of ptrack map to WAL to keep maps of standbys in sync.",
+							 NULL,
+							 &ptrack_wal_log_map,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("ptrack.standby_mode",
+							 "Sets whether blocks written by replay are marked immediately or summarized from WAL by checkpoints.",
+							 NULL,
+							 &ptrack_standby_mode,
+							 PTRACK_STANDBY_IMMEDIATE,
+							 ptrack_standby_mode_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("ptrack.trace_file",
+							   "Appends all marks of blocks to this file for offline simulation.",
+							   "Relative path is relative to the data directory, empty string disables tracing.",
+							   &ptrack_trace_file,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   assign_ptrack_trace_file,
+							   NULL);
+
+	/*
+	 * Request shared memory and locks for ptrack slots, coarse index, hot
+	 * segments, standby state and snapshots
+	 */
+	RequestAddinShmemSpace(ptrackMapShmemSize());
+	RequestAddinShmemSpace(ptrackCoarseShmemSize());
+	RequestAddinShmemSpace(ptrackStandbyShmemSize());
+	RequestAddinShmemSpace(ptrackSlotsShmemSize());
+	RequestAddinShmemSpace(ptrackHotShmemSize());
+	RequestAddinShmemSpace(ptrackSnapshotShmemSize());
+	RequestNamedLWLockTranche("ptrack", 2);
+
 	/* Install hooks */
 	prev_copydir_hook = copydir_hook;
 	copydir_hook = ptrack_copydir_hook;
@@ -120,6 +398,19 @@ _PG_init(void)
 	mdextend_hook = ptrack_mdextend_hook;
 	prev_ProcessSyncRequests_hook = ProcessSyncRequests_hook;
 	ProcessSyncRequests_hook = ptrack_ProcessSyncRequests_hook;
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ptrack_shmem_startup_hook;
+	prev_basebackup_pagemap_hook = basebackup_pagemap_hook;
+	basebackup_pagemap_hook = ptrack_basebackup_pagemap_hook;
+	prev_logicalmsg_redo_hook = logicalmsg_redo_hook;
+	logicalmsg_redo_hook = ptrack_logicalmsg_redo_hook;
+	prev_MarkBufferDirty_hook = MarkBufferDirty_hook;
+	MarkBufferDirty_hook = ptrack_MarkBufferDirty_hook;
+	prev_mdimmedsync_hook = mdimmedsync_hook;
+	mdimmedsync_hook = ptrack_mdimmedsync_hook;
+
+	/* Publish C API for other extensions */
+	ptrack_api_register();
 }
 
 /*
@@ -133,6 +424,11 @@ _PG_fini(void)
 	mdwrite_hook = prev_mdwrite_hook;
 	mdextend_hook = prev_mdextend_hook;
 	ProcessSyncRequests_hook = prev_ProcessSyncRequests_hook;
+	shmem_startup_hook = prev_shmem_startup_hook;
+	basebackup_pagemap_hook = prev_basebackup_pagemap_hook;
+	logicalmsg_redo_hook = prev_logicalmsg_redo_hook;
+	MarkBufferDirty_hook = prev_MarkBufferDirty_hook;
+	mdimmedsync_hook = prev_mdimmedsync_hook;
 }
 
 /*
@@ -196,7 +492,24 @@ static void
 ptrack_mdwrite_hook(RelFileNodeBackend smgr_rnode,
 					ForkNumber forknum, BlockNumber blocknum)
 {
-	ptrack_mark_block(smgr_rnode, forknum, blocknum);
+	if (!ptrack_replay_deferred())
+	{
+		if (ptrack_mark_mode == PTRACK_MARK_DIRTY && BufferFlushInProgress &&
+			BufferFlushLSN != InvalidXLogRecPtr)
+		{
+			/*
+			 * Flushed shared buffer was already marked, when it became dirty,
+			 * but it may have been modified again since then, e.g. after the
+			 * start of a backup.  So advance the mark to its last WAL-logged
+			 * change.
+			 */
+			if (ptrack_map_size != 0 && ptrack_map != NULL)
+				ptrack_mark_block_at(smgr_rnode.node, forknum, blocknum,
+									 BufferFlushLSN);
+		}
+		else
+			ptrack_mark_block(smgr_rnode, forknum, blocknum);
+	}
 
 	if (prev_mdwrite_hook)
 		prev_mdwrite_hook(smgr_rnode, forknum, blocknum);
@@ -206,12 +519,47 @@ static void
 ptrack_mdextend_hook(RelFileNodeBackend smgr_rnode,
 					 ForkNumber forknum, BlockNumber blocknum)
 {
-	ptrack_mark_block(smgr_rnode, forknum, blocknum);
+	if (!ptrack_replay_deferred())
+		ptrack_mark_block(smgr_rnode, forknum, blocknum);
 
 	if (prev_mdextend_hook)
 		prev_mdextend_hook(smgr_rnode, forknum, blocknum);
 }
 
+/*
+ * Mark block of shared buffer once per dirty cycle.  It is called inside
+ * critical sections, but ptrack_mark_block() never errors out.
+ */
+static void
+ptrack_MarkBufferDirty_hook(RelFileNode rnode, ForkNumber forknum,
+							BlockNumber blocknum)
+{
+	if (ptrack_mark_mode == PTRACK_MARK_DIRTY && !ptrack_replay_deferred())
+	{
+		RelFileNodeBackend smgr_rnode;
+
+		smgr_rnode.node = rnode;
+		smgr_rnode.backend = InvalidBackendId;
+		ptrack_mark_block(smgr_rnode, forknum, blocknum);
+	}
+
+	if (prev_MarkBufferDirty_hook)
+		prev_MarkBufferDirty_hook(rnode, forknum, blocknum);
+}
+
+/*
+ * Relation fork was synced to disk before commit, possibly because its
+ * changes were not WAL-logged.
+ */
+static void
+ptrack_mdimmedsync_hook(RelFileNodeBackend smgr_rnode, ForkNumber forknum)
+{
+	ptrack_skipwal_sync(smgr_rnode, forknum);
+
+	if (prev_mdimmedsync_hook)
+		prev_mdimmedsync_hook(smgr_rnode, forknum);
+}
+
 static void
 ptrack_ProcessSyncRequests_hook()
 {
@@ -221,43 +569,245 @@ ptrack_ProcessSyncRequests_hook()
 		prev_ProcessSyncRequests_hook();
 }
 
+static void
+ptrack_logicalmsg_redo_hook(XLogReaderState *record)
+{
+	ptrack_walmap_redo(record);
+
+	if (prev_logicalmsg_redo_hook)
+		prev_logicalmsg_redo_hook(record);
+}
+
 /*
- * Recursively walk through the path and add all data files to filelist.
+ * Allocate (or attach to) ptrack shared memory structures.
  */
 static void
-ptrack_gather_filelist(List **filelist, char *path, Oid spcOid, Oid dbOid)
+ptrack_shmem_startup_hook(void)
 {
-	DIR		   *dir;
-	struct dirent *de;
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
 
-	dir = AllocateDir(path);
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
-	while ((de = ReadDirExtended(dir, path, LOG)) != NULL)
+	ptrackMapShmemInit();
+	ptrackCoarseShmemInit();
+	ptrackStandbyShmemInit();
+	ptrackSlotsShmemInit(&(GetNamedLWLockTranche("ptrack"))[0].lock);
+	ptrackHotShmemInit(&(GetNamedLWLockTranche("ptrack"))[1].lock);
+	ptrackSnapshotShmemInit();
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Provide BASE_BACKUP with PTRACK option with a bitmap of blocks of the
+ * relation segment file 'path' changed since 'lsn'.  Any other files are
+ * left to the previous hook (if any) and sent in full otherwise.
+ */
+static bool
+ptrack_basebackup_pagemap_hook(const char *path, BlockNumber nblocks,
+							   XLogRecPtr lsn, char **pagemap, int *pagemapsize)
+{
+	PtBlockId	bid;
+	int			segno;
+	XLogRecPtr	update_lsn;
+	BlockNumber blkno;
+	datapagemap_t map;
+	PtSegScan	segscan;
+
+	if (!ptrack_parse_relpath(path, &bid, &segno)
+#ifdef PGPRO_EE
+		/* Currently, we do not track files from compressed tablespaces */
+		|| file_is_in_cfs_tablespace(path)
+#endif
+		)
 	{
-		char		subpath[MAXPGPATH * 2];
-		struct stat fst;
-		int			sret;
+		if (prev_basebackup_pagemap_hook)
+			return prev_basebackup_pagemap_hook(path, nblocks, lsn,
+												pagemap, pagemapsize);
+		return false;
+	}
 
-		CHECK_FOR_INTERRUPTS();
+	/*
+	 * Map cannot tell anything about changes before its initialization, so
+	 * sending an incremental copy would silently lose them.
+	 */
+	ptrack_check_start_lsn(lsn, "Take a full backup instead.");
 
-		if (strcmp(de->d_name, ".") == 0 ||
-			strcmp(de->d_name, "..") == 0 ||
-			looks_like_temp_rel_name(de->d_name))
-			continue;
+	map.bitmap = NULL;
+	map.bitmapsize = 0;
 
-		snprintf(subpath, sizeof(subpath), "%s/%s", path, de->d_name);
+	bid.blocknum = segno * RELSEG_SIZE;
+	ptrack_segscan_begin(&segscan, bid, lsn);
 
-		sret = lstat(subpath, &fst);
+	for (blkno = 0; blkno < nblocks; blkno++)
+	{
+		update_lsn = ptrack_segscan_get(&segscan, segno * RELSEG_SIZE + blkno);
 
-		if (sret < 0)
-		{
-			ereport(LOG,
-					(errcode_for_file_access(),
-					 errmsg("ptrack: could not stat file \"%s\": %m", subpath)));
+		if (update_lsn >= lsn)
+			datapagemap_add(&map, blkno);
+	}
+
+	ptrack_segscan_end(&segscan);
+
+	elog(DEBUG3, "ptrack: sending %s of %u blocks incrementally", path, nblocks);
+
+	*pagemap = map.bitmap;
+	*pagemapsize = map.bitmapsize;
+
+	return true;
+}
+
+/*
+ * Return OID of the tablespace located at the first 'len' bytes of
+ * 'location' or InvalidOid.  BASE_BACKUP sends files of tablespaces by the
+ * absolute paths read from pg_tblspc symlinks, so resolve them the same
+ * way.  Files of a tablespace are sent one after another, so the last
+ * answer is cached.
+ */
+static Oid
+ptrack_tablespace_oid(const char *location, size_t len)
+{
+	static char cached_location[MAXPGPATH];
+	static Oid	cached_oid = InvalidOid;
+	char		tblspcdir[MAXPGPATH];
+	PtrackDir  *dir;
+	const char *name;
+	PtrackDirentType type;
+	Oid			result = InvalidOid;
+
+	if (len >= MAXPGPATH)
+		return InvalidOid;
+
+	if (cached_oid != InvalidOid && strlen(cached_location) == len &&
+		strncmp(cached_location, location, len) == 0)
+		return cached_oid;
+
+	snprintf(tblspcdir, sizeof(tblspcdir), "%s/pg_tblspc", DataDir);
+	dir = ptrack_opendir(tblspcdir);
+
+	while ((name = ptrack_readdir(dir, &type, LOG)) != NULL)
+	{
+		char		linkpath[MAXPGPATH * 2];
+		char		target[MAXPGPATH];
+		int			rllen;
+
+		if (strspn(name, "0123456789") != strlen(name))
+			continue;
+
+		snprintf(linkpath, sizeof(linkpath), "%s/%s", tblspcdir, name);
+		rllen = readlink(linkpath, target, sizeof(target));
+		if (rllen < 0 || rllen >= sizeof(target))
 			continue;
+
+		if ((size_t) rllen == len && strncmp(target, location, len) == 0)
+		{
+			result = atooid(name);
+			break;
 		}
+	}
+
+	ptrack_closedir(dir);
+
+	if (result != InvalidOid)
+	{
+		memcpy(cached_location, location, len);
+		cached_location[len] = '\0';
+		cached_oid = result;
+	}
+
+	return result;
+}
+
+/*
+ * Parse path of the relation segment file relative to PGDATA (or absolute
+ * path of the file in a tablespace) into relfilenode, fork number and
+ * segment number.  Returns false if path does not look like a path of
+ * non-temporary relation file.
+ */
+static bool
+ptrack_parse_relpath(const char *path, PtBlockId * bid, int *segno)
+{
+	const char *filename;
+	const char *segpath;
+	unsigned int spcOid = 0;
+	unsigned int dbOid = 0;
+	int			pos = 0;
+	int			oidchars;
+	char		oidbuf[OIDCHARS + 1];
+
+	if (strncmp(path, "./", 2) == 0)
+		path += 2;
+
+	if (strncmp(path, "global/", 7) == 0)
+	{
+		spcOid = GLOBALTABLESPACE_OID;
+		pos = 7;
+	}
+	else if (sscanf(path, "base/%u/%n", &dbOid, &pos) == 1 && pos > 0)
+		spcOid = DEFAULTTABLESPACE_OID;
+	else if (is_absolute_path(path))
+	{
+		const char *verdir = strstr(path, "/" TABLESPACE_VERSION_DIRECTORY "/");
+
+		if (verdir == NULL ||
+			sscanf(verdir, "/" TABLESPACE_VERSION_DIRECTORY "/%u/%n",
+				   &dbOid, &pos) != 1 || pos == 0 ||
+			(spcOid = ptrack_tablespace_oid(path, verdir - path)) == InvalidOid)
+			return false;
+
+		pos += verdir - path;
+	}
+	else if (sscanf(path, "pg_tblspc/%u/" TABLESPACE_VERSION_DIRECTORY "/%u/%n",
+					&spcOid, &dbOid, &pos) != 2 || pos == 0)
+		return false;
+
+	filename = path + pos;
+
+	if (strchr(filename, '/') != NULL ||
+		!parse_filename_for_nontemp_relation(filename, &oidchars, &bid->forknum))
+		return false;
+
+	memcpy(oidbuf, filename, oidchars);
+	oidbuf[oidchars] = '\0';
+
+	bid->relnode.spcNode = spcOid;
+	bid->relnode.dbNode = dbOid;
+	bid->relnode.relNode = atooid(oidbuf);
+	bid->blocknum = 0;
+
+	segpath = strchr(filename, '.');
+	*segno = segpath != NULL ? atoi(segpath + 1) : 0;
+
+	return true;
+}
+
+/*
+ * Recursively walk through the path and add all data files to filelist.
+ */
+static void
+ptrack_gather_filelist(List **filelist, char *path, Oid spcOid, Oid dbOid)
+{
+	PtrackDir  *dir;
+	const char *name;
+	PtrackDirentType type;
+
+	dir = ptrack_opendir(path);
+
+	/* Entry types come from the directory itself, so we rarely stat here */
+	while ((name = ptrack_readdir(dir, &type, LOG)) != NULL)
+	{
+		char		subpath[MAXPGPATH * 2];
+
+		ptrack_scan_delay_point();
 
-		if (S_ISREG(fst.st_mode))
+		if (type == PTRACK_DIRENT_ERROR ||
+			looks_like_temp_rel_name(name))
+			continue;
+
+		snprintf(subpath, sizeof(subpath), "%s/%s", path, name);
+
+		if (type == PTRACK_DIRENT_REG)
 		{
 			/* Regular file inside database directory, otherwise skip it */
 			if (dbOid != InvalidOid || spcOid == GLOBALTABLESPACE_OID)
@@ -270,19 +820,19 @@ ptrack_gather_filelist(List **filelist, char *path, Oid spcOid, Oid dbOid)
 				/*
 				 * Check that filename seems to be a regular relation file.
 				 */
-				if (!parse_filename_for_nontemp_relation(de->d_name, &oidchars, &pfl->forknum))
+				if (!parse_filename_for_nontemp_relation(name, &oidchars, &pfl->forknum))
 					continue;
 
 				/* Parse segno for main fork */
 				if (pfl->forknum == MAIN_FORKNUM)
 				{
-					segpath = strstr(de->d_name, ".");
+					segpath = strstr(name, ".");
 					pfl->segno = segpath != NULL ? atoi(segpath + 1) : 0;
 				}
 				else
 					pfl->segno = 0;
 
-				memcpy(oidbuf, de->d_name, oidchars);
+				memcpy(oidbuf, name, oidchars);
 				oidbuf[oidchars] = '\0';
 				pfl->relnode.relNode = atooid(oidbuf);
 				pfl->relnode.dbNode = dbOid;
@@ -296,35 +846,52 @@ ptrack_gather_filelist(List **filelist, char *path, Oid spcOid, Oid dbOid)
 					 pfl->path, pfl->relnode.relNode);
 			}
 		}
-		else if (S_ISDIR(fst.st_mode))
+		else if (type == PTRACK_DIRENT_DIR)
 		{
-			if (strspn(de->d_name + 1, "0123456789") == strlen(de->d_name + 1)
+			if (strspn(name + 1, "0123456789") == strlen(name + 1)
 				&& dbOid == InvalidOid)
-				ptrack_gather_filelist(filelist, subpath, spcOid, atooid(de->d_name));
-			else if (spcOid != InvalidOid && strcmp(de->d_name, TABLESPACE_VERSION_DIRECTORY) == 0)
+				ptrack_gather_filelist(filelist, subpath, spcOid, atooid(name));
+			else if (spcOid != InvalidOid && strcmp(name, TABLESPACE_VERSION_DIRECTORY) == 0)
 				ptrack_gather_filelist(filelist, subpath, spcOid, InvalidOid);
 		}
-		/* TODO: is it enough to properly check symlink support? */
-#ifndef WIN32
-		else if (S_ISLNK(fst.st_mode))
-#else
-		else if (pgwin32_is_junction(subpath))
-#endif
+		else if (type == PTRACK_DIRENT_LNK)
 		{
 			/*
 			 * We expect that symlinks with only digits in the name to be
 			 * tablespaces
 			 */
-			if (strspn(de->d_name + 1, "0123456789") == strlen(de->d_name + 1))
-				ptrack_gather_filelist(filelist, subpath, atooid(de->d_name), InvalidOid);
+			if (strspn(name + 1, "0123456789") == strlen(name + 1))
+				ptrack_gather_filelist(filelist, subpath, atooid(name), InvalidOid);
 		}
 	}
 
-	FreeDir(dir);				/* we ignore any error here */
+	ptrack_closedir(dir);
+}
+
+/*
+ * Form a list of all data files inside global, base and pg_tblspc.
+ */
+static void
+ptrack_gather_datadir(List **filelist)
+{
+	char		gather_path[MAXPGPATH];
+
+	sprintf(gather_path, "%s/%s", DataDir, "global");
+	ptrack_gather_filelist(filelist, gather_path, GLOBALTABLESPACE_OID, InvalidOid);
+
+	sprintf(gather_path, "%s/%s", DataDir, "base");
+	ptrack_gather_filelist(filelist, gather_path, InvalidOid, InvalidOid);
+
+	sprintf(gather_path, "%s/%s", DataDir, "pg_tblspc");
+	ptrack_gather_filelist(filelist, gather_path, InvalidOid, InvalidOid);
 }
 
+/*
+ * Take the next file from the list and stat it, but do not start the scan
+ * of its segment.  Returns -1 if there are no more files.
+ */
 static int
-ptrack_filelist_getnext(PtScanCtx * ctx)
+ptrack_filelist_stat_next(PtScanCtx * ctx)
 {
 	PtrackFileList_i *pfl = NULL;
 	ListCell   *cell;
@@ -360,12 +927,14 @@ ptrack_filelist_getnext(PtScanCtx * ctx)
 	ctx->bid.forknum = pfl->forknum;
 	ctx->bid.blocknum = 0;
 
+	ptrack_scan_charge(PTRACK_SCAN_COST_STAT);
+
 	if (stat(fullpath, &fst) != 0)
 	{
 		elog(WARNING, "ptrack: cannot stat file %s", fullpath);
 
 		/* But try the next one */
-		return ptrack_filelist_getnext(ctx);
+		return ptrack_filelist_stat_next(ctx);
 	}
 
 	if (pfl->segno > 0)
@@ -382,6 +951,17 @@ ptrack_filelist_getnext(PtScanCtx * ctx)
 	return 0;
 }
 
+static int
+ptrack_filelist_getnext(PtScanCtx * ctx)
+{
+	if (ptrack_filelist_stat_next(ctx) < 0)
+		return -1;
+
+	ptrack_segscan_begin(&ctx->segscan, ctx->bid, ctx->lsn);
+
+	return 0;
+}
+
 /*
  * Returns ptrack version currently in use.
  */
@@ -412,6 +992,16 @@ ptrack_init_lsn(PG_FUNCTION_ARGS)
 	}
 }
 
+/*
+ * Take snapshot of ptrack map by immediate checkpoint and return its LSN.
+ */
+PG_FUNCTION_INFO_V1(ptrack_take_snapshot);
+Datum
+ptrack_take_snapshot(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_LSN(ptrack_snapshot_request());
+}
+
 /*
  * Return set of database blocks which were changed since specified LSN.
  * This function may return false positives (blocks that have not been updated).
@@ -419,13 +1009,79 @@ ptrack_init_lsn(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(ptrack_get_pagemapset);
 Datum
 ptrack_get_pagemapset(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = InvalidXLogRecPtr;
+
+	if (SRF_IS_FIRSTCALL())
+		lsn = PG_GETARG_LSN(0);
+
+	return ptrack_pagemapset_internal(fcinfo, lsn, InvalidXLogRecPtr);
+}
+
+/*
+ * The same as ptrack_get_pagemapset(), but returns blocks changed since
+ * the position of the given slot.  Errors out if ptrack map was not
+ * initialized yet or was reinitialized after the slot position, since map
+ * cannot give a correct answer in that case.
+ */
+PG_FUNCTION_INFO_V1(ptrack_slot_get_pagemapset);
+Datum
+ptrack_slot_get_pagemapset(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = InvalidXLogRecPtr;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		char	   *slot_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+		lsn = ptrack_slot_get_lsn(slot_name);
+		ptrack_check_start_lsn(lsn, "Take a full copy and advance the slot with ptrack_advance_slot().");
+	}
+
+	return ptrack_pagemapset_internal(fcinfo, lsn, InvalidXLogRecPtr);
+}
+
+/*
+ * Return set of database blocks which were changed between two LSNs.
+ * Retained snapshot of the map is used, if it was taken after 'end_lsn',
+ * otherwise it is the same as ptrack_get_pagemapset('start_lsn').
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_pagemapset_range);
+Datum
+ptrack_get_pagemapset_range(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = InvalidXLogRecPtr;
+	XLogRecPtr	end_lsn = InvalidXLogRecPtr;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		lsn = PG_GETARG_LSN(0);
+		end_lsn = PG_GETARG_LSN(1);
+
+		if (end_lsn < lsn)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("end LSN %X/%X precedes start LSN %X/%X",
+							(uint32) (end_lsn >> 32), (uint32) end_lsn,
+							(uint32) (lsn >> 32), (uint32) lsn)));
+	}
+
+	return ptrack_pagemapset_internal(fcinfo, lsn, end_lsn);
+}
+
+/*
+ * Common part of ptrack_get_pagemapset() and ptrack_slot_get_pagemapset().
+ * 'lsn' and 'end_lsn' (if valid) are used only on the first call.
+ */
+static Datum
+ptrack_pagemapset_internal(FunctionCallInfo fcinfo, XLogRecPtr lsn,
+						   XLogRecPtr end_lsn)
 {
 	FuncCallContext *funcctx;
 	PtScanCtx  *ctx;
 	MemoryContext oldcontext;
 	XLogRecPtr	update_lsn;
 	datapagemap_t pagemap;
-	char		gather_path[MAXPGPATH];
 
 	/* Exit immediately if there is no map */
 	if (ptrack_map == NULL)
@@ -440,9 +1096,12 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
 		ctx = (PtScanCtx *) palloc0(sizeof(PtScanCtx));
-		ctx->lsn = PG_GETARG_LSN(0);
+		ctx->lsn = lsn;
 		ctx->filelist = NIL;
 
+		if (end_lsn != InvalidXLogRecPtr)
+			ctx->snapshot = ptrack_snapshot_load(lsn, end_lsn);
+
 		/* Make tuple descriptor */
 #if PG_VERSION_NUM >= 120000
 		tupdesc = CreateTemplateTupleDesc(2);
@@ -461,14 +1120,7 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 		 * TODO: refactor it to do not form a list, but use iterator instead,
 		 * e.g. just ptrack_filelist_getnext(ctx).
 		 */
-		sprintf(gather_path, "%s/%s", DataDir, "global");
-		ptrack_gather_filelist(&ctx->filelist, gather_path, GLOBALTABLESPACE_OID, InvalidOid);
-
-		sprintf(gather_path, "%s/%s", DataDir, "base");
-		ptrack_gather_filelist(&ctx->filelist, gather_path, InvalidOid, InvalidOid);
-
-		sprintf(gather_path, "%s/%s", DataDir, "pg_tblspc");
-		ptrack_gather_filelist(&ctx->filelist, gather_path, InvalidOid, InvalidOid);
+		ptrack_gather_datadir(&ctx->filelist);
 
 		MemoryContextSwitchTo(oldcontext);
 	}
@@ -489,6 +1141,8 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 		/* Stop traversal if there are no more segments */
 		if (ctx->bid.blocknum > ctx->relsize)
 		{
+			ptrack_segscan_end(&ctx->segscan);
+
 			/* We completed a segment and there is a bitmap to return */
 			if (pagemap.bitmap != NULL)
 			{
@@ -525,7 +1179,14 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 			}
 		}
 
-		update_lsn = pg_atomic_read_u64(&ptrack_map->entries[BID_HASH_FUNC(ctx->bid)]);
+		if (ctx->snapshot != NULL)
+		{
+			/* Snapshot already has blocks of hot segments merged in */
+			ptrack_scan_charge(PTRACK_SCAN_COST_MAP);
+			update_lsn = ctx->snapshot[BID_HASH_FUNC(ctx->bid)];
+		}
+		else
+			update_lsn = ptrack_segscan_get(&ctx->segscan, ctx->bid.blocknum);
 
 		if (update_lsn != InvalidXLogRecPtr)
 			elog(DEBUG3, "ptrack: update_lsn %X/%X of blckno %u of file %s",
@@ -539,3 +1200,1488 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 		ctx->bid.blocknum += 1;
 	}
 }
+
+/*
+ * Create new ptrack slot.  If 'start_lsn' is NULL, slot starts at
+ * the current LSN.
+ */
+PG_FUNCTION_INFO_V1(ptrack_create_slot);
+Datum
+ptrack_create_slot(PG_FUNCTION_ARGS)
+{
+	char	   *slot_name;
+	XLogRecPtr	lsn = InvalidXLogRecPtr;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "ptrack slot name cannot be NULL");
+
+	slot_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+	if (!PG_ARGISNULL(1))
+		lsn = PG_GETARG_LSN(1);
+
+	PG_RETURN_LSN(ptrack_slot_create(slot_name, lsn));
+}
+
+/*
+ * Drop existing ptrack slot.
+ */
+PG_FUNCTION_INFO_V1(ptrack_drop_slot);
+Datum
+ptrack_drop_slot(PG_FUNCTION_ARGS)
+{
+	ptrack_slot_drop(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Move slot position forward, e.g. after consumer durably stored all
+ * changes returned by ptrack_slot_get_pagemapset().  Returns new position.
+ */
+PG_FUNCTION_INFO_V1(ptrack_advance_slot);
+Datum
+ptrack_advance_slot(PG_FUNCTION_ARGS)
+{
+	char	   *slot_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	XLogRecPtr	upto_lsn = PG_GETARG_LSN(1);
+
+	PG_RETURN_LSN(ptrack_slot_advance(slot_name, upto_lsn));
+}
+
+/*
+ * Return all ptrack slots with number of pages changed since their positions.
+ * Map is scanned only once for all slots.  Slots, which positions precede
+ * ptrack init_lsn, are reported as invalid and without lag.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_slots);
+Datum
+ptrack_get_slots(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PtrackSlot *slots;
+	int64	   *changed;
+	bool	   *valid;
+	int			nslots;
+	int			i;
+	XLogRecPtr	init_lsn;
+	PtScanCtx	ctx;
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+
+	nslots = ptrack_slots_snapshot(&slots);
+	changed = (int64 *) palloc0(sizeof(int64) * Max(nslots, 1));
+	valid = (bool *) palloc0(sizeof(bool) * Max(nslots, 1));
+
+	/* Count changed pages of all valid slots in a single pass over PGDATA */
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = PG_UINT64_MAX;
+
+	init_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
+	for (i = 0; i < nslots; i++)
+	{
+		valid[i] = (init_lsn != InvalidXLogRecPtr && slots[i].lsn >= init_lsn);
+
+		/* Segments are looked up since the oldest position */
+		if (valid[i])
+			ctx.lsn = Min(ctx.lsn, slots[i].lsn);
+	}
+	if (nslots > 0)
+		ptrack_gather_datadir(&ctx.filelist);
+
+	while (ptrack_filelist_getnext(&ctx) == 0)
+	{
+		for (; ctx.bid.blocknum < ctx.relsize; ctx.bid.blocknum++)
+		{
+			XLogRecPtr	update_lsn;
+
+			update_lsn = ptrack_segscan_get(&ctx.segscan, ctx.bid.blocknum);
+
+			for (i = 0; i < nslots; i++)
+			{
+				if (valid[i] && update_lsn >= slots[i].lsn)
+					changed[i]++;
+			}
+		}
+
+		ptrack_segscan_end(&ctx.segscan);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+
+	for (i = 0; i < nslots; i++)
+	{
+		Datum		values[4];
+		bool		nulls[4] = {false};
+
+		values[0] = CStringGetTextDatum(NameStr(slots[i].name));
+		values[1] = LSNGetDatum(slots[i].lsn);
+		values[2] = BoolGetDatum(valid[i]);
+		if (valid[i])
+			values[3] = Int64GetDatum(changed[i]);
+		else
+			nulls[3] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/* Most recently written blocks go first */
+static int
+ptrack_recent_block_cmp_lsn(const void *a, const void *b)
+{
+	const PtrackRecentBlock *ba = (const PtrackRecentBlock *) a;
+	const PtrackRecentBlock *bb = (const PtrackRecentBlock *) b;
+
+	if (ba->lsn > bb->lsn)
+		return -1;
+	else if (ba->lsn < bb->lsn)
+		return 1;
+	return 0;
+}
+
+/* Physical order, the same as used by autoprewarm */
+static int
+ptrack_recent_block_cmp(const void *a, const void *b)
+{
+	const PtrackRecentBlock *ba = (const PtrackRecentBlock *) a;
+	const PtrackRecentBlock *bb = (const PtrackRecentBlock *) b;
+
+	if (ba->database != bb->database)
+		return ba->database > bb->database ? 1 : -1;
+	if (ba->tablespace != bb->tablespace)
+		return ba->tablespace > bb->tablespace ? 1 : -1;
+	if (ba->filenode != bb->filenode)
+		return ba->filenode > bb->filenode ? 1 : -1;
+	if (ba->forknum != bb->forknum)
+		return ba->forknum > bb->forknum ? 1 : -1;
+	if (ba->blocknum != bb->blocknum)
+		return ba->blocknum > bb->blocknum ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Collect blocks written since 'start_lsn' in physical order.  Loading more
+ * blocks than fit into shared buffers is useless, so only NBuffers most
+ * recently written ones are kept.  Returns the number of blocks.
+ */
+static int
+ptrack_collect_recent_blocks(XLogRecPtr start_lsn, PtrackRecentBlock **blocks)
+{
+	PtScanCtx	ctx;
+	int64		nblocks = 0;
+	int64		maxblocks = Min(1024, 2 * (int64) NBuffers);
+
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	*blocks = (PtrackRecentBlock *) palloc(maxblocks * sizeof(PtrackRecentBlock));
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = start_lsn;
+	ptrack_gather_datadir(&ctx.filelist);
+
+	while (ptrack_filelist_getnext(&ctx) == 0)
+	{
+		for (; ctx.bid.blocknum < ctx.relsize; ctx.bid.blocknum++)
+		{
+			XLogRecPtr	update_lsn;
+			PtrackRecentBlock *block;
+
+			update_lsn = ptrack_segscan_get(&ctx.segscan, ctx.bid.blocknum);
+			if (update_lsn < start_lsn)
+				continue;
+
+			if (nblocks == maxblocks)
+			{
+				if (maxblocks < 2 * (int64) NBuffers)
+				{
+					maxblocks = Min(maxblocks * 2, 2 * (int64) NBuffers);
+					*blocks = (PtrackRecentBlock *)
+						repalloc_huge(*blocks, maxblocks * sizeof(PtrackRecentBlock));
+				}
+				else
+				{
+					/* Throw away the older half */
+					qsort(*blocks, nblocks, sizeof(PtrackRecentBlock),
+						  ptrack_recent_block_cmp_lsn);
+					nblocks = NBuffers;
+				}
+			}
+
+			block = &(*blocks)[nblocks++];
+			block->database = ctx.bid.relnode.dbNode;
+			block->tablespace = ctx.bid.relnode.spcNode;
+			block->filenode = ctx.bid.relnode.relNode;
+			block->forknum = ctx.bid.forknum;
+			block->blocknum = ctx.bid.blocknum;
+			block->lsn = update_lsn;
+		}
+
+		ptrack_segscan_end(&ctx.segscan);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	if (nblocks > NBuffers)
+	{
+		qsort(*blocks, nblocks, sizeof(PtrackRecentBlock),
+			  ptrack_recent_block_cmp_lsn);
+		nblocks = NBuffers;
+	}
+
+	qsort(*blocks, nblocks, sizeof(PtrackRecentBlock), ptrack_recent_block_cmp);
+
+	return (int) nblocks;
+}
+
+/*
+ * Return blocks written since specified LSN in physical order, so they can
+ * be loaded into shared buffers, e.g. by pg_prewarm() after failover.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_recent_blocks);
+Datum
+ptrack_get_recent_blocks(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	start_lsn = PG_GETARG_LSN(0);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PtrackRecentBlock *blocks;
+	int			nblocks;
+	int			i;
+
+	nblocks = ptrack_collect_recent_blocks(start_lsn, &blocks);
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+
+	for (i = 0; i < nblocks; i++)
+	{
+		Datum		values[5];
+		bool		nulls[5] = {false};
+
+		values[0] = ObjectIdGetDatum(blocks[i].database);
+		values[1] = ObjectIdGetDatum(blocks[i].tablespace);
+		values[2] = ObjectIdGetDatum(blocks[i].filenode);
+		values[3] = Int32GetDatum(blocks[i].forknum);
+		values[4] = Int64GetDatum(blocks[i].blocknum);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	pfree(blocks);
+
+	return (Datum) 0;
+}
+
+/*
+ * Write blocks written since specified LSN to PTRACK_PREWARM_FILE, so that
+ * autoprewarm worker of pg_prewarm loads them on its first start.  Returns
+ * the number of blocks written.
+ */
+PG_FUNCTION_INFO_V1(ptrack_dump_prewarm);
+Datum
+ptrack_dump_prewarm(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	start_lsn = PG_GETARG_LSN(0);
+	PtrackRecentBlock *blocks;
+	int			nblocks;
+	int			i;
+	char		path[MAXPGPATH];
+	char		path_tmp[MAXPGPATH];
+	FILE	   *fp;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to dump ptrack prewarm file")));
+
+	nblocks = ptrack_collect_recent_blocks(start_lsn, &blocks);
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_PREWARM_FILE);
+	sprintf(path_tmp, "%s/%s", DataDir, PTRACK_PREWARM_FILE_TMP);
+
+	fp = AllocateFile(path_tmp, "w");
+	if (fp == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path_tmp)));
+
+	fprintf(fp, "<<%d>>\n", nblocks);
+	for (i = 0; i < nblocks; i++)
+		fprintf(fp, "%u,%u,%u,%u,%u\n",
+				blocks[i].database, blocks[i].tablespace, blocks[i].filenode,
+				(uint32) blocks[i].forknum, blocks[i].blocknum);
+
+	if (ferror(fp) || FreeFile(fp) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path_tmp)));
+
+	durable_rename(path_tmp, path, ERROR);
+
+	pfree(blocks);
+
+	PG_RETURN_INT64(nblocks);
+}
+
+/*
+ * Write blocks changed since specified LSN and up to the redo LSN of the last
+ * checkpoint into PTRACK_SUMMARY_DIR as a WAL summary file of PostgreSQL 17.
+ * All blocks changed before the redo LSN were written by that checkpoint at
+ * the latest, so they are marked in the map already.  Returns path of the
+ * file relative to PGDATA.
+ */
+PG_FUNCTION_INFO_V1(ptrack_write_wal_summary);
+Datum
+ptrack_write_wal_summary(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	start_lsn = PG_GETARG_LSN(0);
+	XLogRecPtr	end_lsn;
+	TimeLineID	tli;
+	ControlFileData *control_file;
+	bool		crc_ok;
+	PtScanCtx	ctx;
+	PtrackBlockRefTable *brt;
+	char		dirpath[MAXPGPATH];
+	char		relpath[MAXPGPATH];
+	char		path[MAXPGPATH];
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to write ptrack WAL summary")));
+
+	ptrack_check_start_lsn(start_lsn, NULL);
+
+#if PG_VERSION_NUM >= 120000
+	control_file = get_controlfile(DataDir, &crc_ok);
+#else
+	control_file = get_controlfile(DataDir, NULL, &crc_ok);
+#endif
+
+	/* Control file may be concurrently rewritten by checkpointer */
+	if (!crc_ok)
+		ereport(ERROR,
+				(errmsg("ptrack: calculated CRC checksum does not match value stored in control file"),
+				 errhint("Try again.")));
+
+	end_lsn = control_file->checkPointCopy.redo;
+	tli = control_file->checkPointCopy.ThisTimeLineID;
+	pfree(control_file);
+
+	if (end_lsn <= start_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("no checkpoint was started after LSN %X/%X",
+						(uint32) (start_lsn >> 32), (uint32) start_lsn),
+				 errhint("Run CHECKPOINT first.")));
+
+	brt = ptrack_brt_create();
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = start_lsn;
+	ptrack_gather_datadir(&ctx.filelist);
+
+	while (ptrack_filelist_getnext(&ctx) == 0)
+	{
+		for (; ctx.bid.blocknum < ctx.relsize; ctx.bid.blocknum++)
+		{
+			if (ptrack_segscan_get(&ctx.segscan, ctx.bid.blocknum) >= start_lsn)
+				ptrack_brt_mark(brt, ctx.bid.relnode, ctx.bid.forknum,
+								ctx.bid.blocknum);
+		}
+
+		ptrack_segscan_end(&ctx.segscan);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	sprintf(dirpath, "%s/%s", DataDir, PTRACK_SUMMARY_DIR);
+	if (MakePGDirectory(dirpath) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", dirpath)));
+
+	/* The same name as given by WAL summarizer */
+	snprintf(relpath, sizeof(relpath), "%s/%08X%08X%08X%08X%08X.summary",
+			 PTRACK_SUMMARY_DIR, tli,
+			 (uint32) (start_lsn >> 32), (uint32) start_lsn,
+			 (uint32) (end_lsn >> 32), (uint32) end_lsn);
+	sprintf(path, "%s/%s", DataDir, relpath);
+
+	ptrack_brt_write(brt, path);
+	ptrack_brt_destroy(brt);
+
+	PG_RETURN_TEXT_P(cstring_to_text(relpath));
+}
+
+/*
+ * Return memory stats of ptrack map: number of its pages and pages resident
+ * in memory, whether it was prefaulted and locked, and number of page faults
+ * taken to restore and prefault it at server start.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_map_stats);
+Datum
+ptrack_get_map_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6] = {false};
+	PtrackMapStats stats;
+	int64		npages;
+	int64		nresident;
+
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	ptrack_map_get_stats(&stats, &npages, &nresident);
+
+	values[0] = Int64GetDatum(npages);
+	if (nresident >= 0)
+		values[1] = Int64GetDatum(nresident);
+	else
+		nulls[1] = true;
+	values[2] = BoolGetDatum(stats.prefaulted);
+	values[3] = BoolGetDatum(stats.locked);
+	values[4] = Int64GetDatum(stats.major_faults);
+	values[5] = Int64GetDatum(stats.minor_faults);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+static void
+ptrack_file_key_make(PtrackFileKey * key, const PtrackFileList_i * pfl)
+{
+	key->spcOid = pfl->relnode.spcNode;
+	key->dbOid = pfl->relnode.dbNode;
+	key->relNode = pfl->relnode.relNode;
+	key->forknum = pfl->forknum;
+	key->segno = pfl->segno;
+}
+
+static int
+ptrack_file_key_cmp(const PtrackFileKey * a, const PtrackFileKey * b)
+{
+	if (a->spcOid != b->spcOid)
+		return a->spcOid > b->spcOid ? 1 : -1;
+	if (a->dbOid != b->dbOid)
+		return a->dbOid > b->dbOid ? 1 : -1;
+	if (a->relNode != b->relNode)
+		return a->relNode > b->relNode ? 1 : -1;
+	if (a->forknum != b->forknum)
+		return a->forknum > b->forknum ? 1 : -1;
+	if (a->segno != b->segno)
+		return a->segno > b->segno ? 1 : -1;
+	return 0;
+}
+
+static int
+ptrack_filelist_cmp(const void *a, const void *b)
+{
+	PtrackFileKey ka;
+	PtrackFileKey kb;
+
+	ptrack_file_key_make(&ka, *(PtrackFileList_i * const *) a);
+	ptrack_file_key_make(&kb, *(PtrackFileList_i * const *) b);
+
+	return ptrack_file_key_cmp(&ka, &kb);
+}
+
+/*
+ * Whether database directory may hold files of the cursor range.
+ */
+static bool
+ptrack_cursor_covers_db(const PtrackCursor * cursor, Oid spcOid, Oid dbOid)
+{
+	PtrackFileKey key;
+
+	if (cursor->dbOid != InvalidOid && cursor->dbOid != dbOid)
+		return false;
+
+	/* The least key of the database */
+	key.spcOid = spcOid;
+	key.dbOid = dbOid;
+	key.relNode = 0;
+	key.forknum = 0;
+	key.segno = 0;
+	if (cursor->has_end && ptrack_file_key_cmp(&key, &cursor->end) >= 0)
+		return false;
+
+	/* The greatest key of the database */
+	key.relNode = PG_UINT32_MAX;
+	key.forknum = INT_MAX;
+	key.segno = INT_MAX;
+	if (cursor->has_pos && ptrack_file_key_cmp(&key, &cursor->pos) <= 0)
+		return false;
+
+	return true;
+}
+
+/*
+ * Gather data files of database directories inside 'path', which may hold
+ * files of the cursor range.
+ */
+static void
+ptrack_gather_cursor_dbs(List **filelist, const char *path, Oid spcOid,
+						 const PtrackCursor * cursor)
+{
+	PtrackDir  *dir;
+	const char *name;
+	PtrackDirentType type;
+
+	dir = ptrack_opendir(path);
+
+	while ((name = ptrack_readdir(dir, &type, LOG)) != NULL)
+	{
+		char		subpath[MAXPGPATH * 2];
+		Oid			dbOid;
+
+		ptrack_scan_delay_point();
+
+		if (type != PTRACK_DIRENT_DIR ||
+			strspn(name, "0123456789") != strlen(name))
+			continue;
+
+		dbOid = atooid(name);
+		if (!ptrack_cursor_covers_db(cursor, spcOid, dbOid))
+			continue;
+
+		snprintf(subpath, sizeof(subpath), "%s/%s", path, name);
+		ptrack_gather_filelist(filelist, subpath,
+							   spcOid == DEFAULTTABLESPACE_OID ? InvalidOid : spcOid,
+							   dbOid);
+	}
+
+	ptrack_closedir(dir);
+}
+
+/*
+ * Form a list of data files of the cursor range.  Only directories of
+ * databases, which may hold such files, are listed, so fetching the next
+ * chunk does not walk the whole PGDATA.
+ */
+static void
+ptrack_gather_cursor(List **filelist, const PtrackCursor * cursor)
+{
+	char		path[MAXPGPATH];
+	PtrackDir  *dir;
+	const char *name;
+	PtrackDirentType type;
+
+	if (ptrack_cursor_covers_db(cursor, GLOBALTABLESPACE_OID, InvalidOid))
+	{
+		snprintf(path, sizeof(path), "%s/global", DataDir);
+		ptrack_gather_filelist(filelist, path, GLOBALTABLESPACE_OID, InvalidOid);
+	}
+
+	snprintf(path, sizeof(path), "%s/base", DataDir);
+	ptrack_gather_cursor_dbs(filelist, path, DEFAULTTABLESPACE_OID, cursor);
+
+	snprintf(path, sizeof(path), "%s/pg_tblspc", DataDir);
+	dir = ptrack_opendir(path);
+
+	while ((name = ptrack_readdir(dir, &type, LOG)) != NULL)
+	{
+		char		subpath[MAXPGPATH * 2];
+		Oid			spcOid;
+
+		if (type != PTRACK_DIRENT_LNK ||
+			strspn(name, "0123456789") != strlen(name))
+			continue;
+
+		/* Tablespace is out of the range, if all its databases are */
+		spcOid = atooid(name);
+		if ((cursor->has_pos && spcOid < cursor->pos.spcOid) ||
+			(cursor->has_end && spcOid > cursor->end.spcOid))
+			continue;
+
+		snprintf(subpath, sizeof(subpath), "%s/%s/%s", path, name,
+				 TABLESPACE_VERSION_DIRECTORY);
+		ptrack_gather_cursor_dbs(filelist, subpath, spcOid, cursor);
+	}
+
+	ptrack_closedir(dir);
+}
+
+/*
+ * Form an array of data files of the cursor range sorted by their keys.
+ */
+static PtrackFileList_i * *
+ptrack_gather_sorted(const PtrackCursor * cursor, int *nfiles)
+{
+	List	   *filelist = NIL;
+	PtrackFileList_i **files;
+	ListCell   *cell;
+	int			i = 0;
+
+	ptrack_gather_cursor(&filelist, cursor);
+
+	*nfiles = list_length(filelist);
+	files = palloc(Max(*nfiles, 1) * sizeof(PtrackFileList_i *));
+	foreach(cell, filelist)
+		files[i++] = (PtrackFileList_i *) lfirst(cell);
+	list_free(filelist);
+
+	qsort(files, *nfiles, sizeof(PtrackFileList_i *), ptrack_filelist_cmp);
+
+	return files;
+}
+
+static void
+ptrack_file_key_encode(StringInfo buf, bool valid, const PtrackFileKey * key)
+{
+	if (valid)
+		appendStringInfo(buf, "%u.%u.%u.%d.%d", key->spcOid, key->dbOid,
+						 key->relNode, key->forknum, key->segno);
+	else
+		appendStringInfoChar(buf, '-');
+}
+
+static bool
+ptrack_file_key_decode(const char *str, bool *valid, PtrackFileKey * key)
+{
+	int			pos = 0;
+
+	if (strcmp(str, "-") == 0)
+	{
+		*valid = false;
+		return true;
+	}
+
+	*valid = true;
+	return sscanf(str, "%u.%u.%u.%d.%d%n", &key->spcOid, &key->dbOid,
+				  &key->relNode, &key->forknum, &key->segno, &pos) == 5 &&
+		str[pos] == '\0';
+}
+
+/*
+ * Resume token is "version:LSN:database:pos:end", where 'database' is OID
+ * of the only database scanned or 0, 'pos' and 'end' are keys of files or
+ * "-".  Clients should treat it as an opaque string.
+ */
+static text *
+ptrack_cursor_encode(const PtrackCursor * cursor)
+{
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%d:%X/%X:%u:", PTRACK_CURSOR_VERSION,
+					 (uint32) (cursor->lsn >> 32), (uint32) cursor->lsn,
+					 cursor->dbOid);
+	ptrack_file_key_encode(&buf, cursor->has_pos, &cursor->pos);
+	appendStringInfoChar(&buf, ':');
+	ptrack_file_key_encode(&buf, cursor->has_end, &cursor->end);
+
+	return cstring_to_text(buf.data);
+}
+
+static void
+ptrack_cursor_decode(const char *token, PtrackCursor * cursor)
+{
+	char	   *str = pstrdup(token);
+	char	   *fields[5];
+	int			nfields = 0;
+	char	   *p = str;
+	uint32		hi;
+	uint32		lo;
+	int			len = 0;
+
+	for (;;)
+	{
+		char	   *sep = strchr(p, ':');
+
+		if (nfields == lengthof(fields))
+			goto invalid;
+		fields[nfields++] = p;
+		if (sep == NULL)
+			break;
+		*sep = '\0';
+		p = sep + 1;
+	}
+
+	if (nfields != 5 || atoi(fields[0]) != PTRACK_CURSOR_VERSION ||
+		sscanf(fields[1], "%X/%X%n", &hi, &lo, &len) != 2 ||
+		fields[1][len] != '\0' ||
+		sscanf(fields[2], "%u%n", &cursor->dbOid, &len) != 1 ||
+		fields[2][len] != '\0' ||
+		!ptrack_file_key_decode(fields[3], &cursor->has_pos, &cursor->pos) ||
+		!ptrack_file_key_decode(fields[4], &cursor->has_end, &cursor->end))
+		goto invalid;
+
+	cursor->lsn = ((uint64) hi << 32) | lo;
+	pfree(str);
+	return;
+
+invalid:
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid ptrack cursor token \"%s\"", token)));
+}
+
+/*
+ * Prepare materialized result of set returning function.  Row type of the
+ * result is taken from the declaration of the function.
+ */
+static Tuplestorestate *
+ptrack_materialize_init(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	Oid			typid;
+
+	/* Check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	switch (get_call_result_type(fcinfo, &typid, tupdesc))
+	{
+		case TYPEFUNC_COMPOSITE:
+			break;
+		case TYPEFUNC_SCALAR:
+#if PG_VERSION_NUM >= 120000
+			*tupdesc = CreateTemplateTupleDesc(1);
+#else
+			*tupdesc = CreateTemplateTupleDesc(1, false);
+#endif
+			TupleDescInitEntry(*tupdesc, (AttrNumber) 1, NULL, typid, -1, 0);
+			break;
+		default:
+			elog(ERROR, "return type must be a row type or a scalar");
+	}
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * Open pagemapset cursor returning blocks changed since specified LSN in
+ * files of the given database (or of all databases, if it is 0).  Returns
+ * up to 'parts' resume tokens, which split these files into disjoint ranges
+ * of about the same number of files, so that several agents can scan them
+ * in parallel.
+ */
+PG_FUNCTION_INFO_V1(ptrack_pagemapset_cursor);
+Datum
+ptrack_pagemapset_cursor(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = PG_GETARG_LSN(0);
+	int			parts = PG_GETARG_INT32(1);
+	Oid			dbOid = PG_GETARG_OID(2);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PtrackCursor all;
+	PtrackFileList_i **files;
+	int			nfiles;
+	int			k;
+
+	if (parts < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of ptrack cursor parts must be positive")));
+
+	ptrack_check_start_lsn(lsn, NULL);
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+
+	all.lsn = lsn;
+	all.dbOid = dbOid;
+	all.has_pos = false;
+	all.has_end = false;
+	files = ptrack_gather_sorted(&all, &nfiles);
+
+	/* Every part but the last one has at least one file */
+	parts = Max(Min(parts, nfiles), 1);
+
+	for (k = 0; k < parts; k++)
+	{
+		PtrackCursor cursor = all;
+		int			lo = (int) ((int64) k * nfiles / parts);
+		int			hi = (int) ((int64) (k + 1) * nfiles / parts);
+		Datum		value;
+		bool		isnull = false;
+
+		cursor.has_pos = (lo > 0);
+		if (cursor.has_pos)
+			ptrack_file_key_make(&cursor.pos, files[lo - 1]);
+
+		/* Last part takes also files created after the cursor */
+		cursor.has_end = (k < parts - 1);
+		if (cursor.has_end)
+			ptrack_file_key_make(&cursor.end, files[hi]);
+
+		value = PointerGetDatum(ptrack_cursor_encode(&cursor));
+		tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return changed files of the cursor range after the resume token position,
+ * scanning at most 'max_files' files.  Each row carries the token to resume
+ * after it.  The last row has NULL path and the token to resume after all
+ * scanned files, or NULL token, if the range is exhausted.
+ */
+PG_FUNCTION_INFO_V1(ptrack_pagemapset_fetch);
+Datum
+ptrack_pagemapset_fetch(PG_FUNCTION_ARGS)
+{
+	char	   *token = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int			max_files = PG_GETARG_INT32(1);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PtrackCursor cursor;
+	PtrackFileList_i **files;
+	PtScanCtx	ctx;
+	int			nfiles;
+	int			nscanned = 0;
+	int			i = 0;
+	bool		done = true;
+	Datum		values[3];
+	bool		nulls[3] = {false};
+
+	if (max_files < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of files to fetch must be positive")));
+
+	ptrack_cursor_decode(token, &cursor);
+	ptrack_check_start_lsn(cursor.lsn, NULL);
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+	files = ptrack_gather_sorted(&cursor, &nfiles);
+
+	/* Skip files returned before */
+	if (cursor.has_pos)
+	{
+		int			hi = nfiles;
+
+		while (i < hi)
+		{
+			int			mid = i + (hi - i) / 2;
+			PtrackFileKey key;
+
+			ptrack_file_key_make(&key, files[mid]);
+			if (ptrack_file_key_cmp(&key, &cursor.pos) <= 0)
+				i = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = cursor.lsn;
+
+	for (; i < nfiles; i++)
+	{
+		PtrackFileKey key;
+		datapagemap_t pagemap;
+
+		ptrack_file_key_make(&key, files[i]);
+		if (cursor.has_end && ptrack_file_key_cmp(&key, &cursor.end) >= 0)
+			break;
+
+		if (nscanned++ == max_files)
+		{
+			done = false;
+			break;
+		}
+
+		cursor.has_pos = true;
+		cursor.pos = key;
+
+		/* File may be already removed */
+		ctx.filelist = list_make1(files[i]);
+		if (ptrack_filelist_getnext(&ctx) < 0)
+			continue;
+
+		pagemap.bitmap = NULL;
+		pagemap.bitmapsize = 0;
+
+		for (; ctx.bid.blocknum < ctx.relsize; ctx.bid.blocknum++)
+		{
+			if (ptrack_segscan_get(&ctx.segscan, ctx.bid.blocknum) >= ctx.lsn)
+				datapagemap_add(&pagemap, ctx.bid.blocknum % ((BlockNumber) RELSEG_SIZE));
+		}
+
+		ptrack_segscan_end(&ctx.segscan);
+
+		if (pagemap.bitmap != NULL)
+		{
+			bytea	   *result = (bytea *) palloc(pagemap.bitmapsize + VARHDRSZ);
+
+			SET_VARSIZE(result, pagemap.bitmapsize + VARHDRSZ);
+			memcpy(VARDATA(result), pagemap.bitmap, pagemap.bitmapsize);
+
+			values[0] = CStringGetTextDatum(ctx.relpath);
+			values[1] = PointerGetDatum(result);
+			values[2] = PointerGetDatum(ptrack_cursor_encode(&cursor));
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+			pfree(pagemap.bitmap);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	nulls[0] = true;
+	nulls[1] = true;
+	if (done)
+		nulls[2] = true;
+	else
+		values[2] = PointerGetDatum(ptrack_cursor_encode(&cursor));
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+static const char *const ptrack_sim_hash_names[] = {"hash_any", "crc32c", "fnv1a"};
+static const char *const ptrack_sim_layout_names[] = {"hashed", "contiguous", "segment"};
+
+static int
+ptrack_sim_name_lookup(const char *name, const char *const *names, int nnames,
+					   const char *what)
+{
+	int			i;
+
+	for (i = 0; i < nnames; i++)
+		if (strcmp(name, names[i]) == 0)
+			return i;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown %s \"%s\"", what, name)));
+	return -1;					/* keep compiler quiet */
+}
+
+/*
+ * Replay trace captured with ptrack.trace_file against maps of every given
+ * size, hash function and layout.  For each of them return the number of
+ * blocks changed since 'start_lsn' and of blocks reported as changed by the
+ * map, i.e. the size of incremental backup, and the speed of marking.  Only
+ * traced blocks are checked, unless 'scan_datadir' is set, in which case
+ * false positives among all blocks of the current data files are counted
+ * as well.
+ */
+PG_FUNCTION_INFO_V1(ptrack_simulate_trace);
+Datum
+ptrack_simulate_trace(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	XLogRecPtr	start_lsn = PG_GETARG_LSN(4);
+	bool		scan_datadir = PG_GETARG_BOOL(5);
+	Datum	   *sizes;
+	Datum	   *hashes;
+	Datum	   *layouts;
+	int			nsizes;
+	int			nhashes;
+	int			nlayouts;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PtrackSim  *sim;
+	int			i;
+	int			j;
+	int			k;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to simulate ptrack trace")));
+
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), INT4OID, sizeof(int32), true, 'i',
+					  &sizes, NULL, &nsizes);
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(2), TEXTOID, -1, false, 'i',
+					  &hashes, NULL, &nhashes);
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(3), TEXTOID, -1, false, 'i',
+					  &layouts, NULL, &nlayouts);
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+	sim = ptrack_sim_begin(path, start_lsn);
+
+	for (i = 0; i < nsizes; i++)
+	{
+		int32		map_size = DatumGetInt32(sizes[i]);
+		uint64		nentries;
+
+		if (map_size <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("map size must be positive")));
+
+		/* The same number of entries as ptrack.map_size gives */
+		nentries = ((uint64) map_size * 1024 * 1024 - offsetof(PtrackMapHdr, entries)) /
+			sizeof(PtrackMapEntry);
+
+		for (j = 0; j < nhashes; j++)
+		{
+			char	   *hash = TextDatumGetCString(hashes[j]);
+			int			hash_id = ptrack_sim_name_lookup(hash, ptrack_sim_hash_names,
+														 lengthof(ptrack_sim_hash_names),
+														 "hash function");
+
+			for (k = 0; k < nlayouts; k++)
+			{
+				char	   *layout = TextDatumGetCString(layouts[k]);
+				int			layout_id = ptrack_sim_name_lookup(layout, ptrack_sim_layout_names,
+															   lengthof(ptrack_sim_layout_names),
+															   "layout");
+				double		secs;
+				uint64		changed;
+				uint64		reported;
+				Datum		values[9];
+				bool		nulls[9] = {false};
+
+				secs = ptrack_sim_replay(sim, nentries, (PtrackSimHash) hash_id,
+										 (PtrackSimLayout) layout_id);
+				ptrack_sim_count(sim, &changed, &reported);
+
+				if (scan_datadir)
+				{
+					PtScanCtx	ctx;
+
+					MemSet(&ctx, 0, sizeof(ctx));
+					ctx.lsn = sim->start_lsn;
+					ptrack_gather_datadir(&ctx.filelist);
+
+					while (ptrack_filelist_getnext(&ctx) == 0)
+					{
+						for (; ctx.bid.blocknum < ctx.relsize; ctx.bid.blocknum++)
+						{
+							/* Traced blocks are already counted */
+							if (ptrack_sim_lookup(sim, ctx.bid) >= sim->start_lsn &&
+								!ptrack_sim_is_traced(sim, ctx.bid))
+								reported++;
+						}
+
+						ptrack_segscan_end(&ctx.segscan);
+						CHECK_FOR_INTERRUPTS();
+					}
+				}
+
+				values[0] = Int32GetDatum(map_size);
+				values[1] = CStringGetTextDatum(hash);
+				values[2] = CStringGetTextDatum(layout);
+				values[3] = Int64GetDatum((int64) sim->nmarks);
+				values[4] = Int64GetDatum((int64) changed);
+				values[5] = Int64GetDatum((int64) reported);
+				values[6] = Float8GetDatum(reported > 0 ?
+										   (double) (reported - changed) / reported : 0.0);
+				values[7] = Int64GetDatum((int64) reported * BLCKSZ);
+				if (secs > 0)
+					values[8] = Float8GetDatum(sim->nmarks / secs);
+				else
+					nulls[8] = true;
+
+				tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			}
+		}
+	}
+
+	ptrack_sim_end(sim);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return all data files with their size and whether they were changed since
+ * specified LSN.  Unlike ptrack_get_pagemapset(), lookup of each file stops
+ * at its first changed block and no bitmap is built, so it is much cheaper
+ * for clusters with many small relations.  Changed files of up to
+ * 'whole_file_blocks' blocks are marked to be copied whole, since a bitmap
+ * of them would not save much anyway.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_changed_files);
+Datum
+ptrack_get_changed_files(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = PG_GETARG_LSN(0);
+	int32		whole_file_blocks = PG_GETARG_INT32(1);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PtScanCtx	ctx;
+
+	ptrack_check_start_lsn(lsn, NULL);
+
+	if (whole_file_blocks < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of blocks must not be negative")));
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = lsn;
+	ptrack_gather_datadir(&ctx.filelist);
+
+	while (ptrack_filelist_getnext(&ctx) == 0)
+	{
+		BlockNumber nblocks = ctx.relsize - ctx.bid.blocknum;
+		bool		changed = false;
+		Datum		values[4];
+		bool		nulls[4] = {false};
+
+		/* The first changed block is enough */
+		for (; ctx.bid.blocknum < ctx.relsize; ctx.bid.blocknum++)
+		{
+			if (ptrack_segscan_get(&ctx.segscan, ctx.bid.blocknum) >= ctx.lsn)
+			{
+				changed = true;
+				break;
+			}
+		}
+
+		ptrack_segscan_end(&ctx.segscan);
+
+		values[0] = CStringGetTextDatum(ctx.relpath);
+		values[1] = Int64GetDatum((int64) nblocks * BLCKSZ);
+		values[2] = BoolGetDatum(changed);
+		values[3] = BoolGetDatum(changed && nblocks <= (BlockNumber) whole_file_blocks);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/* Changes of blocks of a single tablespace, see ptrack_estimate_changes() */
+typedef struct PtrackEstimateStratum
+{
+	Oid			spcoid;
+	uint64		nblocks;
+	uint64		nsampled;
+	uint64		nchanged;
+}			PtrackEstimateStratum;
+
+/*
+ * Number of blocks to skip before the next sampled one, so that every block
+ * is sampled independently with probability 'fraction'.
+ */
+static inline uint64
+ptrack_estimate_skip(double fraction)
+{
+	double		u;
+
+	if (fraction >= 1.0)
+		return 0;
+
+	u = ((double) random() + 1.0) / ((double) MAX_RANDOM_VALUE + 2.0);
+
+	return (uint64) floor(log(u) / log(1.0 - fraction));
+}
+
+/*
+ * Fill estimate of changed pages and its 95% confidence bounds.  Variance
+ * of the stratum is taken at the Agresti-Coull adjusted proportion, so that
+ * bounds do not collapse, when no (or every) sampled block was changed, and
+ * it is scaled by the finite population correction, so that a full sample
+ * is exact.  Strata without sampled blocks are assumed to change at the
+ * overall rate 'fallback'.  Bounds are clamped by the sampled blocks known
+ * to be changed and unchanged.
+ */
+static void
+ptrack_estimate_bounds(PtrackEstimateStratum * strata, int nstrata,
+					   double fallback, Datum *values)
+{
+	double		nblocks = 0;
+	double		nsampled = 0;
+	double		nchanged = 0;
+	double		estimate = 0;
+	double		variance = 0;
+	double		low;
+	double		high;
+	int			i;
+
+	for (i = 0; i < nstrata; i++)
+	{
+		PtrackEstimateStratum *st = &strata[i];
+		double		p;
+		double		p_adj;
+
+		nblocks += st->nblocks;
+		nsampled += st->nsampled;
+		nchanged += st->nchanged;
+
+		if (st->nsampled == 0)
+		{
+			estimate += fallback * st->nblocks;
+			variance += (double) st->nblocks * st->nblocks *
+				fallback * (1.0 - fallback);
+			continue;
+		}
+
+		p = (double) st->nchanged / st->nsampled;
+		p_adj = (st->nchanged + 2.0) / (st->nsampled + 4.0);
+
+		estimate += p * st->nblocks;
+		variance += (double) st->nblocks * st->nblocks *
+			p_adj * (1.0 - p_adj) / st->nsampled *
+			(1.0 - (double) st->nsampled / st->nblocks);
+	}
+
+	low = Max(estimate - 1.96 * sqrt(variance), nchanged);
+	high = Min(estimate + 1.96 * sqrt(variance), nblocks - (nsampled - nchanged));
+
+	values[1] = Int64GetDatum((int64) nblocks);
+	values[2] = Int64GetDatum((int64) nsampled);
+	values[3] = Int64GetDatum((int64) rint(estimate));
+	values[4] = Int64GetDatum((int64) floor(low));
+	values[5] = Int64GetDatum((int64) ceil(high));
+	values[6] = Int64GetDatum((int64) rint(estimate) * BLCKSZ);
+}
+
+/*
+ * Estimate number of pages changed since specified LSN by looking up only
+ * a uniform random sample of 'sample_fraction' of all blocks in the map.
+ * Blocks are stratified by tablespace: the function returns a row for every
+ * tablespace and the total one with NULL tablespace.  Files still have to be
+ * listed and stat()ed to know their sizes, but the map is only looked up
+ * for files with sampled blocks.
+ */
+PG_FUNCTION_INFO_V1(ptrack_estimate_changes);
+Datum
+ptrack_estimate_changes(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = PG_GETARG_LSN(0);
+	double		fraction = PG_GETARG_FLOAT8(1);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PtScanCtx	ctx;
+	PtrackEstimateStratum *strata;
+	int			nstrata = 0;
+	int			maxstrata = 4;
+	uint64		skip;
+	uint64		nsampled = 0;
+	uint64		nchanged = 0;
+	double		fallback;
+	Datum		values[7];
+	bool		nulls[7] = {false};
+	int			i;
+
+	ptrack_check_start_lsn(lsn, NULL);
+
+	if (!(fraction > 0.0 && fraction <= 1.0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample fraction must be greater than 0 and not greater than 1")));
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+
+	strata = palloc(maxstrata * sizeof(PtrackEstimateStratum));
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = lsn;
+	ptrack_gather_datadir(&ctx.filelist);
+
+	/* Skips run across files, as if all blocks were a single sequence */
+	skip = ptrack_estimate_skip(fraction);
+
+	while (ptrack_filelist_stat_next(&ctx) == 0)
+	{
+		PtrackEstimateStratum *st = NULL;
+		uint64		nblocks = ctx.relsize - ctx.bid.blocknum;
+
+		for (i = 0; i < nstrata; i++)
+		{
+			if (strata[i].spcoid == ctx.bid.relnode.spcNode)
+			{
+				st = &strata[i];
+				break;
+			}
+		}
+
+		if (st == NULL)
+		{
+			if (nstrata == maxstrata)
+			{
+				maxstrata *= 2;
+				strata = repalloc(strata, maxstrata * sizeof(PtrackEstimateStratum));
+			}
+
+			st = &strata[nstrata++];
+			MemSet(st, 0, sizeof(PtrackEstimateStratum));
+			st->spcoid = ctx.bid.relnode.spcNode;
+		}
+
+		st->nblocks += nblocks;
+
+		/* Most of small files have no sampled blocks at all */
+		if (skip < nblocks)
+		{
+			ptrack_segscan_begin(&ctx.segscan, ctx.bid, ctx.lsn);
+
+			for (; skip < nblocks; skip += 1 + ptrack_estimate_skip(fraction))
+			{
+				st->nsampled++;
+				if (ptrack_segscan_get(&ctx.segscan, ctx.bid.blocknum + skip) >= ctx.lsn)
+					st->nchanged++;
+			}
+
+			ptrack_segscan_end(&ctx.segscan);
+		}
+		skip -= nblocks;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	for (i = 0; i < nstrata; i++)
+	{
+		nsampled += strata[i].nsampled;
+		nchanged += strata[i].nchanged;
+	}
+	fallback = (nchanged + 2.0) / (nsampled + 4.0);
+
+	for (i = 0; i < nstrata; i++)
+	{
+		values[0] = ObjectIdGetDatum(strata[i].spcoid);
+		nulls[0] = false;
+		ptrack_estimate_bounds(&strata[i], 1, fallback, values);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	nulls[0] = true;
+	ptrack_estimate_bounds(strata, nstrata, fallback, values);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	pfree(strata);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return blocks of relation fork changed since specified LSN.  Blocks are
+ * found through the C API looked up the way other extensions do it, by
+ * 'lookup' method of the API: 'iterator' (file_begin() and file_next()),
+ * 'array' (blocks_changed_since()) or 'block' (block_changed_since()).
+ * Methods are not synchronized with concurrent writes, so they may only be
+ * compared with each other on a quiesced cluster.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_relation_blocks);
+Datum
+ptrack_get_relation_blocks(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	XLogRecPtr	lsn = PG_GETARG_LSN(1);
+	ForkNumber	forknum = forkname_to_number(text_to_cstring(PG_GETARG_TEXT_PP(2)));
+	char	   *lookup = text_to_cstring(PG_GETARG_TEXT_PP(3));
+	PtrackApi  *api = *(PtrackApi * *) find_rendezvous_variable(PTRACK_API_RENDEZVOUS);
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	Relation	rel;
+	RelFileNode rnode;
+	BlockNumber nblocks;
+	BlockNumber blkno;
+	bool		isnull = false;
+	Datum		value;
+
+	if (api == NULL || api->version != PTRACK_API_VERSION)
+		elog(ERROR, "ptrack API is not available");
+
+	if (strcmp(lookup, "iterator") != 0 && strcmp(lookup, "array") != 0 &&
+		strcmp(lookup, "block") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid lookup method \"%s\"", lookup),
+				 errhint("Valid lookup methods are \"iterator\", \"array\" and \"block\".")));
+
+	rel = relation_open(relid, AccessShareLock);
+
+	/* Temporary relations are not tracked */
+	if (RelationUsesLocalBuffers(rel))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("changes of temporary relation \"%s\" are not tracked",
+						RelationGetRelationName(rel))));
+
+	rnode = rel->rd_node;
+	RelationOpenSmgr(rel);
+	nblocks = smgrexists(rel->rd_smgr, forknum) ?
+		RelationGetNumberOfBlocksInFork(rel, forknum) : 0;
+
+	relation_close(rel, AccessShareLock);
+
+	tupstore = ptrack_materialize_init(fcinfo, &tupdesc);
+
+	if (strcmp(lookup, "iterator") == 0)
+	{
+		PtrackFileIter *iter;
+
+		iter = api->file_begin(rnode, forknum, nblocks, lsn);
+		while (api->file_next(iter, &blkno))
+		{
+			value = Int64GetDatum((int64) blkno);
+			tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+		}
+		api->file_end(iter);
+	}
+	else if (strcmp(lookup, "array") == 0)
+	{
+		BlockNumber *blknos = palloc(Max(nblocks, 1) * sizeof(BlockNumber));
+		bool	   *changed = palloc(Max(nblocks, 1) * sizeof(bool));
+
+		for (blkno = 0; blkno < nblocks; blkno++)
+			blknos[blkno] = blkno;
+		api->blocks_changed_since(rnode, forknum, blknos, nblocks, lsn, changed);
+
+		for (blkno = 0; blkno < nblocks; blkno++)
+		{
+			if (!changed[blkno])
+				continue;
+			value = Int64GetDatum((int64) blkno);
+			tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+		}
+
+		pfree(blknos);
+		pfree(changed);
+	}
+	else
+	{
+		for (blkno = 0; blkno < nblocks; blkno++)
+		{
+			if (!api->block_changed_since(rnode, forknum, blkno, lsn))
+				continue;
+			value = Int64GetDatum((int64) blkno);
+			tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
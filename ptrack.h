@@ -22,9 +22,14 @@
 #include "utils/relcache.h"
 
 /* Ptrack version as a string */
-#define PTRACK_VERSION "2.1"
+#define PTRACK_VERSION "2.2"
 /* Ptrack version as a number */
-#define PTRACK_VERSION_NUM 210
+#define PTRACK_VERSION_NUM 220
+
+/* File loaded by autoprewarm worker of pg_prewarm on its first start */
+#define PTRACK_PREWARM_FILE "autoprewarm.blocks"
+/* Used for atomical update of PTRACK_PREWARM_FILE */
+#define PTRACK_PREWARM_FILE_TMP "autoprewarm.blocks.ptrack"
 
 /*
  * Structure identifying block on the disk.
@@ -36,6 +41,25 @@ typedef struct PtBlockId
 	BlockNumber blocknum;
 }			PtBlockId;
 
+/*
+ * State of changes lookup in a single relation segment, see
+ * ptrack_segscan_begin().
+ */
+typedef struct PtSegScan
+{
+	PtBlockId	bid;
+	/* Exact map of hot segment or -1 */
+	int			hot_slot;
+	/* Whether hashed map has to be consulted */
+	bool		use_map;
+	/* Slot of the first block of the segment with segment layout */
+	size_t		seg_slot;
+	/* Map groups of this epoch and older are unchanged, -1 if none */
+	int64		coarse_epoch;
+	/* Reported for every block, while replayed WAL is not summarized */
+	XLogRecPtr	pending_lsn;
+}			PtSegScan;
+
 /*
  * Context for ptrack_get_pagemapset set returning function.
  */
@@ -46,8 +70,25 @@ typedef struct PtScanCtx
 	uint32		relsize;
 	char	   *relpath;
 	List	   *filelist;
+	PtSegScan	segscan;
+	/* Entries of the map snapshot to use instead of the map or NULL */
+	uint64	   *snapshot;
 }			PtScanCtx;
 
+/*
+ * Block of the recently written set of blocks.  Block address fields are
+ * the same as in the records of pg_prewarm's autoprewarm.
+ */
+typedef struct PtrackRecentBlock
+{
+	Oid			database;
+	Oid			tablespace;
+	Oid			filenode;
+	ForkNumber	forknum;
+	BlockNumber blocknum;
+	XLogRecPtr	lsn;
+}			PtrackRecentBlock;
+
 /*
  * List item type for ptrack data files list.
  */
@@ -59,4 +100,37 @@ typedef struct PtrackFileList_i
 	char	   *path;
 }			PtrackFileList_i;
 
+/*
+ * Key of relation segment file in the enumeration of pagemapset cursors.
+ * Files are enumerated in ascending order of keys, so that enumeration
+ * can be resumed after the last returned file, even if other files were
+ * created or removed in between.
+ */
+typedef struct PtrackFileKey
+{
+	Oid			spcOid;
+	Oid			dbOid;
+	Oid			relNode;
+	int			forknum;
+	int			segno;
+}			PtrackFileKey;
+
+/*
+ * Decoded resume token of pagemapset cursor.  Cursor returns changes since
+ * 'lsn' of files of database 'dbOid' (or of all files, if it is invalid)
+ * after 'pos' (if any) and before 'end' (if any).
+ */
+typedef struct PtrackCursor
+{
+	XLogRecPtr	lsn;
+	Oid			dbOid;
+	bool		has_pos;
+	PtrackFileKey pos;
+	bool		has_end;
+	PtrackFileKey end;
+}			PtrackCursor;
+
+/* Version of the resume token format */
+#define PTRACK_CURSOR_VERSION 1
+
 #endif							/* PTRACK_H */
@@ -0,0 +1,77 @@
+/*-------------------------------------------------------------------------
+ *
+ * ptrack_api.h
+ *	  in-process C API of ptrack for other extensions
+ *
+ * Extension running in the same server finds the API through a rendezvous
+ * variable, once ptrack is loaded by shared_preload_libraries:
+ *
+ *		PtrackApi **api_p = (PtrackApi **) find_rendezvous_variable(PTRACK_API_RENDEZVOUS);
+ *		PtrackApi  *api = *api_p;
+ *
+ *		if (api == NULL || api->version != PTRACK_API_VERSION)
+ *			elog(ERROR, "ptrack API is not available");
+ *
+ * Do the lookup lazily (not in _PG_init()), since the order of preloaded
+ * libraries is not defined.  All functions error out if ptrack is disabled
+ * or 'lsn' precedes ptrack_init_lsn(), since map cannot tell anything about
+ * earlier changes.  Like ptrack_get_pagemapset(), they may report unchanged
+ * blocks as changed, but never the other way around.
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/ptrack_api.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_API_H
+#define PTRACK_API_H
+
+#include "access/xlogdefs.h"
+#include "common/relpath.h"
+#include "storage/block.h"
+#include "storage/relfilenode.h"
+
+/* Name of the rendezvous variable pointing to PtrackApi */
+#define PTRACK_API_RENDEZVOUS "ptrack_api"
+
+/* Incremented on every incompatible change of PtrackApi */
+#define PTRACK_API_VERSION 1
+
+/* Iterator over changed blocks of a relation fork, see file_begin */
+typedef struct PtrackFileIter PtrackFileIter;
+
+typedef struct PtrackApi
+{
+	int			version;
+
+	/* LSN of the last map initialization or InvalidXLogRecPtr */
+	XLogRecPtr	(*init_lsn) (void);
+
+	/* Whether block was changed since 'lsn' */
+	bool		(*block_changed_since) (RelFileNode rnode, ForkNumber forknum,
+										BlockNumber blkno, XLogRecPtr lsn);
+
+	/*
+	 * Set changed[i] for each of 'nblocks' blocks of 'blknos' of the same
+	 * relation fork.  Consecutive blocks of the same segment are looked up
+	 * together, so sorted 'blknos' are the fastest.
+	 */
+	void		(*blocks_changed_since) (RelFileNode rnode, ForkNumber forknum,
+										 const BlockNumber *blknos, int nblocks,
+										 XLogRecPtr lsn, bool *changed);
+
+	/*
+	 * Iterate over blocks changed since 'lsn' among the first 'nblocks'
+	 * blocks of relation fork in ascending order.  file_next() returns false
+	 * when there are no more blocks.  Iterator is allocated in the current
+	 * memory context.
+	 */
+	PtrackFileIter *(*file_begin) (RelFileNode rnode, ForkNumber forknum,
+								   BlockNumber nblocks, XLogRecPtr lsn);
+	bool		(*file_next) (PtrackFileIter * iter, BlockNumber *blkno);
+	void		(*file_end) (PtrackFileIter * iter);
+}			PtrackApi;
+
+#endif							/* PTRACK_API_H */
@@ -0,0 +1,1133 @@
+/*
+ * ptrack_backup.c
+ *		Reference incremental backup and restore tool using ptrack
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/ptrack_backup/ptrack_backup.c
+ *
+ * Takes full and incremental backups of a local cluster into plain
+ * directories, restores chains of them and merges chains into a single full
+ * backup.  It is neither a replacement of pg_probackup nor of pg_basebackup,
+ * but a minimal consumer of ptrack_get_pagemapset(), which shows how
+ * incremental backups are built on top of it and serves as an end-to-end
+ * benchmark of ptrack: every command reports its duration against the
+ * amount of data read.
+ *
+ * Backup has the same layout as PGDATA.  Relation segment files of an
+ * incremental backup are stored as <file>.ptrack in the same format as
+ * members of BASE_BACKUP with PTRACK option: header of three uint32 values
+ * (magic, number of blocks in the file and number of changed blocks N),
+ * followed by N block numbers and N blocks.  Root of each backup contains
+ * backup.info with its mode, LSNs and parent directory.
+ *
+ * Tool reads PGDATA directly, so it must run on the database host as
+ * an OS user with access to it.  Files are copied by parallel worker
+ * processes (not on Windows), changed blocks are read in coalesced runs of
+ * up to PTRACK_BACKUP_IO_SIZE bytes.  WAL segments required for recovery
+ * are copied from pg_wal after pg_stop_backup(), so they must not be
+ * recycled during the backup, e.g. keep them with wal_keep_segments.
+ * Tablespaces are stored and restored inside pg_tblspc.
+ */
+
+#include "postgres_fe.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+#include "access/xlogdefs.h"
+#include "common/file_perm.h"
+#include "getopt_long.h"
+#include "libpq-fe.h"
+#include "portability/instr_time.h"
+
+/* The same as in basebackup.h of the core patch */
+#define PTRACK_INCREMENTAL_MAGIC 0x316B7470	/* "ptk1" */
+#define PTRACK_INCREMENTAL_SUFFIX ".ptrack"
+
+#define PTRACK_BACKUP_INFO "backup.info"
+#define PTRACK_BACKUP_IO_SIZE (1024 * 1024)
+#define PTRACK_BACKUP_IO_BLOCKS (PTRACK_BACKUP_IO_SIZE / BLCKSZ)
+
+typedef enum BackupMode
+{
+	BACKUP_MODE_FULL,
+	BACKUP_MODE_INCREMENTAL
+}			BackupMode;
+
+typedef struct BackupInfo
+{
+	BackupMode	mode;
+	XLogRecPtr	start_lsn;
+	XLogRecPtr	stop_lsn;
+	/* Parent directory of incremental backup */
+	char		parent[MAXPGPATH];
+}			BackupInfo;
+
+/* Bitmap of changed blocks of a relation segment file */
+typedef struct Pagemap
+{
+	char	   *path;
+	unsigned char *bitmap;
+	size_t		bitmapsize;
+}			Pagemap;
+
+/* Counters of a worker, summed up by the main process */
+typedef struct CopyStats
+{
+	uint64		files;
+	uint64		bytes_read;
+	uint64		bytes_written;
+	uint64		blocks_changed;
+}			CopyStats;
+
+typedef void (*FileAction) (int i, CopyStats * stats);
+
+static const char *progname;
+static int	num_workers = 1;
+
+/* State of the current command, shared with worker processes by fork() */
+static char src_dir[MAXPGPATH];
+static char dst_dir[MAXPGPATH];
+static char **files = NULL;
+static int	nfiles = 0;
+static int	maxfiles = 0;
+static Pagemap *pagemaps = NULL;
+static int	npagemaps = 0;
+static bool incremental = false;
+static char *iobuf = NULL;
+
+/* Directory contents not needed for recovery, the same as in basebackup.c */
+static const char *const exclude_dir_contents[] = {
+	"pg_wal",
+	"pg_stat_tmp",
+	"pg_replslot",
+	"pg_dynshmem",
+	"pg_notify",
+	"pg_serial",
+	"pg_snapshots",
+	"pg_subtrans",
+	NULL
+};
+
+/*
+ * Files not needed for recovery.  Transient and per-cluster ptrack files are
+ * the same as in excludeFiles of basebackup.c with the ptrack core patch.
+ */
+static const char *const exclude_files[] = {
+	"postmaster.pid",
+	"postmaster.opts",
+	"backup_label",
+	"tablespace_map",
+	"backup_label.old",
+	"pg_internal.init",
+	"ptrack.map.mmap",
+	"ptrack.map.tmp",
+	"ptrack.slots",
+	"ptrack.slots.tmp",
+	"ptrack.skipwal",
+	"ptrack.skipwal.old",
+	"pg_ptrack",
+	NULL
+};
+
+static void fatal_error(const char *fmt,...) pg_attribute_printf(1, 2) pg_attribute_noreturn();
+
+static void
+fatal_error(const char *fmt,...)
+{
+	va_list		ap;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static double
+elapsed_sec(instr_time start)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, start);
+	return INSTR_TIME_GET_DOUBLE(now);
+}
+
+/*
+ * Backup metadata
+ */
+
+static void
+write_backup_info(const char *dir, const BackupInfo * info)
+{
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, PTRACK_BACKUP_INFO);
+	fp = fopen(path, PG_BINARY_W);
+	if (fp == NULL)
+		fatal_error("could not create file \"%s\": %s", path, strerror(errno));
+
+	fprintf(fp, "mode = %s\n", info->mode == BACKUP_MODE_FULL ? "full" : "incremental");
+	fprintf(fp, "start_lsn = %X/%X\n",
+			(uint32) (info->start_lsn >> 32), (uint32) info->start_lsn);
+	fprintf(fp, "stop_lsn = %X/%X\n",
+			(uint32) (info->stop_lsn >> 32), (uint32) info->stop_lsn);
+	if (info->mode == BACKUP_MODE_INCREMENTAL)
+		fprintf(fp, "parent = %s\n", info->parent);
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0)
+		fatal_error("could not write file \"%s\": %s", path, strerror(errno));
+}
+
+static XLogRecPtr
+parse_lsn(const char *str)
+{
+	uint32		hi;
+	uint32		lo;
+
+	if (sscanf(str, "%X/%X", &hi, &lo) != 2)
+		fatal_error("invalid LSN \"%s\"", str);
+
+	return (uint64) hi << 32 | lo;
+}
+
+static void
+read_backup_info(const char *dir, BackupInfo * info)
+{
+	char		path[MAXPGPATH];
+	char		line[MAXPGPATH + 64];
+	FILE	   *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, PTRACK_BACKUP_INFO);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		fatal_error("could not open file \"%s\": %s (is it a completed backup?)",
+					path, strerror(errno));
+
+	MemSet(info, 0, sizeof(BackupInfo));
+	info->mode = BACKUP_MODE_FULL;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char	   *value = strstr(line, " = ");
+
+		if (value == NULL)
+			continue;
+		*value = '\0';
+		value += 3;
+		value[strcspn(value, "\r\n")] = '\0';
+
+		if (strcmp(line, "mode") == 0)
+			info->mode = strcmp(value, "full") == 0 ? BACKUP_MODE_FULL : BACKUP_MODE_INCREMENTAL;
+		else if (strcmp(line, "start_lsn") == 0)
+			info->start_lsn = parse_lsn(value);
+		else if (strcmp(line, "stop_lsn") == 0)
+			info->stop_lsn = parse_lsn(value);
+		else if (strcmp(line, "parent") == 0)
+			strlcpy(info->parent, value, sizeof(info->parent));
+	}
+
+	fclose(fp);
+
+	if (info->stop_lsn == InvalidXLogRecPtr ||
+		(info->mode == BACKUP_MODE_INCREMENTAL && info->parent[0] == '\0'))
+		fatal_error("file \"%s\" is incomplete", path);
+}
+
+/*
+ * Lists of files
+ */
+
+static void
+add_file(const char *relpath)
+{
+	if (nfiles == maxfiles)
+	{
+		maxfiles = maxfiles > 0 ? maxfiles * 2 : 1024;
+		files = pg_realloc(files, maxfiles * sizeof(char *));
+	}
+	files[nfiles++] = pg_strdup(relpath);
+}
+
+static bool
+name_in_list(const char *name, const char *const *list)
+{
+	int			i;
+
+	for (i = 0; list[i] != NULL; i++)
+		if (strcmp(name, list[i]) == 0)
+			return true;
+	return false;
+}
+
+static void
+make_dir(const char *path)
+{
+	if (mkdir(path, pg_dir_create_mode) != 0 && errno != EEXIST)
+		fatal_error("could not create directory \"%s\": %s", path, strerror(errno));
+}
+
+/*
+ * Collect regular files under 'root'/'reldir' into the list and create the
+ * same directories under 'mkroot' (if not NULL).  Symlinks are followed, so
+ * tablespaces become plain directories.  'pgdata' enables exclusions of
+ * files, which are not backed up.
+ */
+static void
+walk_dir(const char *root, const char *reldir, const char *mkroot, bool pgdata)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+
+	snprintf(path, sizeof(path), "%s/%s", root, reldir);
+	dir = opendir(path);
+	if (dir == NULL)
+		fatal_error("could not open directory \"%s\": %s", path, strerror(errno));
+
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		char		relpath[MAXPGPATH];
+		char		fullpath[MAXPGPATH];
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (reldir[0] == '\0')
+			strlcpy(relpath, de->d_name, sizeof(relpath));
+		else
+			snprintf(relpath, sizeof(relpath), "%s/%s", reldir, de->d_name);
+		snprintf(fullpath, sizeof(fullpath), "%s/%s", root, relpath);
+
+		if (pgdata && (name_in_list(de->d_name, exclude_files) ||
+					   strncmp(de->d_name, "pgsql_tmp", 9) == 0))
+			continue;
+		if (!pgdata && reldir[0] == '\0' && strcmp(de->d_name, PTRACK_BACKUP_INFO) == 0)
+			continue;
+
+		if (stat(fullpath, &st) != 0)
+		{
+			/* File was removed concurrently, WAL replay will remove it too */
+			if (errno == ENOENT)
+				continue;
+			fatal_error("could not stat file \"%s\": %s", fullpath, strerror(errno));
+		}
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (mkroot != NULL)
+			{
+				snprintf(fullpath, sizeof(fullpath), "%s/%s", mkroot, relpath);
+				make_dir(fullpath);
+			}
+
+			if (pgdata && name_in_list(relpath, exclude_dir_contents))
+				continue;
+
+			walk_dir(root, relpath, mkroot, pgdata);
+		}
+		else if (S_ISREG(st.st_mode))
+			add_file(relpath);
+	}
+
+	if (errno != 0)
+		fatal_error("could not read directory \"%s\": %s", path, strerror(errno));
+
+	closedir(dir);
+}
+
+/*
+ * Whether 'relpath' is a segment file of non-temporary relation.
+ */
+static bool
+is_relation_file(const char *relpath)
+{
+	const char *name = last_dir_separator(relpath);
+	size_t		len;
+
+	if (strncmp(relpath, "global/", 7) != 0 &&
+		strncmp(relpath, "base/", 5) != 0 &&
+		strncmp(relpath, "pg_tblspc/", 10) != 0)
+		return false;
+
+	name = name != NULL ? name + 1 : relpath;
+	len = strspn(name, "0123456789");
+	if (len == 0)
+		return false;
+	name += len;
+
+	if (strncmp(name, "_fsm", 4) == 0 || strncmp(name, "_vm", 3) == 0 ||
+		strncmp(name, "_init", 5) == 0)
+		name += strcspn(name, ".");
+
+	if (*name == '.')
+	{
+		name++;
+		if (strspn(name, "0123456789") != strlen(name) || *name == '\0')
+			return false;
+		return true;
+	}
+
+	return *name == '\0';
+}
+
+static int
+pagemap_cmp(const void *a, const void *b)
+{
+	return strcmp(((const Pagemap *) a)->path, ((const Pagemap *) b)->path);
+}
+
+static Pagemap *
+find_pagemap(const char *relpath)
+{
+	Pagemap		key;
+
+	key.path = (char *) relpath;
+	return bsearch(&key, pagemaps, npagemaps, sizeof(Pagemap), pagemap_cmp);
+}
+
+/*
+ * File I/O
+ */
+
+static int
+open_file(const char *path, int flags)
+{
+	int			fd = open(path, flags | PG_BINARY, pg_file_create_mode);
+
+	if (fd < 0)
+		fatal_error("could not open file \"%s\": %s", path, strerror(errno));
+	return fd;
+}
+
+static size_t
+read_full(int fd, char *buf, size_t size, const char *path)
+{
+	size_t		done = 0;
+
+	while (done < size)
+	{
+		ssize_t		r = read(fd, buf + done, size - done);
+
+		if (r < 0)
+			fatal_error("could not read file \"%s\": %s", path, strerror(errno));
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static void
+write_full(int fd, const char *buf, size_t size, const char *path)
+{
+	errno = 0;
+	if (write(fd, buf, size) != (ssize_t) size)
+	{
+		/* If write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		fatal_error("could not write file \"%s\": %s", path, strerror(errno));
+	}
+}
+
+static void
+seek_to(int fd, off_t offset, const char *path)
+{
+	if (lseek(fd, offset, SEEK_SET) < 0)
+		fatal_error("could not seek in file \"%s\": %s", path, strerror(errno));
+}
+
+static void
+close_file(int fd, const char *path, bool sync)
+{
+	if (sync && fsync(fd) != 0)
+		fatal_error("could not fsync file \"%s\": %s", path, strerror(errno));
+	if (close(fd) != 0)
+		fatal_error("could not close file \"%s\": %s", path, strerror(errno));
+}
+
+static void
+copy_file_full(const char *from, const char *to, CopyStats * stats)
+{
+	int			src = open_file(from, O_RDONLY);
+	int			dst = open_file(to, O_WRONLY | O_CREAT | O_TRUNC);
+	size_t		r;
+
+	while ((r = read_full(src, iobuf, PTRACK_BACKUP_IO_SIZE, from)) > 0)
+	{
+		write_full(dst, iobuf, r, to);
+		stats->bytes_read += r;
+		stats->bytes_written += r;
+	}
+
+	close_file(src, from, false);
+	close_file(dst, to, true);
+}
+
+/*
+ * Write blocks of 'from' set in 'map' to 'to' in the incremental format.
+ * Runs of consecutive changed blocks are read at once.
+ */
+static void
+copy_file_incremental(const char *from, const char *to, const Pagemap * map,
+					  CopyStats * stats)
+{
+	int			src = open_file(from, O_RDONLY);
+	int			dst;
+	struct stat st;
+	uint32		hdr[3];
+	uint32	   *blknos;
+	uint32		nblocks;
+	uint32		nchanged = 0;
+	uint32		blkno;
+	uint32		i;
+
+	if (fstat(src, &st) != 0)
+		fatal_error("could not stat file \"%s\": %s", from, strerror(errno));
+	nblocks = st.st_size / BLCKSZ;
+
+	blknos = pg_malloc(sizeof(uint32) * (nblocks + 1));
+	if (map != NULL)
+	{
+		for (blkno = 0; blkno < nblocks && blkno / 8 < map->bitmapsize; blkno++)
+			if (map->bitmap[blkno / 8] & (1 << (blkno % 8)))
+				blknos[nchanged++] = blkno;
+	}
+
+	hdr[0] = PTRACK_INCREMENTAL_MAGIC;
+	hdr[1] = nblocks;
+	hdr[2] = nchanged;
+
+	dst = open_file(to, O_WRONLY | O_CREAT | O_TRUNC);
+	write_full(dst, (char *) hdr, sizeof(hdr), to);
+	write_full(dst, (char *) blknos, sizeof(uint32) * nchanged, to);
+
+	for (i = 0; i < nchanged;)
+	{
+		uint32		run = 1;
+		size_t		size;
+		size_t		r;
+
+		while (i + run < nchanged && run < PTRACK_BACKUP_IO_BLOCKS &&
+			   blknos[i + run] == blknos[i] + run)
+			run++;
+
+		size = (size_t) run * BLCKSZ;
+		seek_to(src, (off_t) blknos[i] * BLCKSZ, from);
+		r = read_full(src, iobuf, size, from);
+
+		/* File was truncated concurrently, WAL replay will truncate it too */
+		if (r < size)
+			MemSet(iobuf + r, 0, size - r);
+
+		write_full(dst, iobuf, size, to);
+		stats->bytes_read += r;
+		stats->bytes_written += size;
+		i += run;
+	}
+
+	stats->blocks_changed += nchanged;
+	stats->bytes_written += sizeof(hdr) + sizeof(uint32) * nchanged;
+
+	pg_free(blknos);
+	close_file(src, from, false);
+	close_file(dst, to, true);
+}
+
+/*
+ * Apply incremental file 'from' to the restored file 'to'.
+ */
+static void
+apply_file_incremental(const char *from, const char *to, CopyStats * stats)
+{
+	int			src = open_file(from, O_RDONLY);
+	int			dst = open_file(to, O_WRONLY | O_CREAT);
+	uint32		hdr[3];
+	uint32	   *blknos;
+	uint32		i;
+
+	if (read_full(src, (char *) hdr, sizeof(hdr), from) != sizeof(hdr) ||
+		hdr[0] != PTRACK_INCREMENTAL_MAGIC)
+		fatal_error("file \"%s\" is not an incremental file", from);
+
+	blknos = pg_malloc(sizeof(uint32) * (hdr[2] + 1));
+	if (read_full(src, (char *) blknos, sizeof(uint32) * hdr[2], from) != sizeof(uint32) * hdr[2])
+		fatal_error("file \"%s\" is truncated", from);
+
+	if (ftruncate(dst, (off_t) hdr[1] * BLCKSZ) != 0)
+		fatal_error("could not truncate file \"%s\": %s", to, strerror(errno));
+
+	for (i = 0; i < hdr[2];)
+	{
+		uint32		run = 1;
+		size_t		size;
+
+		if (blknos[i] >= hdr[1])
+			fatal_error("file \"%s\" is corrupted", from);
+
+		while (i + run < hdr[2] && run < PTRACK_BACKUP_IO_BLOCKS &&
+			   blknos[i + run] == blknos[i] + run)
+			run++;
+
+		size = (size_t) run * BLCKSZ;
+		if (read_full(src, iobuf, size, from) != size)
+			fatal_error("file \"%s\" is truncated", from);
+
+		seek_to(dst, (off_t) blknos[i] * BLCKSZ, to);
+		write_full(dst, iobuf, size, to);
+		stats->bytes_read += size;
+		stats->bytes_written += size;
+		i += run;
+	}
+
+	stats->blocks_changed += hdr[2];
+
+	pg_free(blknos);
+	close_file(src, from, false);
+	close_file(dst, to, true);
+}
+
+/*
+ * Per-file actions run by workers
+ */
+
+static void
+backup_one_file(int i, CopyStats * stats)
+{
+	char		from[MAXPGPATH];
+	char		to[MAXPGPATH];
+
+	snprintf(from, sizeof(from), "%s/%s", src_dir, files[i]);
+
+	if (incremental && is_relation_file(files[i]))
+	{
+		snprintf(to, sizeof(to), "%s/%s%s", dst_dir, files[i], PTRACK_INCREMENTAL_SUFFIX);
+		copy_file_incremental(from, to, find_pagemap(files[i]), stats);
+	}
+	else
+	{
+		snprintf(to, sizeof(to), "%s/%s", dst_dir, files[i]);
+		copy_file_full(from, to, stats);
+	}
+
+	stats->files++;
+}
+
+static void
+restore_one_file(int i, CopyStats * stats)
+{
+	char		from[MAXPGPATH];
+	char		to[MAXPGPATH];
+	size_t		len = strlen(files[i]);
+	size_t		suffix_len = strlen(PTRACK_INCREMENTAL_SUFFIX);
+
+	snprintf(from, sizeof(from), "%s/%s", src_dir, files[i]);
+
+	if (len > suffix_len &&
+		strcmp(files[i] + len - suffix_len, PTRACK_INCREMENTAL_SUFFIX) == 0)
+	{
+		snprintf(to, sizeof(to), "%s/%.*s", dst_dir, (int) (len - suffix_len), files[i]);
+		apply_file_incremental(from, to, stats);
+	}
+	else
+	{
+		snprintf(to, sizeof(to), "%s/%s", dst_dir, files[i]);
+		copy_file_full(from, to, stats);
+	}
+
+	stats->files++;
+}
+
+/*
+ * Run 'action' for every file of the list by num_workers processes.
+ */
+static void
+run_parallel(FileAction action, CopyStats * total)
+{
+#ifndef WIN32
+	pid_t	   *pids;
+	int		   *pipes;
+	int			w;
+	bool		failed = false;
+
+	fflush(NULL);
+
+	pids = pg_malloc(sizeof(pid_t) * num_workers);
+	pipes = pg_malloc(sizeof(int) * num_workers);
+
+	for (w = 0; w < num_workers; w++)
+	{
+		int			fds[2];
+
+		if (pipe(fds) != 0)
+			fatal_error("could not create pipe: %s", strerror(errno));
+
+		pids[w] = fork();
+		if (pids[w] < 0)
+			fatal_error("could not fork worker process: %s", strerror(errno));
+
+		if (pids[w] == 0)
+		{
+			CopyStats	stats;
+			int			i;
+
+			close(fds[0]);
+			MemSet(&stats, 0, sizeof(stats));
+
+			/* Static partitioning keeps neighbouring segments apart */
+			for (i = w; i < nfiles; i += num_workers)
+				action(i, &stats);
+
+			if (write(fds[1], &stats, sizeof(stats)) != sizeof(stats))
+				exit(1);
+			exit(0);
+		}
+
+		close(fds[1]);
+		pipes[w] = fds[0];
+	}
+
+	for (w = 0; w < num_workers; w++)
+	{
+		CopyStats	stats;
+		int			status;
+
+		if (read(pipes[w], &stats, sizeof(stats)) == sizeof(stats))
+		{
+			total->files += stats.files;
+			total->bytes_read += stats.bytes_read;
+			total->bytes_written += stats.bytes_written;
+			total->blocks_changed += stats.blocks_changed;
+		}
+		close(pipes[w]);
+
+		if (waitpid(pids[w], &status, 0) < 0 ||
+			!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = true;
+	}
+
+	pg_free(pids);
+	pg_free(pipes);
+
+	if (failed)
+		fatal_error("worker process failed");
+#else
+	int			i;
+
+	for (i = 0; i < nfiles; i++)
+		action(i, total);
+#endif
+}
+
+static void
+report(const char *what, const CopyStats * stats, double sec)
+{
+	printf("%s: " UINT64_FORMAT " files, %.1f MB read, %.1f MB written, " UINT64_FORMAT " changed blocks, %.3f s, %.1f MB/s\n",
+		   what, stats->files,
+		   stats->bytes_read / 1048576.0, stats->bytes_written / 1048576.0,
+		   stats->blocks_changed, sec,
+		   sec > 0 ? stats->bytes_read / 1048576.0 / sec : 0);
+}
+
+/*
+ * Commands
+ */
+
+static PGresult *
+run_query(PGconn *conn, const char *query, ExecStatusType expected)
+{
+	PGresult   *res = PQexec(conn, query);
+
+	if (PQresultStatus(res) != expected)
+		fatal_error("query failed: %s\nquery was: %s", PQerrorMessage(conn), query);
+	return res;
+}
+
+static void
+fetch_pagemaps(PGconn *conn, XLogRecPtr lsn)
+{
+	char		query[128];
+	PGresult   *res;
+	int			i;
+
+	snprintf(query, sizeof(query),
+			 "SELECT path, pagemap FROM ptrack_get_pagemapset('%X/%X')",
+			 (uint32) (lsn >> 32), (uint32) lsn);
+	res = run_query(conn, query, PGRES_TUPLES_OK);
+
+	npagemaps = PQntuples(res);
+	pagemaps = pg_malloc0(sizeof(Pagemap) * (npagemaps + 1));
+	for (i = 0; i < npagemaps; i++)
+	{
+		pagemaps[i].path = pg_strdup(PQgetvalue(res, i, 0));
+		pagemaps[i].bitmap = PQunescapeBytea((unsigned char *) PQgetvalue(res, i, 1),
+											 &pagemaps[i].bitmapsize);
+		if (pagemaps[i].bitmap == NULL)
+			fatal_error("out of memory");
+	}
+	PQclear(res);
+
+	qsort(pagemaps, npagemaps, sizeof(Pagemap), pagemap_cmp);
+}
+
+/*
+ * Copy WAL segments from the one containing 'start_lsn' up to the one
+ * containing 'stop_lsn'.  Segment names of a timeline sort in LSN order.
+ */
+static void
+copy_wal(PGconn *conn, XLogRecPtr start_lsn, XLogRecPtr stop_lsn, CopyStats * stats)
+{
+	char		query[128];
+	char		first[MAXPGPATH];
+	char		last[MAXPGPATH];
+	char		wal_dir[MAXPGPATH];
+	PGresult   *res;
+	DIR		   *dir;
+	struct dirent *de;
+
+	snprintf(query, sizeof(query),
+			 "SELECT pg_walfile_name('%X/%X'), pg_walfile_name('%X/%X')",
+			 (uint32) (start_lsn >> 32), (uint32) start_lsn,
+			 (uint32) (stop_lsn >> 32), (uint32) stop_lsn);
+	res = run_query(conn, query, PGRES_TUPLES_OK);
+	strlcpy(first, PQgetvalue(res, 0, 0), sizeof(first));
+	strlcpy(last, PQgetvalue(res, 0, 1), sizeof(last));
+	PQclear(res);
+
+	snprintf(wal_dir, sizeof(wal_dir), "%s/pg_wal", src_dir);
+	dir = opendir(wal_dir);
+	if (dir == NULL)
+		fatal_error("could not open directory \"%s\": %s", wal_dir, strerror(errno));
+
+	nfiles = 0;
+	while ((de = readdir(dir)) != NULL)
+	{
+		char		relpath[MAXPGPATH];
+
+		if (strlen(de->d_name) != 24 || strspn(de->d_name, "0123456789ABCDEF") != 24 ||
+			strcmp(de->d_name, first) < 0 || strcmp(de->d_name, last) > 0)
+			continue;
+
+		snprintf(relpath, sizeof(relpath), "pg_wal/%s", de->d_name);
+		add_file(relpath);
+	}
+	closedir(dir);
+
+	snprintf(wal_dir, sizeof(wal_dir), "%s/pg_wal/%s", src_dir, last);
+	if (access(wal_dir, F_OK) != 0)
+		fatal_error("WAL segment \"%s\" is not found, it may be already removed", wal_dir);
+
+	/* WAL segments are never incremental */
+	incremental = false;
+	run_parallel(backup_one_file, stats);
+}
+
+static void
+do_backup(const char *connstr, const char *backup_dir, const char *parent_dir)
+{
+	PGconn	   *conn;
+	PGresult   *res;
+	BackupInfo	info;
+	BackupInfo	parent;
+	CopyStats	stats;
+	instr_time	start;
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	char	   *labelfile;
+
+	INSTR_TIME_SET_CURRENT(start);
+	MemSet(&info, 0, sizeof(info));
+	MemSet(&stats, 0, sizeof(stats));
+
+	if (parent_dir != NULL)
+	{
+		read_backup_info(parent_dir, &parent);
+		info.mode = BACKUP_MODE_INCREMENTAL;
+		strlcpy(info.parent, make_absolute_path(parent_dir), sizeof(info.parent));
+		incremental = true;
+	}
+
+	conn = PQconnectdb(connstr);
+	if (PQstatus(conn) != CONNECTION_OK)
+		fatal_error("could not connect to server: %s", PQerrorMessage(conn));
+
+	res = run_query(conn, "SELECT current_setting('data_directory')", PGRES_TUPLES_OK);
+	strlcpy(src_dir, PQgetvalue(res, 0, 0), sizeof(src_dir));
+	PQclear(res);
+
+	if (mkdir(backup_dir, pg_dir_create_mode) != 0)
+		fatal_error("could not create directory \"%s\": %s", backup_dir, strerror(errno));
+	strlcpy(dst_dir, backup_dir, sizeof(dst_dir));
+
+	res = run_query(conn, "SELECT pg_start_backup('ptrack_backup', true, false)", PGRES_TUPLES_OK);
+	info.start_lsn = parse_lsn(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	if (incremental)
+	{
+		XLogRecPtr	init_lsn;
+
+		res = run_query(conn, "SELECT ptrack_init_lsn()", PGRES_TUPLES_OK);
+		init_lsn = parse_lsn(PQgetvalue(res, 0, 0));
+		PQclear(res);
+
+		if (init_lsn == InvalidXLogRecPtr || parent.start_lsn < init_lsn)
+			fatal_error("start LSN %X/%X of parent backup precedes ptrack init LSN %X/%X, take a full backup",
+						(uint32) (parent.start_lsn >> 32), (uint32) parent.start_lsn,
+						(uint32) (init_lsn >> 32), (uint32) init_lsn);
+
+		fetch_pagemaps(conn, parent.start_lsn);
+	}
+
+	walk_dir(src_dir, "", dst_dir, true);
+	run_parallel(backup_one_file, &stats);
+
+	res = run_query(conn, "SELECT lsn, labelfile FROM pg_stop_backup(false, false)", PGRES_TUPLES_OK);
+	info.stop_lsn = parse_lsn(PQgetvalue(res, 0, 0));
+	labelfile = pg_strdup(PQgetvalue(res, 0, 1));
+	PQclear(res);
+
+	snprintf(path, sizeof(path), "%s/backup_label", dst_dir);
+	fp = fopen(path, PG_BINARY_W);
+	if (fp == NULL || fputs(labelfile, fp) < 0 || fflush(fp) != 0 ||
+		fsync(fileno(fp)) != 0 || fclose(fp) != 0)
+		fatal_error("could not write file \"%s\": %s", path, strerror(errno));
+
+	copy_wal(conn, info.start_lsn, info.stop_lsn, &stats);
+	PQfinish(conn);
+
+	/* Backup is complete only once backup.info is written */
+	write_backup_info(dst_dir, &info);
+
+	report(incremental ? "incremental backup" : "full backup", &stats, elapsed_sec(start));
+}
+
+/*
+ * Delete files and directories of 'reldir' of the restored directory,
+ * which are absent in the backup being applied.
+ */
+static void
+remove_stale(const char *reldir)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+
+	snprintf(path, sizeof(path), "%s/%s", dst_dir, reldir);
+	dir = opendir(path);
+	if (dir == NULL)
+		fatal_error("could not open directory \"%s\": %s", path, strerror(errno));
+
+	while ((de = readdir(dir)) != NULL)
+	{
+		char		relpath[MAXPGPATH];
+		char		target[MAXPGPATH];
+		char		source[MAXPGPATH];
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (reldir[0] == '\0')
+			strlcpy(relpath, de->d_name, sizeof(relpath));
+		else
+			snprintf(relpath, sizeof(relpath), "%s/%s", reldir, de->d_name);
+		snprintf(target, sizeof(target), "%s/%s", dst_dir, relpath);
+		snprintf(source, sizeof(source), "%s/%s", src_dir, relpath);
+
+		if (stat(target, &st) != 0)
+			fatal_error("could not stat file \"%s\": %s", target, strerror(errno));
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (access(source, F_OK) != 0)
+			{
+				if (!rmtree(target, true))
+					fatal_error("could not remove directory \"%s\"", target);
+			}
+			else
+				remove_stale(relpath);
+		}
+		else
+		{
+			char		source_incr[MAXPGPATH];
+
+			snprintf(source_incr, sizeof(source_incr), "%s%s", source, PTRACK_INCREMENTAL_SUFFIX);
+			if (access(source, F_OK) != 0 && access(source_incr, F_OK) != 0 &&
+				unlink(target) != 0)
+				fatal_error("could not remove file \"%s\": %s", target, strerror(errno));
+		}
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Restore chain ending with 'backup_dir' into 'target_dir'.  Returns
+ * metadata of 'backup_dir'.
+ */
+static void
+restore_chain(const char *backup_dir, const char *target_dir, BackupInfo * tip)
+{
+	char	  **chain = NULL;
+	int			nchain = 0;
+	BackupInfo	info;
+	CopyStats	stats;
+	instr_time	start;
+	int			i;
+
+	INSTR_TIME_SET_CURRENT(start);
+	MemSet(&stats, 0, sizeof(stats));
+
+	/* Find the full backup the chain starts from */
+	read_backup_info(backup_dir, tip);
+	info = *tip;
+	chain = pg_malloc(sizeof(char *));
+	chain[nchain++] = pg_strdup(backup_dir);
+	while (info.mode == BACKUP_MODE_INCREMENTAL)
+	{
+		char	   *parent = pg_strdup(info.parent);
+
+		read_backup_info(parent, &info);
+		chain = pg_realloc(chain, sizeof(char *) * (nchain + 1));
+		chain[nchain++] = parent;
+	}
+
+	if (mkdir(target_dir, pg_dir_create_mode) != 0)
+		fatal_error("could not create directory \"%s\": %s", target_dir, strerror(errno));
+	strlcpy(dst_dir, target_dir, sizeof(dst_dir));
+
+	for (i = nchain - 1; i >= 0; i--)
+	{
+		strlcpy(src_dir, chain[i], sizeof(src_dir));
+
+		nfiles = 0;
+		walk_dir(src_dir, "", dst_dir, false);
+		run_parallel(restore_one_file, &stats);
+
+		/* Relations dropped since the parent */
+		if (i < nchain - 1)
+			remove_stale("");
+	}
+
+	report("restore", &stats, elapsed_sec(start));
+}
+
+static void
+usage(void)
+{
+	printf("%s takes and restores incremental backups of a local cluster using ptrack.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s backup -B DIR [-b PARENT_DIR] [-d CONNSTR] [-j NUM]\n", progname);
+	printf("  %s restore -B DIR -D DATADIR [-j NUM]\n", progname);
+	printf("  %s merge -B DIR -D NEW_DIR [-j NUM]\n", progname);
+	printf("\nOptions:\n");
+	printf("  -B, --backup-dir=DIR      backup to take, restore or merge\n");
+	printf("  -b, --parent=DIR          take incremental backup on top of this one\n");
+	printf("  -d, --dbname=CONNSTR      connection string\n");
+	printf("  -D, --target=DIR          directory to restore or merge into\n");
+	printf("  -j, --jobs=NUM            number of parallel worker processes\n");
+	printf("  -?, --help                show this help, then exit\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"backup-dir", required_argument, NULL, 'B'},
+		{"parent", required_argument, NULL, 'b'},
+		{"dbname", required_argument, NULL, 'd'},
+		{"target", required_argument, NULL, 'D'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *command;
+	char	   *backup_dir = NULL;
+	char	   *parent_dir = NULL;
+	char	   *target_dir = NULL;
+	const char *connstr = "";
+	int			c;
+
+	progname = get_progname(argv[0]);
+
+	if (argc < 2 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+	{
+		usage();
+		exit(argc < 2 ? 1 : 0);
+	}
+	command = argv[1];
+	argv++;
+	argc--;
+
+	while ((c = getopt_long(argc, argv, "B:b:d:D:j:?", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'B':
+				backup_dir = pg_strdup(optarg);
+				break;
+			case 'b':
+				parent_dir = pg_strdup(optarg);
+				break;
+			case 'd':
+				connstr = pg_strdup(optarg);
+				break;
+			case 'D':
+				target_dir = pg_strdup(optarg);
+				break;
+			case 'j':
+				num_workers = atoi(optarg);
+				if (num_workers < 1)
+					fatal_error("number of parallel jobs must be at least 1");
+				break;
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	if (backup_dir == NULL)
+		fatal_error("no backup directory specified");
+	canonicalize_path(backup_dir);
+
+	iobuf = pg_malloc(PTRACK_BACKUP_IO_SIZE);
+
+	if (strcmp(command, "backup") == 0)
+		do_backup(connstr, backup_dir, parent_dir);
+	else if (strcmp(command, "restore") == 0 || strcmp(command, "merge") == 0)
+	{
+		BackupInfo	tip;
+
+		if (target_dir == NULL)
+			fatal_error("no target directory specified");
+		canonicalize_path(target_dir);
+
+		restore_chain(backup_dir, target_dir, &tip);
+
+		/* Merged chain is a full backup with the same LSNs as its tip */
+		if (strcmp(command, "merge") == 0)
+		{
+			tip.mode = BACKUP_MODE_FULL;
+			tip.parent[0] = '\0';
+			write_backup_info(target_dir, &tip);
+		}
+	}
+	else
+		fatal_error("unrecognized command \"%s\"", command);
+
+	return 0;
+}
@@ -77,8 +77,10 @@ echo "############### Compiling and installing ptrack extension"
 mkdir $PG_SRC/contrib/ptrack
 cp * $PG_SRC/contrib/ptrack/
 cp -R t $PG_SRC/contrib/ptrack/
+cp -R ptrack_backup $PG_SRC/contrib/ptrack/
 
 make USE_PGXS=1 PG_CPPFLAGS="-coverage" SHLIB_LINK="-coverage" -C $PG_SRC/contrib/ptrack/ install
+make USE_PGXS=1 -C $PG_SRC/contrib/ptrack/ptrack_backup/ install
 
 if [ "$TEST_CASE" = "tap" ]; then
 
@@ -0,0 +1,247 @@
+/*
+ * skipwal.c
+ *		Persistence of marks of relations skipping WAL
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/skipwal.c
+ *
+ * Map is written to disk only by checkpoints, and marks made after the last
+ * one are restored after crash by replay of WAL.  With wal_level = minimal
+ * some commands (COPY into a table created in the same transaction, CREATE
+ * INDEX, CLUSTER, ALTER TABLE SET TABLESPACE, etc.) write relation files
+ * without WAL and sync them by smgrimmedsync() before commit instead.  Marks
+ * of their blocks would be lost on crash, so mdimmedsync_hook of the core
+ * patch appends a record with the synced relation fork to the journal
+ * PTRACK_SKIPWAL_PATH and fsyncs it before commit returns.  On the next
+ * start all blocks of journalled forks are marked again.  Such relation
+ * files are always new in the transaction, so nothing is lost by marking
+ * them as a whole.
+ *
+ * Checkpoint moves the journal away to PTRACK_SKIPWAL_OLD_PATH before it
+ * scans the map and removes it once the map is durable.  Record is always
+ * appended after the marks it covers are made, so even a record, which got
+ * into the old journal after the move, is covered by the map written.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrack_skipwal_sync()             --- journal relation fork synced without WAL
+ *	  ptrack_skipwal_checkpoint_begin() --- move journal away before map is written
+ *	  ptrack_skipwal_checkpoint_end()   --- remove journal covered by the map
+ *	  ptrack_skipwal_replay()           --- mark blocks of journalled forks on start
+ *	  ptrack_skipwal_clean()            --- remove journal, when map is reset
+ *
+ */
+
+#include "postgres.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/smgr.h"
+
+#include "ptrack.h"
+#include "engine.h"
+#include "skipwal.h"
+
+static inline bool
+ptrack_skipwal_exists(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0;
+}
+
+/*
+ * Journal relation fork synced bypassing WAL.  Called by mdimmedsync_hook
+ * before commit, so failure just aborts the transaction.
+ */
+void
+ptrack_skipwal_sync(RelFileNodeBackend smgr_rnode, ForkNumber forknum)
+{
+	char		path[MAXPGPATH];
+	PtrackSkipWalRecord rec;
+	bool		created;
+	int			fd;
+
+	/* Changes are restored by replay of WAL otherwise */
+	if (ptrack_map == NULL || XLogIsNeeded() || RecoveryInProgress() ||
+		smgr_rnode.backend != InvalidBackendId)
+		return;
+
+	MemSet(&rec, 0, sizeof(rec));
+	rec.relnode = smgr_rnode.node;
+	rec.forknum = forknum;
+	rec.nblocks = smgrnblocks(smgropen(smgr_rnode.node, smgr_rnode.backend), forknum);
+	rec.lsn = GetXLogInsertRecPtr();
+
+	if (rec.nblocks == 0)
+		return;
+
+	INIT_CRC32C(rec.crc);
+	COMP_CRC32C(rec.crc, (char *) &rec, offsetof(PtrackSkipWalRecord, crc));
+	FIN_CRC32C(rec.crc);
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_SKIPWAL_PATH);
+	created = !ptrack_skipwal_exists(path);
+
+	/* Single record is appended atomically, even by concurrent backends */
+	fd = OpenTransientFile(path, O_CREAT | O_WRONLY | O_APPEND | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not open file \"%s\": %m", path)));
+
+	errno = 0;
+	if (write(fd, &rec, sizeof(rec)) != sizeof(rec))
+	{
+		/* If write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not write file \"%s\": %m", path)));
+	}
+
+	if (pg_fsync(fd) != 0)
+		ereport(data_sync_elevel(ERROR),
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not fsync file \"%s\": %m", path)));
+
+	if (CloseTransientFile(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not close file \"%s\": %m", path)));
+
+	if (created)
+	{
+		sprintf(path, "%s/global", DataDir);
+		fsync_fname(path, true);
+	}
+
+	elog(DEBUG1, "ptrack: journalled %u blocks of rel %u/%u/%u fork %d synced without WAL",
+		 rec.nblocks, rec.relnode.spcNode, rec.relnode.dbNode,
+		 rec.relnode.relNode, rec.forknum);
+}
+
+/*
+ * Move the journal away before checkpoint scans the map.  Old journal left
+ * by a failed checkpoint is not covered by any map on disk yet, so it is
+ * kept and the current one is left in place instead.  The latter is then
+ * replayed once more on start, which is harmless.
+ */
+void
+ptrack_skipwal_checkpoint_begin(void)
+{
+	char		path[MAXPGPATH];
+	char		old_path[MAXPGPATH];
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_SKIPWAL_PATH);
+	sprintf(old_path, "%s/%s", DataDir, PTRACK_SKIPWAL_OLD_PATH);
+
+	if (ptrack_skipwal_exists(path) && !ptrack_skipwal_exists(old_path))
+		durable_rename(path, old_path, ERROR);
+}
+
+/*
+ * Remove the journal moved away, once the map is durable.
+ */
+void
+ptrack_skipwal_checkpoint_end(void)
+{
+	char		old_path[MAXPGPATH];
+
+	sprintf(old_path, "%s/%s", DataDir, PTRACK_SKIPWAL_OLD_PATH);
+
+	if (ptrack_skipwal_exists(old_path))
+		durable_unlink(old_path, LOG);
+}
+
+static void
+ptrack_skipwal_replay_file(const char *path)
+{
+	PtrackSkipWalRecord rec;
+	int			fd;
+	int			nrecs = 0;
+	int			r;
+
+	fd = BasicOpenFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack init: could not open file \"%s\": %m", path)));
+	}
+
+	while ((r = read(fd, &rec, sizeof(rec))) == sizeof(rec))
+	{
+		pg_crc32c	crc;
+		PtBlockId	bid;
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, (char *) &rec, offsetof(PtrackSkipWalRecord, crc));
+		FIN_CRC32C(crc);
+
+		/* Record torn by crash belongs to uncommitted transaction */
+		if (!EQ_CRC32C(crc, rec.crc))
+		{
+			elog(LOG, "ptrack init: skipping corrupted record of \"%s\"", path);
+			continue;
+		}
+
+		bid.relnode = rec.relnode;
+		bid.forknum = rec.forknum;
+		for (bid.blocknum = 0; bid.blocknum < rec.nblocks; bid.blocknum++)
+			ptrack_map_advance(BID_HASH_FUNC(bid), rec.lsn);
+
+		nrecs++;
+	}
+
+	if (r < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack init: could not read file \"%s\": %m", path)));
+
+	close(fd);
+
+	elog(LOG, "ptrack init: marked %d relation forks synced without WAL from \"%s\"",
+		 nrecs, path);
+}
+
+/*
+ * Mark all blocks of journalled relation forks in the map just restored
+ * from disk.  Journals are removed by the next checkpoint.
+ */
+void
+ptrack_skipwal_replay(void)
+{
+	char		path[MAXPGPATH];
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_SKIPWAL_OLD_PATH);
+	ptrack_skipwal_replay_file(path);
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_SKIPWAL_PATH);
+	ptrack_skipwal_replay_file(path);
+}
+
+/*
+ * Remove journals, when map is initialized from scratch or disabled.
+ */
+void
+ptrack_skipwal_clean(void)
+{
+	char		path[MAXPGPATH];
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_SKIPWAL_PATH);
+	if (ptrack_skipwal_exists(path))
+		durable_unlink(path, LOG);
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_SKIPWAL_OLD_PATH);
+	if (ptrack_skipwal_exists(path))
+		durable_unlink(path, LOG);
+}
@@ -0,0 +1,46 @@
+/*-------------------------------------------------------------------------
+ *
+ * skipwal.h
+ *	  header for persistence of marks of relations skipping WAL
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/skipwal.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_SKIPWAL_H
+#define PTRACK_SKIPWAL_H
+
+#include "access/xlogdefs.h"
+#include "port/pg_crc32c.h"
+#include "storage/relfilenode.h"
+
+/* Journal of relation forks synced bypassing WAL since the last checkpoint */
+#define PTRACK_SKIPWAL_PATH "global/ptrack.skipwal"
+/* Journal being replaced by the checkpoint in progress */
+#define PTRACK_SKIPWAL_OLD_PATH "global/ptrack.skipwal.old"
+
+/*
+ * Record of the journal.  All blocks of the fork below 'nblocks' are marked
+ * with 'lsn' on the next server start.
+ */
+typedef struct PtrackSkipWalRecord
+{
+	RelFileNode relnode;
+	ForkNumber	forknum;
+	BlockNumber nblocks;
+	XLogRecPtr	lsn;
+	/* CRC of everything above */
+	pg_crc32c	crc;
+}			PtrackSkipWalRecord;
+
+extern void ptrack_skipwal_sync(RelFileNodeBackend smgr_rnode, ForkNumber forknum);
+extern void ptrack_skipwal_checkpoint_begin(void);
+extern void ptrack_skipwal_checkpoint_end(void);
+extern void ptrack_skipwal_replay(void);
+extern void ptrack_skipwal_clean(void);
+
+#endif							/* PTRACK_SKIPWAL_H */
@@ -0,0 +1,527 @@
+/*
+ * slots.c
+ *		Named persistent positions of ptrack consumers
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/slots.c
+ *
+ * Several independent consumers (backups, block mirrors, verification
+ * jobs) may read changes from the same ptrack map.  Each of them can
+ * register a slot, which durably stores the LSN since which changes are
+ * not yet consumed, so that nobody has to keep this LSN externally.
+ *
+ * Slots are kept in shared memory and are written to PTRACK_SLOTS_PATH
+ * each time they are modified, so slot position never goes backward or
+ * forward silently after crash.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrackSlotsShmemSize()  --- shared memory size required for slots
+ *	  ptrackSlotsShmemInit()  --- allocate slots and restore them from disk
+ *	  ptrack_slot_create()    --- create new slot
+ *	  ptrack_slot_drop()      --- drop existing slot
+ *	  ptrack_slot_get_lsn()   --- get current slot position
+ *	  ptrack_slot_advance()   --- move slot position forward
+ *	  ptrack_slots_snapshot() --- get a copy of all slots in use
+ *
+ */
+
+#include "postgres.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "storage/shmem.h"
+
+#include "ptrack.h"
+#include "engine.h"
+#include "slots.h"
+
+PtrackSlotsCtlData *ptrack_slots = NULL;
+int			ptrack_max_slots;
+
+/*
+ * Header of ptrack.slots file.  It is followed by 'nslots' PtrackSlot's
+ * and CRC of type pg_crc32c of everything before it.
+ */
+typedef struct PtrackSlotsFileHdr
+{
+	char		magic[PTRACK_MAGIC_SIZE];
+	uint32		version_num;
+	uint32		nslots;
+}			PtrackSlotsFileHdr;
+
+static void ptrack_slots_read(void);
+static void ptrack_slots_write(void);
+static PtrackSlot *ptrack_slot_find(const char *name);
+
+/*
+ * Shared memory size required for ptrack slots.
+ */
+Size
+ptrackSlotsShmemSize(void)
+{
+	return add_size(offsetof(PtrackSlotsCtlData, slots),
+					mul_size(ptrack_max_slots, sizeof(PtrackSlot)));
+}
+
+/*
+ * Allocate ptrack slots in shared memory and restore them from disk.
+ * Slots are read only once by postmaster, other processes just attach.
+ */
+void
+ptrackSlotsShmemInit(LWLock *lock)
+{
+	bool		found;
+
+	ptrack_slots = ShmemInitStruct("ptrack slots",
+								   ptrackSlotsShmemSize(),
+								   &found);
+
+	if (!found)
+	{
+		MemSet(ptrack_slots, 0, ptrackSlotsShmemSize());
+		ptrack_slots->lock = lock;
+
+		if (DataDir != NULL && !IsBootstrapProcessingMode())
+			ptrack_slots_read();
+	}
+}
+
+/*
+ * Restore slots from PTRACK_SLOTS_PATH, if any.
+ */
+static void
+ptrack_slots_read(void)
+{
+	char		slots_path[MAXPGPATH];
+	int			fd;
+	PtrackSlotsFileHdr hdr;
+	PtrackSlot	slot;
+	pg_crc32c	crc;
+	pg_crc32c	file_crc;
+	uint32		i;
+
+	sprintf(slots_path, "%s/%s", DataDir, PTRACK_SLOTS_PATH);
+
+	fd = BasicOpenFile(slots_path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return;
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack slots: could not open file \"%s\": %m", slots_path)));
+	}
+
+	INIT_CRC32C(crc);
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		memcmp(hdr.magic, PTRACK_SLOTS_MAGIC, sizeof(PTRACK_SLOTS_MAGIC)) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack slots: wrong format of file \"%s\"", slots_path),
+				 errhint("Delete \"%s\" and start the server again.", slots_path)));
+
+	COMP_CRC32C(crc, (char *) &hdr, sizeof(hdr));
+
+	if (hdr.nslots > ptrack_max_slots)
+		ereport(ERROR,
+				(errmsg("ptrack slots: too many slots in file \"%s\"", slots_path),
+				 errhint("Increase ptrack.max_slots to at least %u.", hdr.nslots)));
+
+	for (i = 0; i < hdr.nslots; i++)
+	{
+		if (read(fd, &slot, sizeof(slot)) != sizeof(slot))
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("ptrack slots: unexpected end of file \"%s\"", slots_path),
+					 errhint("Delete \"%s\" and start the server again.", slots_path)));
+
+		COMP_CRC32C(crc, (char *) &slot, sizeof(slot));
+		ptrack_slots->slots[i] = slot;
+	}
+
+	FIN_CRC32C(crc);
+
+	if (read(fd, &file_crc, sizeof(file_crc)) != sizeof(file_crc) ||
+		!EQ_CRC32C(file_crc, crc))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack slots: incorrect checksum of file \"%s\"", slots_path),
+				 errhint("Delete \"%s\" and start the server again.", slots_path)));
+
+	close(fd);
+
+	elog(DEBUG1, "ptrack slots: restored %u slots", hdr.nslots);
+}
+
+/*
+ * Durably write all slots in use to PTRACK_SLOTS_PATH.
+ *
+ * Caller must hold ptrack_slots->lock in exclusive mode.
+ */
+static void
+ptrack_slots_write(void)
+{
+	char		slots_path[MAXPGPATH];
+	char		slots_path_tmp[MAXPGPATH];
+	int			fd;
+	PtrackSlotsFileHdr hdr;
+	pg_crc32c	crc;
+	int			i;
+
+	sprintf(slots_path, "%s/%s", DataDir, PTRACK_SLOTS_PATH);
+	sprintf(slots_path_tmp, "%s/%s", DataDir, PTRACK_SLOTS_PATH_TMP);
+
+	/* Transient file is closed automatically on error */
+	fd = OpenTransientFile(slots_path_tmp, O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack slots: could not create file \"%s\": %m", slots_path_tmp)));
+
+	MemSet(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PTRACK_SLOTS_MAGIC, sizeof(PTRACK_SLOTS_MAGIC));
+	hdr.version_num = PTRACK_VERSION_NUM;
+	for (i = 0; i < ptrack_max_slots; i++)
+		if (ptrack_slots->slots[i].in_use)
+			hdr.nslots++;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) &hdr, sizeof(hdr));
+
+	errno = 0;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto write_error;
+
+	for (i = 0; i < ptrack_max_slots; i++)
+	{
+		PtrackSlot *slot = &ptrack_slots->slots[i];
+
+		if (!slot->in_use)
+			continue;
+
+		COMP_CRC32C(crc, (char *) slot, sizeof(PtrackSlot));
+		if (write(fd, slot, sizeof(PtrackSlot)) != sizeof(PtrackSlot))
+			goto write_error;
+	}
+
+	FIN_CRC32C(crc);
+
+	if (write(fd, &crc, sizeof(crc)) != sizeof(crc))
+		goto write_error;
+
+	if (pg_fsync(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack slots: could not fsync file \"%s\": %m", slots_path_tmp)));
+
+	if (CloseTransientFile(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack slots: could not close file \"%s\": %m", slots_path_tmp)));
+
+	durable_rename(slots_path_tmp, slots_path, ERROR);
+	return;
+
+write_error:
+	/* If write didn't set errno, assume problem is no disk space */
+	if (errno == 0)
+		errno = ENOSPC;
+
+	ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("ptrack slots: could not write file \"%s\": %m", slots_path_tmp)));
+}
+
+/*
+ * Find slot in use by name.  Caller must hold ptrack_slots->lock.
+ */
+static PtrackSlot *
+ptrack_slot_find(const char *name)
+{
+	int			i;
+
+	for (i = 0; i < ptrack_max_slots; i++)
+	{
+		PtrackSlot *slot = &ptrack_slots->slots[i];
+
+		if (slot->in_use && strcmp(NameStr(slot->name), name) == 0)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Error out if slots are not usable right now.
+ */
+static void
+ptrack_slots_check(const char *name)
+{
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (ptrack_slots == NULL || ptrack_max_slots == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("ptrack slots are disabled"),
+				 errhint("Set ptrack.max_slots to a value greater than zero.")));
+
+	if (name != NULL && (strlen(name) == 0 || strlen(name) >= NAMEDATALEN))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("invalid ptrack slot name \"%s\"", name)));
+}
+
+/*
+ * Create new slot with position 'lsn' or with the current LSN, if 'lsn'
+ * is invalid.  Returns actual slot position.
+ */
+XLogRecPtr
+ptrack_slot_create(const char *name, XLogRecPtr lsn)
+{
+	PtrackSlot *slot = NULL;
+	XLogRecPtr	cur_lsn;
+	XLogRecPtr	init_lsn;
+	int			i;
+
+	ptrack_slots_check(name);
+
+	if (RecoveryInProgress())
+		cur_lsn = GetXLogReplayRecPtr(NULL);
+	else
+		cur_lsn = GetXLogInsertRecPtr();
+
+	/*
+	 * Make sure, that init_lsn is set, otherwise the first checkpoint will
+	 * set it after the slot position and slot will become invalid.
+	 */
+	init_lsn = ptrack_set_init_lsn(cur_lsn);
+
+	if (lsn == InvalidXLogRecPtr)
+		lsn = cur_lsn;
+	else if (lsn < init_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ptrack slot position %X/%X precedes ptrack init LSN %X/%X",
+						(uint32) (lsn >> 32), (uint32) lsn,
+						(uint32) (init_lsn >> 32), (uint32) init_lsn)));
+	else if (lsn > cur_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ptrack slot position %X/%X is in the future",
+						(uint32) (lsn >> 32), (uint32) lsn)));
+
+	LWLockAcquire(ptrack_slots->lock, LW_EXCLUSIVE);
+
+	if (ptrack_slot_find(name) != NULL)
+	{
+		LWLockRelease(ptrack_slots->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_OBJECT),
+				 errmsg("ptrack slot \"%s\" already exists", name)));
+	}
+
+	for (i = 0; i < ptrack_max_slots; i++)
+	{
+		if (!ptrack_slots->slots[i].in_use)
+		{
+			slot = &ptrack_slots->slots[i];
+			break;
+		}
+	}
+
+	if (slot == NULL)
+	{
+		LWLockRelease(ptrack_slots->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("all ptrack slots are in use"),
+				 errhint("Free one or increase ptrack.max_slots.")));
+	}
+
+	MemSet(slot, 0, sizeof(PtrackSlot));
+	namestrcpy(&slot->name, name);
+	slot->lsn = lsn;
+	slot->in_use = true;
+
+	PG_TRY();
+	{
+		ptrack_slots_write();
+	}
+	PG_CATCH();
+	{
+		/* Do not leave slot in memory, if we were unable to persist it */
+		slot->in_use = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	LWLockRelease(ptrack_slots->lock);
+
+	elog(DEBUG1, "ptrack slot \"%s\" created at %X/%X",
+		 name, (uint32) (lsn >> 32), (uint32) lsn);
+
+	return lsn;
+}
+
+/*
+ * Drop existing slot.
+ */
+void
+ptrack_slot_drop(const char *name)
+{
+	PtrackSlot *slot;
+
+	ptrack_slots_check(name);
+
+	LWLockAcquire(ptrack_slots->lock, LW_EXCLUSIVE);
+
+	slot = ptrack_slot_find(name);
+	if (slot == NULL)
+	{
+		LWLockRelease(ptrack_slots->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("ptrack slot \"%s\" does not exist", name)));
+	}
+
+	slot->in_use = false;
+
+	PG_TRY();
+	{
+		ptrack_slots_write();
+	}
+	PG_CATCH();
+	{
+		slot->in_use = true;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	LWLockRelease(ptrack_slots->lock);
+}
+
+/*
+ * Get current position of the slot.
+ */
+XLogRecPtr
+ptrack_slot_get_lsn(const char *name)
+{
+	PtrackSlot *slot;
+	XLogRecPtr	lsn;
+
+	ptrack_slots_check(name);
+
+	LWLockAcquire(ptrack_slots->lock, LW_SHARED);
+
+	slot = ptrack_slot_find(name);
+	if (slot == NULL)
+	{
+		LWLockRelease(ptrack_slots->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("ptrack slot \"%s\" does not exist", name)));
+	}
+
+	lsn = slot->lsn;
+
+	LWLockRelease(ptrack_slots->lock);
+
+	return lsn;
+}
+
+/*
+ * Atomically move slot position forward up to 'upto_lsn'.  New position
+ * is durably stored before we return it.  Moving slot backward is a no-op,
+ * since it could only mean, that consumer got the same changes twice.
+ */
+XLogRecPtr
+ptrack_slot_advance(const char *name, XLogRecPtr upto_lsn)
+{
+	PtrackSlot *slot;
+	XLogRecPtr	cur_lsn;
+	XLogRecPtr	old_lsn;
+
+	ptrack_slots_check(name);
+
+	if (RecoveryInProgress())
+		cur_lsn = GetXLogReplayRecPtr(NULL);
+	else
+		cur_lsn = GetXLogInsertRecPtr();
+
+	if (upto_lsn > cur_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot advance ptrack slot \"%s\" to %X/%X, which is in the future",
+						name, (uint32) (upto_lsn >> 32), (uint32) upto_lsn)));
+
+	LWLockAcquire(ptrack_slots->lock, LW_EXCLUSIVE);
+
+	slot = ptrack_slot_find(name);
+	if (slot == NULL)
+	{
+		LWLockRelease(ptrack_slots->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("ptrack slot \"%s\" does not exist", name)));
+	}
+
+	old_lsn = slot->lsn;
+
+	if (upto_lsn > old_lsn)
+	{
+		slot->lsn = upto_lsn;
+
+		PG_TRY();
+		{
+			ptrack_slots_write();
+		}
+		PG_CATCH();
+		{
+			slot->lsn = old_lsn;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+
+	upto_lsn = slot->lsn;
+
+	LWLockRelease(ptrack_slots->lock);
+
+	return upto_lsn;
+}
+
+/*
+ * Return palloc'ed copy of all slots in use and their number.
+ */
+int
+ptrack_slots_snapshot(PtrackSlot **slots)
+{
+	int			nslots = 0;
+	int			i;
+
+	ptrack_slots_check(NULL);
+
+	*slots = (PtrackSlot *) palloc(sizeof(PtrackSlot) * ptrack_max_slots);
+
+	LWLockAcquire(ptrack_slots->lock, LW_SHARED);
+
+	for (i = 0; i < ptrack_max_slots; i++)
+	{
+		if (ptrack_slots->slots[i].in_use)
+			(*slots)[nslots++] = ptrack_slots->slots[i];
+	}
+
+	LWLockRelease(ptrack_slots->lock);
+
+	return nslots;
+}
@@ -0,0 +1,62 @@
+/*-------------------------------------------------------------------------
+ *
+ * slots.h
+ *	  header for named persistent positions of ptrack consumers
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/slots.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_SLOTS_H
+#define PTRACK_SLOTS_H
+
+#include "access/xlogdefs.h"
+#include "storage/lwlock.h"
+
+/* Persistent copy of ptrack slots */
+#define PTRACK_SLOTS_PATH "global/ptrack.slots"
+/* Used for atomical crash-safe update of ptrack.slots */
+#define PTRACK_SLOTS_PATH_TMP "global/ptrack.slots.tmp"
+
+/* Ptrack slots magic bytes, distinct from the magics of map files */
+#define PTRACK_SLOTS_MAGIC "ptl"
+
+/*
+ * Named position of a single ptrack consumer.  All blocks changed since
+ * 'lsn' are not yet consumed by the slot owner.
+ */
+typedef struct PtrackSlot
+{
+	bool		in_use;
+	NameData	name;
+	XLogRecPtr	lsn;
+}			PtrackSlot;
+
+/*
+ * Shared memory state of all ptrack slots.  Array of slots is protected
+ * by 'lock', which is also held while slots are written to disk, so the
+ * on-disk copy is always consistent with what we reported to the users.
+ */
+typedef struct PtrackSlotsCtlData
+{
+	LWLock	   *lock;
+	PtrackSlot	slots[FLEXIBLE_ARRAY_MEMBER];
+}			PtrackSlotsCtlData;
+
+extern PtrackSlotsCtlData * ptrack_slots;
+extern int	ptrack_max_slots;
+
+extern Size ptrackSlotsShmemSize(void);
+extern void ptrackSlotsShmemInit(LWLock *lock);
+
+extern XLogRecPtr ptrack_slot_create(const char *name, XLogRecPtr lsn);
+extern void ptrack_slot_drop(const char *name);
+extern XLogRecPtr ptrack_slot_get_lsn(const char *name);
+extern XLogRecPtr ptrack_slot_advance(const char *name, XLogRecPtr upto_lsn);
+extern int	ptrack_slots_snapshot(PtrackSlot **slots);
+
+#endif							/* PTRACK_SLOTS_H */
@@ -0,0 +1,446 @@
+/*
+ * snapshot.c
+ *		Retained snapshots of ptrack map
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/snapshot.c
+ *
+ * Map keeps only the latest LSN of each slot, so it can tell which blocks
+ * were changed since some LSN, but not which were changed between two LSNs
+ * in the past.  To answer such questions we retain on-disk copies of the
+ * map written by selected checkpoints in PTRACK_SNAPSHOT_DIR.  All changes
+ * made before the checkpoint redo LSN are flushed by the checkpoint and
+ * marked before the map is written, so snapshot named by this LSN contains
+ * every block changed between its init_lsn and its own LSN.
+ *
+ * ptrack.map is never changed in place, each checkpoint replaces it with
+ * a new file, so a snapshot is just a hard link to the current ptrack.map
+ * (or its copy, where hard links are not supported).
+ *
+ * Snapshot is taken by the first checkpoint started after
+ * ptrack_snapshot_request(), a checkpoint already in progress does not
+ * count, since it may have missed changes made before the request.  Oldest
+ * snapshots are removed on every checkpoint to keep at most
+ * ptrack.snapshots of them taking at most ptrack.snapshots_max_size.
+ * Snapshots of another map size or layout cannot be used, so they are
+ * removed at start.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrackSnapshotShmemSize()    --- shared memory size required for snapshots
+ *	  ptrackSnapshotShmemInit()    --- allocate snapshots state in shared memory
+ *	  ptrack_snapshot_request()    --- take snapshot by immediate checkpoint
+ *	  ptrack_snapshot_checkpoint() --- take requested snapshot and remove old ones
+ *	  ptrack_snapshot_check()      --- remove snapshots incompatible with the map
+ *	  ptrack_snapshot_load()       --- load the oldest snapshot taken after LSN
+ *	  ptrack_snapshot_clean()      --- remove all snapshots
+ *
+ */
+
+#include "postgres.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "postmaster/bgwriter.h"
+#include "storage/copydir.h"
+#include "storage/fd.h"
+#include "storage/shmem.h"
+
+#include "ptrack.h"
+#include "engine.h"
+#include "snapshot.h"
+
+/*
+ * Snapshot file found on disk.
+ */
+typedef struct PtrackSnapshotFile
+{
+	XLogRecPtr	lsn;
+	off_t		size;
+}			PtrackSnapshotFile;
+
+PtrackSnapshotCtlData *ptrack_snapshot_ctl = NULL;
+int			ptrack_snapshots;
+int			ptrack_snapshots_max_size;
+
+static inline void
+ptrack_snapshot_path(char *path, XLogRecPtr lsn)
+{
+	snprintf(path, MAXPGPATH, "%s/%s/%08X%08X%s", DataDir, PTRACK_SNAPSHOT_DIR,
+			 (uint32) (lsn >> 32), (uint32) lsn, PTRACK_SNAPSHOT_SUFFIX);
+}
+
+static int
+ptrack_snapshot_cmp(const void *a, const void *b)
+{
+	XLogRecPtr	lsn_a = ((const PtrackSnapshotFile *) a)->lsn;
+	XLogRecPtr	lsn_b = ((const PtrackSnapshotFile *) b)->lsn;
+
+	if (lsn_a < lsn_b)
+		return -1;
+	else if (lsn_a > lsn_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Find all snapshots on disk and return their number.  Snapshots are
+ * sorted by LSN.
+ */
+static int
+ptrack_snapshot_list(PtrackSnapshotFile * *files)
+{
+	char		dir_path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+	int			nfiles = 0;
+	int			maxfiles = 16;
+
+	*files = NULL;
+
+	sprintf(dir_path, "%s/%s", DataDir, PTRACK_SNAPSHOT_DIR);
+
+	dir = AllocateDir(dir_path);
+	if (dir == NULL && errno == ENOENT)
+		return 0;
+
+	*files = palloc(maxfiles * sizeof(PtrackSnapshotFile));
+
+	while ((de = ReadDir(dir, dir_path)) != NULL)
+	{
+		char		path[MAXPGPATH];
+		struct stat st;
+		uint32		hi;
+		uint32		lo;
+
+		if (strlen(de->d_name) != 16 + strlen(PTRACK_SNAPSHOT_SUFFIX) ||
+			strcmp(de->d_name + 16, PTRACK_SNAPSHOT_SUFFIX) != 0 ||
+			sscanf(de->d_name, "%08X%08X", &hi, &lo) != 2)
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", dir_path, de->d_name);
+		if (stat(path, &st) < 0)
+		{
+			/* Removed concurrently by checkpointer */
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not stat file \"%s\": %m", path)));
+		}
+
+		if (nfiles == maxfiles)
+		{
+			maxfiles *= 2;
+			*files = repalloc(*files, maxfiles * sizeof(PtrackSnapshotFile));
+		}
+
+		(*files)[nfiles].lsn = (uint64) hi << 32 | lo;
+		(*files)[nfiles].size = st.st_size;
+		nfiles++;
+	}
+
+	FreeDir(dir);
+
+	qsort(*files, nfiles, sizeof(PtrackSnapshotFile), ptrack_snapshot_cmp);
+
+	return nfiles;
+}
+
+/*
+ * Remove oldest snapshots exceeding ptrack.snapshots and
+ * ptrack.snapshots_max_size.
+ */
+static void
+ptrack_snapshot_retain(void)
+{
+	PtrackSnapshotFile *files;
+	int			nfiles;
+	int			i;
+	uint64		total_size = 0;
+
+	nfiles = ptrack_snapshot_list(&files);
+
+	for (i = 0; i < nfiles; i++)
+		total_size += files[i].size;
+
+	for (i = 0; i < nfiles; i++)
+	{
+		char		path[MAXPGPATH];
+
+		if (nfiles - i <= ptrack_snapshots &&
+			(ptrack_snapshots_max_size == 0 ||
+			 total_size <= (uint64) ptrack_snapshots_max_size * 1024 * 1024))
+			break;
+
+		ptrack_snapshot_path(path, files[i].lsn);
+		durable_unlink(path, LOG);
+		total_size -= files[i].size;
+
+		elog(DEBUG1, "ptrack checkpoint: removed snapshot %X/%X",
+			 (uint32) (files[i].lsn >> 32), (uint32) files[i].lsn);
+	}
+
+	if (files != NULL)
+		pfree(files);
+}
+
+/*
+ * Retain the map just written to 'ptrack_path' as a snapshot 'snap_lsn'.
+ */
+static void
+ptrack_snapshot_take(const char *ptrack_path, XLogRecPtr snap_lsn)
+{
+	char		dir_path[MAXPGPATH];
+	char		snap_path[MAXPGPATH];
+
+	sprintf(dir_path, "%s/%s", DataDir, PTRACK_SNAPSHOT_DIR);
+	if (MakePGDirectory(dir_path) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not create directory \"%s\": %m", dir_path)));
+
+	ptrack_snapshot_path(snap_path, snap_lsn);
+
+	if (link(ptrack_path, snap_path) < 0)
+	{
+		/* Checkpoint was skipped and we have this snapshot already */
+		if (errno != EEXIST)
+			copy_file((char *) ptrack_path, snap_path);
+	}
+
+	fsync_fname(snap_path, false);
+	fsync_fname(dir_path, true);
+
+	pg_atomic_write_u64(&ptrack_snapshot_ctl->last_lsn, snap_lsn);
+
+	elog(DEBUG1, "ptrack checkpoint: took snapshot %X/%X",
+		 (uint32) (snap_lsn >> 32), (uint32) snap_lsn);
+}
+
+/*
+ * Get the amount of shared memory required for snapshots.
+ */
+Size
+ptrackSnapshotShmemSize(void)
+{
+	return sizeof(PtrackSnapshotCtlData);
+}
+
+/*
+ * Allocate snapshots state in shared memory.
+ */
+void
+ptrackSnapshotShmemInit(void)
+{
+	bool		found;
+
+	ptrack_snapshot_ctl = ShmemInitStruct("ptrack snapshots",
+										  ptrackSnapshotShmemSize(),
+										  &found);
+
+	if (!found)
+	{
+		pg_atomic_init_u64(&ptrack_snapshot_ctl->requested_lsn, InvalidXLogRecPtr);
+		pg_atomic_init_u64(&ptrack_snapshot_ctl->last_lsn, InvalidXLogRecPtr);
+	}
+}
+
+/*
+ * Take snapshot of the map by immediate checkpoint and return its LSN.
+ */
+XLogRecPtr
+ptrack_snapshot_request(void)
+{
+	XLogRecPtr	lsn;
+	XLogRecPtr	last_lsn;
+	uint64		requested_lsn;
+	bool		recovery;
+
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (ptrack_snapshots == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("ptrack snapshots are disabled"),
+				 errhint("Set ptrack.snapshots to a positive value.")));
+
+	/*
+	 * Redo LSN of every checkpoint started after this point is not less than
+	 * the current end of WAL, so a checkpoint in progress cannot take the
+	 * snapshot for us.  Restartpoint starts at an already replayed checkpoint
+	 * record, so standby only needs a snapshot newer than the last one.
+	 */
+	recovery = RecoveryInProgress();
+	last_lsn = pg_atomic_read_u64(&ptrack_snapshot_ctl->last_lsn);
+	lsn = recovery ? last_lsn + 1 : GetXLogInsertRecPtr();
+
+	requested_lsn = pg_atomic_read_u64(&ptrack_snapshot_ctl->requested_lsn);
+	while (requested_lsn < lsn &&
+		   !pg_atomic_compare_exchange_u64(&ptrack_snapshot_ctl->requested_lsn,
+										   &requested_lsn, lsn));
+
+	/*
+	 * Checkpoint started after our request leaves it pending, if a concurrent
+	 * request for a later LSN came before its end, so wait for the next one.
+	 */
+	do
+	{
+		RequestCheckpoint(CHECKPOINT_IMMEDIATE | CHECKPOINT_FORCE | CHECKPOINT_WAIT);
+	} while (!recovery &&
+			 pg_atomic_read_u64(&ptrack_snapshot_ctl->requested_lsn) >= lsn);
+
+	last_lsn = pg_atomic_read_u64(&ptrack_snapshot_ctl->last_lsn);
+
+	/*
+	 * Restartpoint is skipped, if no checkpoint record was replayed since the
+	 * previous one, so the old snapshot must not be reported as a new one.
+	 * Checkpointer also takes none, if its ptrack.snapshots was reset.
+	 */
+	if (last_lsn < lsn)
+	{
+		requested_lsn = lsn;
+		pg_atomic_compare_exchange_u64(&ptrack_snapshot_ctl->requested_lsn,
+									   &requested_lsn, InvalidXLogRecPtr);
+
+		if (recovery)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("ptrack snapshot was not taken, since no checkpoint was replayed after the last restartpoint"),
+					 errhint("Run CHECKPOINT on primary and try again.")));
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("ptrack snapshot was not taken by checkpoint")));
+	}
+
+	return last_lsn;
+}
+
+/*
+ * Called by checkpointer after the map is written to 'ptrack_path' with
+ * redo LSN 'snap_lsn'.
+ */
+void
+ptrack_snapshot_checkpoint(const char *ptrack_path, XLogRecPtr snap_lsn)
+{
+	uint64		requested_lsn;
+
+	requested_lsn = pg_atomic_read_u64(&ptrack_snapshot_ctl->requested_lsn);
+
+	/* Request made after the start of this checkpoint is left to the next one */
+	if (requested_lsn != InvalidXLogRecPtr && requested_lsn <= snap_lsn)
+	{
+		/* Newer request may come concurrently, it is kept then */
+		pg_atomic_compare_exchange_u64(&ptrack_snapshot_ctl->requested_lsn,
+									   &requested_lsn, InvalidXLogRecPtr);
+
+		if (ptrack_snapshots > 0)
+			ptrack_snapshot_take(ptrack_path, snap_lsn);
+	}
+
+	ptrack_snapshot_retain();
+}
+
+/*
+ * Remove snapshots, which cannot be used with the current map, e.g. after
+ * ptrack.map_size or ptrack.map_layout was changed.  Called by postmaster
+ * at start.
+ */
+void
+ptrack_snapshot_check(void)
+{
+	PtrackSnapshotFile *files;
+	int			nfiles;
+	int			i;
+
+	nfiles = ptrack_snapshot_list(&files);
+
+	for (i = 0; i < nfiles; i++)
+	{
+		char		path[MAXPGPATH];
+
+		ptrack_snapshot_path(path, files[i].lsn);
+
+		if (!ptrack_map_file_compatible(path))
+		{
+			durable_unlink(path, LOG);
+
+			elog(LOG, "ptrack init: removed snapshot %X/%X incompatible with the map",
+				 (uint32) (files[i].lsn >> 32), (uint32) files[i].lsn);
+		}
+	}
+
+	if (files != NULL)
+		pfree(files);
+}
+
+/*
+ * Load entries of the oldest snapshot, which has all changes made between
+ * 'start_lsn' and 'end_lsn'.  Returns NULL if all snapshots were taken
+ * before 'end_lsn', then the current map has to be used.
+ */
+uint64 *
+ptrack_snapshot_load(XLogRecPtr start_lsn, XLogRecPtr end_lsn)
+{
+	PtrackSnapshotFile *files;
+	PtrackMapFileHdr hdr;
+	int			nfiles;
+	int			i;
+	char		path[MAXPGPATH];
+	uint64	   *entries;
+
+	nfiles = ptrack_snapshot_list(&files);
+
+	for (i = 0; i < nfiles; i++)
+	{
+		if (files[i].lsn >= end_lsn)
+			break;
+	}
+
+	if (i == nfiles)
+	{
+		if (files != NULL)
+			pfree(files);
+		return NULL;
+	}
+
+	ptrack_snapshot_path(path, files[i].lsn);
+	entries = ptrack_map_file_load(path, &hdr);
+
+	if (hdr.init_lsn == InvalidXLogRecPtr || start_lsn < hdr.init_lsn)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("start LSN %X/%X precedes init LSN %X/%X of ptrack snapshot %X/%X",
+						(uint32) (start_lsn >> 32), (uint32) start_lsn,
+						(uint32) (hdr.init_lsn >> 32), (uint32) hdr.init_lsn,
+						(uint32) (files[i].lsn >> 32), (uint32) files[i].lsn)));
+
+	elog(DEBUG1, "ptrack: using snapshot %X/%X for changes up to %X/%X",
+		 (uint32) (files[i].lsn >> 32), (uint32) files[i].lsn,
+		 (uint32) (end_lsn >> 32), (uint32) end_lsn);
+
+	pfree(files);
+
+	return entries;
+}
+
+/*
+ * Remove all snapshots, when ptrack is disabled.
+ */
+void
+ptrack_snapshot_clean(void)
+{
+	char		dir_path[MAXPGPATH];
+	struct stat st;
+
+	sprintf(dir_path, "%s/%s", DataDir, PTRACK_SNAPSHOT_DIR);
+
+	if (stat(dir_path, &st) == 0 && !rmtree(dir_path, true))
+		elog(LOG, "could not remove directory \"%s\"", dir_path);
+}
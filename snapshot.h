@@ -0,0 +1,50 @@
+/*-------------------------------------------------------------------------
+ *
+ * snapshot.h
+ *	  header for retained snapshots of ptrack map
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/snapshot.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_SNAPSHOT_H
+#define PTRACK_SNAPSHOT_H
+
+#include "access/xlogdefs.h"
+#include "port/atomics.h"
+
+/* Directory with retained snapshots of ptrack.map */
+#define PTRACK_SNAPSHOT_DIR "pg_ptrack"
+
+/* Snapshot file name is its LSN in hex followed by this suffix */
+#define PTRACK_SNAPSHOT_SUFFIX ".snap"
+
+/*
+ * Shared state of snapshots.  Backends raise 'requested_lsn' to the end of
+ * WAL and wait for the checkpoint, which redo LSN is not less than it.  That
+ * checkpoint takes the snapshot and reports its LSN in 'last_lsn'.
+ */
+typedef struct PtrackSnapshotCtlData
+{
+	pg_atomic_uint64 requested_lsn;
+	pg_atomic_uint64 last_lsn;
+}			PtrackSnapshotCtlData;
+
+extern PtrackSnapshotCtlData * ptrack_snapshot_ctl;
+extern int	ptrack_snapshots;
+extern int	ptrack_snapshots_max_size;
+
+extern Size ptrackSnapshotShmemSize(void);
+extern void ptrackSnapshotShmemInit(void);
+
+extern XLogRecPtr ptrack_snapshot_request(void);
+extern void ptrack_snapshot_checkpoint(const char *ptrack_path, XLogRecPtr snap_lsn);
+extern void ptrack_snapshot_check(void);
+extern uint64 *ptrack_snapshot_load(XLogRecPtr start_lsn, XLogRecPtr end_lsn);
+extern void ptrack_snapshot_clean(void);
+
+#endif							/* PTRACK_SNAPSHOT_H */
@@ -0,0 +1,446 @@
+/*
+ * standby.c
+ *		Deferred tracking of changes replayed by standby
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/standby.c
+ *
+ * Standby marks every block written by replay, the same way primary does,
+ * so the startup process pays for ptrack_mark_block() on each of them.
+ * Standbys, which exist only for failover, do not need an up to date map
+ * until they are promoted.  With ptrack.standby_mode = deferred blocks
+ * written by replay are not marked at all.  Instead, checkpointer reads the
+ * replayed WAL once more and marks all blocks it references at the end LSN
+ * of their records, off the critical path of replay.
+ *
+ * Standby removes WAL older than its restartpoint, so replayed WAL cannot
+ * be kept until promotion.  Thus, it is summarized by every restartpoint
+ * just before the map is written, and the rest of it by the first
+ * checkpoint after promotion (or end of crash recovery).  Map written to
+ * disk always covers all changes up to its redo LSN, as usual.  Until the
+ * replayed WAL is summarized, scans report every block as changed, so
+ * backups taken from a promoted node in between are just larger.
+ *
+ * WAL is read directly from pg_wal, taking the segment of the latest
+ * timeline available.  If it is missing (e.g. it was restored from the
+ * archive and removed), changes cannot be summarized, so init_lsn of the map
+ * is moved forward with a warning and the next backup has to be a full one.
+ *
+ * Some blocks are changed by replay without a block reference in the
+ * record.  Truncation of the visibility map and free space map is covered
+ * by marking both forks entirely, databases created by replay are marked by
+ * copydir hook as usual.  Other updates of the free space map are not
+ * WAL-logged at all, so they are lost, the same as hint bits.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrackStandbyShmemSize()     --- shared memory size required for standby state
+ *	  ptrackStandbyShmemInit()     --- allocate standby state in shared memory
+ *	  ptrack_replay_deferred()     --- check whether replay is summarized later
+ *	  ptrack_standby_checkpoint()  --- summarize replayed WAL into the map
+ *	  ptrack_standby_pending_lsn() --- get LSN to report, while WAL is not summarized
+ *
+ */
+
+#include "postgres.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access/rmgr.h"
+#include "access/xlog_internal.h"
+#include "access/xlogreader.h"
+#include "catalog/pg_control.h"
+#include "catalog/storage_xlog.h"
+#include "common/controldata_utils.h"
+#include "common/relpath.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/shmem.h"
+
+#include "ptrack.h"
+#include "engine.h"
+#include "standby.h"
+
+/* Segment of WAL being read, see ptrack_standby_read_page() */
+typedef struct PtrackWalFile
+{
+	int			fd;
+	XLogSegNo	segno;
+	TimeLineID	tli;
+	/* Latest timeline to look for segments */
+	TimeLineID	max_tli;
+}			PtrackWalFile;
+
+PtrackStandbyCtlData *ptrack_standby = NULL;
+int			ptrack_standby_mode = PTRACK_STANDBY_IMMEDIATE;
+
+/* Files, which make server start recovery even after clean shutdown */
+static const char *const ptrack_recovery_files[] = {
+	BACKUP_LABEL_FILE,
+#if PG_VERSION_NUM >= 120000
+	RECOVERY_SIGNAL_FILE,
+	STANDBY_SIGNAL_FILE
+#else
+	"recovery.conf"
+#endif
+};
+
+static bool ptrack_standby_no_recovery(void);
+static XLogRecPtr ptrack_standby_summarized_lsn(void);
+static bool ptrack_standby_summarize(XLogRecPtr start_lsn, XLogRecPtr end_lsn,
+									 TimeLineID max_tli);
+
+Size
+ptrackStandbyShmemSize(void)
+{
+	if (ptrack_map_size == 0 || ptrack_standby_mode != PTRACK_STANDBY_DEFERRED)
+		return 0;
+
+	return sizeof(PtrackStandbyCtlData);
+}
+
+/*
+ * Allocate standby state in shared memory.  Nothing is allocated unless
+ * ptrack.standby_mode is deferred, so ptrack_standby stays NULL.
+ */
+void
+ptrackStandbyShmemInit(void)
+{
+	bool		found;
+
+	if (ptrack_map_size == 0 || ptrack_standby_mode != PTRACK_STANDBY_DEFERRED)
+		return;
+
+	ptrack_standby = ShmemInitStruct("ptrack standby",
+									 sizeof(PtrackStandbyCtlData),
+									 &found);
+
+	/* Map loaded by postmaster covers all changes up to its redo LSN */
+	if (!found)
+	{
+		pg_atomic_init_u64(&ptrack_standby->summarized_lsn,
+						   ptrack_map != NULL ? ptrack_map->redo_lsn : InvalidXLogRecPtr);
+		ptrack_standby->no_recovery = ptrack_standby_no_recovery();
+	}
+}
+
+/*
+ * Whether the map was written by the shutdown checkpoint, after which
+ * server starts without recovery.
+ */
+static bool
+ptrack_standby_no_recovery(void)
+{
+	ControlFileData *control_file;
+	bool		crc_ok;
+	bool		result;
+	int			i;
+
+	if (ptrack_map == NULL)
+		return false;
+
+#if PG_VERSION_NUM >= 120000
+	control_file = get_controlfile(DataDir, &crc_ok);
+#else
+	control_file = get_controlfile(DataDir, NULL, &crc_ok);
+#endif
+
+	result = crc_ok && control_file->state == DB_SHUTDOWNED &&
+		control_file->checkPoint == ptrack_map->redo_lsn &&
+		control_file->checkPointCopy.redo == control_file->checkPoint;
+	pfree(control_file);
+
+	for (i = 0; result && i < lengthof(ptrack_recovery_files); i++)
+	{
+		char		path[MAXPGPATH];
+		struct stat st;
+
+		snprintf(path, MAXPGPATH, "%s/%s", DataDir, ptrack_recovery_files[i]);
+		if (stat(path, &st) == 0)
+			result = false;
+	}
+
+	return result;
+}
+
+/*
+ * Return LSN, before which all replayed changes are in the map.  Without
+ * recovery replay ends right after the shutdown checkpoint record, which
+ * changes nothing, so everything replayed is summarized already.
+ */
+static XLogRecPtr
+ptrack_standby_summarized_lsn(void)
+{
+	XLogRecPtr	lsn = pg_atomic_read_u64(&ptrack_standby->summarized_lsn);
+
+	if (ptrack_standby->no_recovery && !RecoveryInProgress())
+	{
+		XLogRecPtr	replay_lsn = GetXLogReplayRecPtr(NULL);
+
+		while (lsn < replay_lsn &&
+			   !pg_atomic_compare_exchange_u64(&ptrack_standby->summarized_lsn,
+											   &lsn, replay_lsn));
+		lsn = Max(lsn, replay_lsn);
+	}
+
+	return lsn;
+}
+
+/*
+ * Summarize WAL replayed since the previous call into the map.  Called by
+ * checkpointer before the map is written.
+ */
+void
+ptrack_standby_checkpoint(void)
+{
+	XLogRecPtr	start_lsn;
+	XLogRecPtr	end_lsn;
+	TimeLineID	tli;
+
+	if (ptrack_standby == NULL)
+		return;
+
+	start_lsn = ptrack_standby_summarized_lsn();
+	end_lsn = GetXLogReplayRecPtr(&tli);
+
+	if (start_lsn >= end_lsn)
+		return;
+
+	/*
+	 * Nothing to summarize into the new map, ptrackCheckpoint() is going to
+	 * set its init_lsn not below end_lsn.
+	 */
+	if (start_lsn == InvalidXLogRecPtr ||
+		pg_atomic_read_u64(&ptrack_map->init_lsn) == InvalidXLogRecPtr)
+	{
+		pg_atomic_write_u64(&ptrack_standby->summarized_lsn, end_lsn);
+		return;
+	}
+
+	/* Segments of the new timeline after promotion are the latest ones */
+	if (!ptrack_standby_summarize(start_lsn, end_lsn, Max(tli, ThisTimeLineID)))
+	{
+		elog(WARNING, "ptrack standby: could not summarize WAL from %X/%X to %X/%X, init_lsn is moved forward",
+			 (uint32) (start_lsn >> 32), (uint32) start_lsn,
+			 (uint32) (end_lsn >> 32), (uint32) end_lsn);
+		pg_atomic_write_u64(&ptrack_map->init_lsn, end_lsn);
+	}
+
+	pg_atomic_write_u64(&ptrack_standby->summarized_lsn, end_lsn);
+
+	elog(DEBUG1, "ptrack standby: summarized WAL from %X/%X to %X/%X",
+		 (uint32) (start_lsn >> 32), (uint32) start_lsn,
+		 (uint32) (end_lsn >> 32), (uint32) end_lsn);
+}
+
+/*
+ * Return LSN, which scans have to report for every block, since replayed
+ * WAL is not summarized yet, or InvalidXLogRecPtr if the map is complete.
+ */
+XLogRecPtr
+ptrack_standby_pending_lsn(void)
+{
+	XLogRecPtr	replay_lsn;
+
+	if (ptrack_standby == NULL)
+		return InvalidXLogRecPtr;
+
+	replay_lsn = GetXLogReplayRecPtr(NULL);
+	if (ptrack_standby_summarized_lsn() >= replay_lsn)
+		return InvalidXLogRecPtr;
+
+	return RecoveryInProgress() ? replay_lsn : GetXLogInsertRecPtr();
+}
+
+/*
+ * Mark all blocks of the relation fork at 'lsn'.
+ */
+static void
+ptrack_standby_mark_fork(RelFileNode rnode, ForkNumber forknum, XLogRecPtr lsn)
+{
+	char	   *path = relpathperm(rnode, forknum);
+	char		segpath[MAXPGPATH];
+	struct stat st;
+	BlockNumber segno;
+	BlockNumber blkno;
+
+	for (segno = 0;; segno++)
+	{
+		BlockNumber nblocks;
+
+		if (segno == 0)
+			snprintf(segpath, MAXPGPATH, "%s", path);
+		else
+			snprintf(segpath, MAXPGPATH, "%s.%u", path, segno);
+
+		if (stat(segpath, &st) != 0)
+			break;
+
+		nblocks = st.st_size / BLCKSZ;
+		for (blkno = 0; blkno < nblocks; blkno++)
+			ptrack_mark_block_at(rnode, forknum, segno * RELSEG_SIZE + blkno, lsn);
+
+		if (nblocks < RELSEG_SIZE)
+			break;
+	}
+
+	pfree(path);
+}
+
+/*
+ * Read WAL page from pg_wal.  Segment is taken from the latest timeline,
+ * which has it, since segment of timeline switch is copied to the new
+ * timeline and the old one is renamed to .partial on promotion.
+ */
+static int
+ptrack_standby_read_page(XLogReaderState *reader, XLogRecPtr targetPagePtr,
+						 int reqLen, XLogRecPtr targetRecPtr, char *readBuf
+#if PG_VERSION_NUM < 130000
+						 ,TimeLineID *pageTLI
+#endif
+)
+{
+	PtrackWalFile *file = (PtrackWalFile *) reader->private_data;
+	XLogSegNo	segno;
+	off_t		offset;
+
+	XLByteToSeg(targetPagePtr, segno, wal_segment_size);
+	offset = XLogSegmentOffset(targetPagePtr, wal_segment_size);
+
+	if (file->fd < 0 || file->segno != segno)
+	{
+		char		path[MAXPGPATH];
+		TimeLineID	tli;
+
+		if (file->fd >= 0)
+			CloseTransientFile(file->fd);
+		file->fd = -1;
+
+		for (tli = file->max_tli; tli > 0 && file->fd < 0; tli--)
+		{
+			XLogFilePath(path, tli, segno, wal_segment_size);
+			file->fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+			file->tli = tli;
+		}
+
+		if (file->fd < 0)
+		{
+			elog(LOG, "ptrack standby: could not find WAL segment of %X/%X",
+				 (uint32) (targetPagePtr >> 32), (uint32) targetPagePtr);
+			return -1;
+		}
+
+		file->segno = segno;
+	}
+
+	if (lseek(file->fd, offset, SEEK_SET) != offset ||
+		read(file->fd, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
+	{
+		elog(LOG, "ptrack standby: could not read WAL page at %X/%X: %m",
+			 (uint32) (targetPagePtr >> 32), (uint32) targetPagePtr);
+		return -1;
+	}
+
+#if PG_VERSION_NUM < 130000
+	*pageTLI = file->tli;
+#endif
+
+	return XLOG_BLCKSZ;
+}
+
+/*
+ * Mark blocks referenced by WAL records from 'start_lsn' to 'end_lsn',
+ * which must be both record boundaries.  Return false, if WAL could not be
+ * read.
+ */
+static bool
+ptrack_standby_summarize(XLogRecPtr start_lsn, XLogRecPtr end_lsn,
+						 TimeLineID max_tli)
+{
+	XLogReaderState *reader;
+	PtrackWalFile file;
+	XLogRecord *record;
+	XLogRecPtr	lsn = start_lsn;
+	char	   *errormsg = NULL;
+	bool		result = true;
+
+	file.fd = -1;
+	file.segno = 0;
+	file.tli = 0;
+	file.max_tli = max_tli;
+
+#if PG_VERSION_NUM >= 130000
+	reader = XLogReaderAllocate(wal_segment_size, NULL,
+								XL_ROUTINE(.page_read = &ptrack_standby_read_page),
+								&file);
+#else
+	reader = XLogReaderAllocate(wal_segment_size, &ptrack_standby_read_page,
+								&file);
+#endif
+	if (reader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory"),
+				 errdetail("Failed while allocating a WAL reading processor.")));
+
+	/* Record ending at the page boundary is followed by the page header */
+	if (XLogSegmentOffset(lsn, wal_segment_size) == 0)
+		lsn += SizeOfXLogLongPHD;
+	else if (lsn % XLOG_BLCKSZ == 0)
+		lsn += SizeOfXLogShortPHD;
+
+#if PG_VERSION_NUM >= 130000
+	XLogBeginRead(reader, lsn);
+#endif
+
+	while (reader->EndRecPtr < end_lsn)
+	{
+		uint8		block_id;
+
+#if PG_VERSION_NUM >= 130000
+		record = XLogReadRecord(reader, &errormsg);
+#else
+		record = XLogReadRecord(reader, lsn, &errormsg);
+		lsn = InvalidXLogRecPtr;
+#endif
+		if (record == NULL)
+		{
+			if (errormsg != NULL)
+				elog(LOG, "ptrack standby: %s", errormsg);
+			result = false;
+			break;
+		}
+
+		for (block_id = 0; (int) block_id <= reader->max_block_id; block_id++)
+		{
+			RelFileNode rnode;
+			ForkNumber	forknum;
+			BlockNumber blkno;
+
+			if (XLogRecGetBlockTag(reader, block_id, &rnode, &forknum, &blkno))
+				ptrack_mark_block_at(rnode, forknum, blkno, reader->EndRecPtr);
+		}
+
+		/* Truncation of the maps rewrites their last pages without WAL */
+		if (XLogRecGetRmid(reader) == RM_SMGR_ID &&
+			(XLogRecGetInfo(reader) & ~XLR_INFO_MASK) == XLOG_SMGR_TRUNCATE)
+		{
+			xl_smgr_truncate *xlrec = (xl_smgr_truncate *) XLogRecGetData(reader);
+
+			if (xlrec->flags & SMGR_TRUNCATE_VM)
+				ptrack_standby_mark_fork(xlrec->rnode, VISIBILITYMAP_FORKNUM,
+										 reader->EndRecPtr);
+			if (xlrec->flags & SMGR_TRUNCATE_FSM)
+				ptrack_standby_mark_fork(xlrec->rnode, FSM_FORKNUM,
+										 reader->EndRecPtr);
+		}
+	}
+
+	if (file.fd >= 0)
+		CloseTransientFile(file.fd);
+	XLogReaderFree(reader);
+
+	return result;
+}
@@ -0,0 +1,57 @@
+/*-------------------------------------------------------------------------
+ *
+ * standby.h
+ *	  header for deferred tracking of changes replayed by standby
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/standby.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_STANDBY_H
+#define PTRACK_STANDBY_H
+
+#include "access/xlog.h"
+#include "access/xlogdefs.h"
+#include "port/atomics.h"
+
+/*
+ * Values of ptrack.standby_mode.  With PTRACK_STANDBY_DEFERRED blocks
+ * written by replay are not marked, changes are summarized into the map
+ * from the replayed WAL by checkpointer instead.
+ */
+typedef enum PtrackStandbyMode
+{
+	PTRACK_STANDBY_IMMEDIATE,
+	PTRACK_STANDBY_DEFERRED
+}			PtrackStandbyMode;
+
+typedef struct PtrackStandbyCtlData
+{
+	/* All changes replayed before this LSN are in the map */
+	pg_atomic_uint64 summarized_lsn;
+	/* Map was written by the shutdown checkpoint, no recovery follows it */
+	bool		no_recovery;
+}			PtrackStandbyCtlData;
+
+extern PtrackStandbyCtlData * ptrack_standby;
+extern int	ptrack_standby_mode;
+
+extern Size ptrackStandbyShmemSize(void);
+extern void ptrackStandbyShmemInit(void);
+extern void ptrack_standby_checkpoint(void);
+extern XLogRecPtr ptrack_standby_pending_lsn(void);
+
+/*
+ * Whether blocks written by replay are left to ptrack_standby_checkpoint().
+ */
+static inline bool
+ptrack_replay_deferred(void)
+{
+	return ptrack_standby_mode == PTRACK_STANDBY_DEFERRED && RecoveryInProgress();
+}
+
+#endif							/* PTRACK_STANDBY_H */
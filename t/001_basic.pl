@@ -10,7 +10,7 @@ use PostgresNode;
 use TestLib;
 use Test::More;
 
-plan tests => 23;
+plan tests => 70;
 
 my $node;
 my $res;
@@ -66,13 +66,31 @@ like(
 $node->append_conf(
 	'postgresql.conf', q{
 ptrack.map_size = 13
+ptrack.hot_segments = 4
+ptrack.hot_threshold = 100
 });
+$node->restart;
+
+# Relations written without WAL should keep their marks after crash
+$node->safe_psql("postgres", "CHECKPOINT");
+my $skipwal_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$node->safe_psql("postgres",
+	"BEGIN; CREATE TABLE ptrack_skipwal AS SELECT i FROM generate_series(1, 100000) i; COMMIT");
+my $skipwal_path = $node->safe_psql("postgres", "SELECT pg_relation_filepath('ptrack_skipwal')");
+$node->stop('immediate');
+$node->start;
+$res_stdout = $node->safe_psql("postgres", "SELECT path FROM ptrack_get_pagemapset('$skipwal_lsn')");
+like(
+	$res_stdout,
+	qr/^$skipwal_path$/m,
+	'ptrack should keep marks of relation written without WAL after crash');
+$node->safe_psql("postgres", "DROP TABLE ptrack_skipwal");
+
 $node->stop;
-$res = $node->start(fail_ok => 1);
-is($res, 0, 'could not start with wal_level = \'minimal\'');
 $node->append_conf(
 	'postgresql.conf', q{
 wal_level = 'replica'
+max_wal_senders = 4
 });
 $node->start;
 
@@ -94,6 +112,11 @@ $node->stop('immediate');
 $node->start;
 $res_stdout = $node->safe_psql("postgres", "SELECT ptrack_init_lsn()");
 is($res_stdout, $init_lsn, 'ptrack init_lsn should be the same after crash recovery');
+ok(-s $node->data_dir . '/global/ptrack.map' < 1024 * 1024,
+	'ptrack.map should be stored compressed');
+
+# Create ptrack slot before doing any changes
+$node->safe_psql("postgres", "SELECT ptrack_create_slot('test_slot')");
 
 # Do some stuff, which hits ptrack
 $node->safe_psql("postgres", "CREATE DATABASE ptrack_test");
@@ -115,13 +138,417 @@ like(
 	qr/$rel_oid/,
 	'ptrack pagemapset should contain new relation oid');
 
+# Slot should survive restart and see the same changes
+$res_stdout = $node->safe_psql("postgres", "SELECT * FROM ptrack_slot_get_pagemapset('test_slot')");
+like(
+	$res_stdout,
+	qr/$rel_oid/,
+	'ptrack slot pagemapset should contain new relation oid');
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT valid AND changed_pages > 0 FROM ptrack_slots WHERE slot_name = 'test_slot'");
+is($res_stdout, 't', 'ptrack slot should be valid and have some lag');
+
+# Slot can be moved only forward
+my $cur_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_advance_slot('test_slot', '$cur_lsn')");
+is($res_stdout, $cur_lsn, 'ptrack slot should be advanced');
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_advance_slot('test_slot', '$flush_lsn')");
+is($res_stdout, $cur_lsn, 'ptrack slot should not go backward');
+
+# Map copied into a base backup should be trusted by the restored cluster
+$node->backup('ptrack_backup');
+my $node_restored = get_new_node('restored');
+$node_restored->init_from_backup($node, 'ptrack_backup');
+$node_restored->start;
+$res_stdout = $node_restored->safe_psql("postgres", "SELECT ptrack_init_lsn()");
+is($res_stdout, $init_lsn, 'restored cluster should inherit ptrack init_lsn');
+$res_stdout = $node_restored->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$flush_lsn')");
+like(
+	$res_stdout,
+	qr/$rel_oid/,
+	'restored cluster should inherit tracked changes');
+$node_restored->stop;
+
+# Changes of hot segments are tracked outside of the hashed map and should
+# survive both checkpoint and restart
+$node->safe_psql("postgres", "CREATE TABLE ptrack_hot AS SELECT i AS id FROM generate_series(0, 100000) i");
+$node->safe_psql("postgres", "CHECKPOINT");
+my $hot_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+my $hot_oid = $node->safe_psql("postgres", "SELECT relfilenode FROM pg_class WHERE relname = 'ptrack_hot'");
+$node->safe_psql("postgres", "UPDATE ptrack_hot SET id = id + 1");
+$node->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$hot_lsn')");
+like(
+	$res_stdout,
+	qr/$hot_oid/,
+	'ptrack pagemapset should contain changed hot relation');
+$node->restart;
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$hot_lsn')");
+like(
+	$res_stdout,
+	qr/$hot_oid/,
+	'ptrack pagemapset should contain changed hot relation after restart');
+
+# Throttled scan should return the same changeset
+$res_stdout = $node->safe_psql("postgres", "SELECT count(*) FROM ptrack_get_pagemapset('$hot_lsn')");
+$res = $node->safe_psql("postgres", qq{
+SET ptrack.scan_cost_delay = 1;
+SET ptrack.scan_cost_limit = 10000;
+SELECT count(*) FROM ptrack_get_pagemapset('$hot_lsn');
+});
+is($res, $res_stdout, 'throttled ptrack pagemapset should return the same files');
+
+# Reference backup tool should restore an incremental chain to the same state
+SKIP:
+{
+	skip "ptrack_backup is not installed", 4
+	  if system("ptrack_backup --help >/dev/null 2>&1") != 0;
+
+	my $backup_root = TestLib::tempdir;
+	my $connstr = $node->connstr('postgres');
+	command_ok(
+		[ 'ptrack_backup', 'backup', '-B', "$backup_root/full", '-d', $connstr, '-j', '2' ],
+		'ptrack_backup should take full backup');
+	$node->safe_psql("postgres", "UPDATE ptrack_hot SET id = id + 1 WHERE id < 1000");
+	command_ok(
+		[ 'ptrack_backup', 'backup', '-B', "$backup_root/incr", '-b', "$backup_root/full",
+		  '-d', $connstr, '-j', '2' ],
+		'ptrack_backup should take incremental backup');
+	my $expected = $node->safe_psql("postgres", "SELECT sum(id) FROM ptrack_hot");
+
+	my $node_chain = get_new_node('chain');
+	command_ok(
+		[ 'ptrack_backup', 'restore', '-B', "$backup_root/incr", '-D', $node_chain->data_dir, '-j', '2' ],
+		'ptrack_backup should restore incremental chain');
+	$node_chain->append_conf('postgresql.conf', "port = " . $node_chain->port);
+	$node_chain->start;
+	$res_stdout = $node_chain->safe_psql("postgres", "SELECT sum(id) FROM ptrack_hot");
+	is($res_stdout, $expected, 'restored incremental chain should have the same data');
+	$node_chain->stop;
+}
+
+# Incremental BASE_BACKUP should send changed relation files as pagemap
+# members, including files of tablespaces sent by their absolute paths
+my $tblspc_dir = TestLib::tempdir;
+$node->safe_psql("postgres", "CREATE TABLESPACE ptrack_tblspc LOCATION '$tblspc_dir'");
+$node->safe_psql("postgres",
+	"CREATE TABLE ptrack_tblspc_tbl TABLESPACE ptrack_tblspc AS SELECT i AS id FROM generate_series(0, 1000) i");
+$node->safe_psql("postgres", "CHECKPOINT");
+my $incr_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+my $tblspc_rel_oid = $node->safe_psql("postgres", "SELECT relfilenode FROM pg_class WHERE relname = 'ptrack_tblspc_tbl'");
+$node->safe_psql("postgres", "UPDATE ptrack_hot SET id = id + 1 WHERE id < 1000");
+$node->safe_psql("postgres", "UPDATE ptrack_tblspc_tbl SET id = id + 1 WHERE id < 10");
+$node->safe_psql("postgres", "CHECKPOINT");
+($res_stdout, $res_stderr) = run_command(
+	[ 'psql', '-X', '-q', '-d', $node->connstr('postgres') . ' replication=database',
+	  '-c', "BASE_BACKUP PTRACK '$incr_lsn'" ]);
+like(
+	$res_stdout,
+	qr{base/\d+/$hot_oid\.ptrack},
+	'incremental base backup should send pagemap of changed relation');
+like(
+	$res_stdout,
+	qr{/\d+/$tblspc_rel_oid\.ptrack},
+	'incremental base backup should send pagemap of changed relation in tablespace');
+$node->safe_psql("postgres", "DROP TABLE ptrack_tblspc_tbl");
+$node->safe_psql("postgres", "DROP TABLESPACE ptrack_tblspc");
+
+# Standby should receive changes of the primary's map through WAL
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.wal_log_map = on
+});
+$node->reload;
+$node->backup('ptrack_standby_backup');
+my $node_standby = get_new_node('standby');
+$node_standby->init_from_backup($node, 'ptrack_standby_backup', has_streaming => 1);
+$node_standby->start;
+$node->safe_psql("postgres",
+	"CREATE TABLE ptrack_walmap WITH (autovacuum_enabled = off) AS SELECT i FROM generate_series(1, 1000) i");
+my $walmap_oid = $node->safe_psql("postgres", "SELECT relfilenode FROM pg_class WHERE relname = 'ptrack_walmap'");
+$node->safe_psql("postgres", "CHECKPOINT");
+$node->wait_for_catchup($node_standby, 'replay', $node->lsn('insert'));
+# Restartpoint writes out all pages replayed so far, so standby marks the
+# table by itself only before this LSN
+$node_standby->safe_psql("postgres", "CHECKPOINT");
+my $standby_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+# Hint bits are set without WAL, so standby can learn about this change
+# only from the map of primary
+$node->safe_psql("postgres", "SELECT count(*) FROM ptrack_walmap");
+$node->safe_psql("postgres", "CHECKPOINT");
+$node->safe_psql("postgres", "CHECKPOINT");
+$node->wait_for_catchup($node_standby, 'replay', $node->lsn('insert'));
+$res_stdout = $node_standby->safe_psql("postgres", "SELECT ptrack_init_lsn()");
+is($res_stdout, $node->safe_psql("postgres", "SELECT ptrack_init_lsn()"),
+	'standby should take over ptrack init_lsn of primary');
+$res_stdout = $node_standby->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$standby_lsn')");
+like(
+	$res_stdout,
+	qr/\/$walmap_oid,/,
+	'standby should receive changes made by primary without WAL');
+$node_standby->stop;
+
+# Deferred standby should summarize replayed changes into its map on promotion
+my $node_deferred = get_new_node('deferred');
+$node_deferred->init_from_backup($node, 'ptrack_standby_backup', has_streaming => 1);
+$node_deferred->append_conf(
+	'postgresql.conf', q{
+ptrack.standby_mode = 'deferred'
+});
+$node->safe_psql("postgres", "CREATE TABLE ptrack_untouched WITH (autovacuum_enabled = off) AS SELECT 1 AS i");
+my $untouched_oid = $node->safe_psql("postgres", "SELECT relfilenode FROM pg_class WHERE relname = 'ptrack_untouched'");
+$node_deferred->start;
+my $deferred_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$node->safe_psql("postgres", "UPDATE ptrack_hot SET id = id + 1");
+$node->wait_for_catchup($node_deferred, 'replay', $node->lsn('insert'));
+$node_deferred->promote;
+$node_deferred->poll_query_until('postgres', "SELECT NOT pg_is_in_recovery()");
+$node_deferred->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node_deferred->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$deferred_lsn')");
+like(
+	$res_stdout,
+	qr/$hot_oid/,
+	'promoted deferred standby should track changes replayed before promotion');
+unlike(
+	$res_stdout,
+	qr/\/$untouched_oid,/,
+	'promoted deferred standby should not report relation untouched since LSN');
+$node_deferred->restart;
+$res_stdout = $node_deferred->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$deferred_lsn')");
+unlike(
+	$res_stdout,
+	qr/\/$untouched_oid,/,
+	'deferred node restarted without recovery should not report untouched relation');
+$node_deferred->stop;
+
+# Retained snapshot should tell which relations were changed between two LSNs
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.snapshots = 2
+});
+$node->reload;
+$node->safe_psql("postgres", "CREATE TABLE ptrack_snap WITH (autovacuum_enabled = off) AS SELECT i FROM generate_series(1, 1000) i");
+$node->safe_psql("postgres", "CHECKPOINT");
+my $snap_oid = $node->safe_psql("postgres", "SELECT relfilenode FROM pg_class WHERE relname = 'ptrack_snap'");
+my $snap_start_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$node->safe_psql("postgres", "UPDATE ptrack_hot SET id = id + 1");
+my $snap_lsn = $node->safe_psql("postgres", "SELECT ptrack_take_snapshot()");
+$node->safe_psql("postgres", "UPDATE ptrack_snap SET i = i + 1");
+$node->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node->safe_psql("postgres", "SELECT path FROM ptrack_get_pagemapset('$snap_start_lsn', '$snap_lsn')");
+like(
+	$res_stdout,
+	qr/$hot_oid/,
+	'ptrack snapshot should contain relation changed before it');
+unlike(
+	$res_stdout,
+	qr/\/$snap_oid(\.|$)/m,
+	'ptrack snapshot should not contain relation changed after it');
+
+# Standby should take snapshot only by restartpoint at a newly replayed checkpoint
+$node->backup('ptrack_snap_backup');
+my $node_snap = get_new_node('snap_standby');
+$node_snap->init_from_backup($node, 'ptrack_snap_backup', has_streaming => 1);
+$node_snap->start;
+$node->safe_psql("postgres", "CHECKPOINT");
+$node->wait_for_catchup($node_snap, 'replay', $node->lsn('insert'));
+$res_stdout = $node_snap->safe_psql("postgres", "SELECT ptrack_take_snapshot() <> '0/0'");
+is($res_stdout, 't', 'standby should take ptrack snapshot by restartpoint');
+($res, $res_stdout, $res_stderr) = $node_snap->psql("postgres", "SELECT ptrack_take_snapshot()");
+like(
+	$res_stderr,
+	qr/no checkpoint was replayed after the last restartpoint/,
+	'standby should not report old ptrack snapshot without new restartpoint');
+$node_snap->stop;
+
+# Recently written blocks should be exported for prewarming
+$res_stdout = $node->safe_psql("postgres", "SELECT count(*) FROM ptrack_get_recent_blocks('$snap_start_lsn') WHERE relfilenode = $hot_oid");
+ok($res_stdout > 0, 'ptrack recent blocks should contain changed relation');
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_dump_prewarm('$snap_start_lsn')");
+like(
+	slurp_file($node->data_dir . '/autoprewarm.blocks'),
+	qr/^<<$res_stdout>>\n/,
+	'ptrack should dump recent blocks in autoprewarm format');
+
+# Changeset should be exported as a block reference table
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_write_wal_summary('$snap_start_lsn')");
+my $summary = slurp_file($node->data_dir . '/' . $res_stdout);
+my %summary_rels;
+my $summary_pos = 4;
+while ($summary_pos + 24 <= length($summary))
+{
+	my ($spc, $db, $rel, $fork, $limit, $nchunks) =
+	  unpack('L6', substr($summary, $summary_pos, 24));
+	$summary_pos += 24;
+	last if $rel == 0;
+	$summary_rels{$rel} = 1;
+	my @usage = unpack("S$nchunks", substr($summary, $summary_pos, 2 * $nchunks));
+	$summary_pos += 2 * $nchunks;
+	$summary_pos += 2 * $_ foreach @usage;
+}
+is(unpack('L', $summary), 0x652b137b,
+	'ptrack WAL summary should start with block reference table magic');
+ok($summary_rels{$hot_oid} && $summary_rels{$snap_oid} && $summary_pos + 4 == length($summary),
+	'ptrack WAL summary should contain changed relations');
+
+# Cursor split into parts should return every changed file once
+my %cursor_paths;
+foreach my $token (split /\n/, $node->safe_psql("postgres", "SELECT ptrack_pagemapset_cursor('$snap_start_lsn', 2)"))
+{
+	while ($token ne '')
+	{
+		my @rows = split /\n/, $node->safe_psql("postgres",
+			"SELECT coalesce(path, ''), coalesce(next_token, '') FROM ptrack_pagemapset_fetch('$token', 50)");
+		$token = '';
+		foreach my $row (@rows)
+		{
+			my ($path, $next_token) = split /\|/, $row, 2;
+			if ($path ne '') { $cursor_paths{$path}++; }
+			else { $token = $next_token; }
+		}
+	}
+}
+ok((grep { /\/$hot_oid$/ } keys %cursor_paths) && (grep { /\/$snap_oid$/ } keys %cursor_paths) &&
+	!(grep { $_ > 1 } values %cursor_paths),
+	'ptrack cursor should return each changed file once');
+
+# Cursor of a single database should return its files only
+my $postgres_oid = $node->safe_psql("postgres", "SELECT oid FROM pg_database WHERE datname = 'postgres'");
+my $db_token = $node->safe_psql("postgres", "SELECT ptrack_pagemapset_cursor('$snap_start_lsn', 1, $postgres_oid)");
+my @db_paths = split /\n/, $node->safe_psql("postgres",
+	"SELECT path FROM ptrack_pagemapset_fetch('$db_token', 100000) WHERE path IS NOT NULL");
+ok((grep { /\/$snap_oid$/ } @db_paths) && !(grep { !/^base\/$postgres_oid\// } @db_paths),
+	'ptrack cursor should return only files of the given database');
+
+# Changed files should be the same as the files of pagemapset
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT count(*) FROM ptrack_get_changed_files('$snap_start_lsn') c " .
+	"FULL JOIN ptrack_get_pagemapset('$snap_start_lsn') p ON c.path = p.path " .
+	"WHERE c.changed IS DISTINCT FROM (p.path IS NOT NULL)");
+is($res_stdout, '0', 'ptrack changed files should match files of pagemapset');
+
+# Estimate from the full sample should be exact
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT e.changed_pages = c.n AND e.changed_pages_low = c.n AND e.changed_pages_high = c.n " .
+	"FROM ptrack_estimate_changes('$snap_start_lsn', 1) e, " .
+	"(SELECT count(*) AS n FROM ptrack_get_pagemapset('$snap_start_lsn') p, " .
+	"generate_series(0, length(p.pagemap) * 8 - 1) b WHERE get_bit(p.pagemap, b) = 1) c " .
+	"WHERE e.tablespace IS NULL");
+is($res_stdout, 't', 'ptrack estimate from the full sample should be exact');
+
+# Bounds of the estimate from a partial sample should contain the exact number
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT e.changed_pages_low <= c.n AND c.n <= e.changed_pages_high " .
+	"FROM ptrack_estimate_changes('$snap_start_lsn', 0.5) e, " .
+	"(SELECT count(*) AS n FROM ptrack_get_pagemapset('$snap_start_lsn') p, " .
+	"generate_series(0, length(p.pagemap) * 8 - 1) b WHERE get_bit(p.pagemap, b) = 1) c " .
+	"WHERE e.tablespace IS NULL");
+is($res_stdout, 't', 'ptrack estimate bounds from a partial sample should contain exact number');
+
+# C API should report the changed block of relation and no other blocks
+$node->safe_psql("postgres",
+	"CREATE TABLE ptrack_api WITH (autovacuum_enabled = off, fillfactor = 50) AS SELECT i FROM generate_series(1, 20000) i");
+$node->safe_psql("postgres", "CHECKPOINT");
+my $api_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$node->safe_psql("postgres", "UPDATE ptrack_api SET i = 0 WHERE ctid = '(1,1)'");
+$node->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT string_agg(b::text, ',') FROM ptrack_get_relation_blocks('ptrack_api', '$api_lsn') b");
+is($res_stdout, '1', 'ptrack C API should report only the changed block of relation');
+foreach my $lookup ('array', 'block')
+{
+	is($node->safe_psql("postgres",
+			"SELECT string_agg(b::text, ',') FROM ptrack_get_relation_blocks('ptrack_api', '$api_lsn', 'main', '$lookup') b"),
+		$res_stdout, "ptrack C API $lookup lookup should agree with iterator");
+}
+
+# Blocks of shared buffers should be marked as soon as they become dirty
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.mark_mode = 'dirty'
+});
+$node->restart;
+my $dirty_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$node->safe_psql("postgres", "UPDATE ptrack_snap SET i = i + 1");
+$res_stdout = $node->safe_psql("postgres", "SELECT path FROM ptrack_get_pagemapset('$dirty_lsn')");
+like(
+	$res_stdout,
+	qr/\/$snap_oid$/m,
+	'ptrack should mark block before checkpoint, when its buffer becomes dirty');
+
+# Buffer modified again while still dirty should be marked, when it is flushed
+my $redirty_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$node->safe_psql("postgres", "UPDATE ptrack_snap SET i = i + 1");
+$node->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node->safe_psql("postgres", "SELECT path FROM ptrack_get_pagemapset('$redirty_lsn')");
+like(
+	$res_stdout,
+	qr/\/$snap_oid$/m,
+	'ptrack should mark block modified after start LSN while its buffer was dirty');
+
+# Marks should be captured to the trace and replayed against simulated maps
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.trace_file = 'ptrack.trace'
+});
+$node->reload;
+$node->safe_psql("postgres", "UPDATE ptrack_snap SET i = i + 1");
+$node->safe_psql("postgres", "CHECKPOINT");
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.trace_file = ''
+});
+$node->restart;
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT count(*) FILTER (WHERE marks > 0 AND changed_blocks > 0 AND reported_blocks >= changed_blocks) " .
+	"FROM ptrack_simulate_trace('ptrack.trace', '{1,64}', '{hash_any,crc32c,fnv1a}', '{hashed,contiguous}')");
+is($res_stdout, '12', 'ptrack trace should be replayed against every simulated map');
+
+# Segment layout should track changes the same way
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.map_layout = 'segment'
+});
+$node->restart;
+my $layout_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$node->safe_psql("postgres", "UPDATE ptrack_snap SET i = i + 1");
+$res_stdout = $node->safe_psql("postgres", "SELECT path FROM ptrack_get_pagemapset('$layout_lsn')");
+like(
+	$res_stdout,
+	qr/\/$snap_oid$/m,
+	'ptrack should track changes with segment layout');
+
+# Coarse index should skip only groups unchanged since the requested LSN
+$node->safe_psql("postgres", "CHECKPOINT");
+$node->safe_psql("postgres", "CHECKPOINT");
+my $coarse_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_lsn()");
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT count(*) FILTER (WHERE lsn = '$layout_lsn'), count(*) FILTER (WHERE lsn = '$coarse_lsn') " .
+	"FROM (VALUES ('$layout_lsn'::pg_lsn), ('$coarse_lsn')) v(lsn), ptrack_get_pagemapset(lsn) " .
+	"WHERE path ~ '/$snap_oid\$'");
+is($res_stdout, '1|0', 'ptrack coarse index should skip only unchanged map groups');
+
+# Changes restored from the map file should not be skipped after restart
+$node->restart;
+$res_stdout = $node->safe_psql("postgres", "SELECT path FROM ptrack_get_pagemapset('$layout_lsn')");
+like(
+	$res_stdout,
+	qr/\/$snap_oid$/m,
+	'ptrack coarse index should not skip changes made before restart');
+
 # We should be able to change ptrack map size (but loose all changes)
 $node->append_conf(
 	'postgresql.conf', q{
 ptrack.map_size = 14
+ptrack.map_prefault = on
+ptrack.map_random_access = on
 });
 $node->restart;
 
+# Prefaulted map should be resident in memory
+$res_stdout = $node->safe_psql("postgres", "SELECT prefaulted AND resident_pages = map_pages FROM ptrack_get_map_stats()");
+is($res_stdout, 't', 'ptrack map should be prefaulted at start');
+
 $node->safe_psql("postgres", "CHECKPOINT");
 $res_stdout = $node->safe_psql("postgres", "SELECT ptrack_init_lsn()");
 unlike(
@@ -135,6 +562,17 @@ unlike(
 	qr/base\/$db_oid/,
 	'we should loose changes after ptrack map resize');
 
+# Slot becomes invalid after ptrack map resize
+($res, $res_stdout, $res_stderr) = $node->psql("postgres", "SELECT * FROM ptrack_slot_get_pagemapset('test_slot')");
+is($res, 3, 'errors out if slot position precedes init LSN');
+like(
+	$res_stderr,
+	qr/precedes ptrack init LSN/,
+	'errors out if slot position precedes init LSN');
+$node->safe_psql("postgres", "SELECT ptrack_drop_slot('test_slot')");
+$res_stdout = $node->safe_psql("postgres", "SELECT count(*) FROM ptrack_slots");
+is($res_stdout, '0', 'ptrack slot should be dropped');
+
 # We should be able to turn off ptrack and clean up all files by stting ptrack.map_size = 0
 $node->append_conf(
 	'postgresql.conf', q{
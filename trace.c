@@ -0,0 +1,531 @@
+/*
+ * trace.c
+ *		Capture of block marks and their offline simulation
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/trace.c
+ *
+ * Size of the map and the way blocks are put into it determine the rate of
+ * false positives, but the write pattern of a real cluster can hardly be
+ * guessed.  With ptrack.trace_file set, every process appends (block, LSN)
+ * of each mark made by ptrack_mark_block() to that file.  Records are
+ * buffered per process and appended by a single write() of
+ * PTRACK_TRACE_BUF_RECORDS records at once, so the cost of capture is about
+ * a system call per 128 marks and the trace needs no locks.  Buffered
+ * records reach the file when the buffer fills up, when the trace file is
+ * changed or disabled (on the next mark of the process) and on process exit.
+ *
+ * With ptrack.mark_mode = dirty marks are made inside critical sections,
+ * where neither file I/O nor registration of exit callbacks is allowed.
+ * So the mark only appends to the buffer there, and the file is opened and
+ * written by the first mark made outside of a critical section.  Buffer has
+ * room for PTRACK_TRACE_MAX_RECORDS records to wait for it, marks beyond
+ * that are dropped with a warning.
+ *
+ * Trace is then replayed by ptrack_simulate_trace() against maps of any
+ * size, hash function and layout.  The replay runs in the backend, but it
+ * does not touch the map in use, so it can be done on any server with ptrack
+ * loaded.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrack_trace_mark()    --- append mark to the trace
+ *	  ptrack_sim_begin()     --- load exact set of changes of the trace
+ *	  ptrack_sim_replay()    --- replay marks of the trace against a map
+ *	  ptrack_sim_lookup()    --- get LSN of the block in the replayed map
+ *	  ptrack_sim_is_traced() --- check whether the block is in the trace
+ *	  ptrack_sim_count()     --- count changed and reported traced blocks
+ *	  ptrack_sim_end()       --- free the simulation
+ *
+ */
+
+#include "postgres.h"
+
+#include <unistd.h>
+
+#include "access/hash.h"
+#include "common/file_perm.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+
+#include "engine.h"
+#include "trace.h"
+
+char	   *ptrack_trace_file = NULL;
+
+/* Whether marks have to be passed to ptrack_trace_mark() */
+bool		ptrack_trace_active = false;
+
+/* Trace file of this process */
+static int	trace_fd = -1;
+static char trace_path[MAXPGPATH];
+/* Set by assign hook, when trace file is changed */
+static bool trace_reopen = false;
+/* Set when the trace cannot be written, until trace file is changed */
+static bool trace_failed = false;
+static bool trace_exit_registered = false;
+
+static PtrackTraceRecord trace_buf[PTRACK_TRACE_MAX_RECORDS];
+static int	trace_nrecs = 0;
+/* Number of marks dropped, since the buffer was full in critical sections */
+static uint64 trace_dropped = 0;
+
+static void
+ptrack_trace_flush(void)
+{
+	size_t		size = trace_nrecs * sizeof(PtrackTraceRecord);
+
+	trace_nrecs = 0;
+
+	if (trace_fd < 0 || size == 0)
+		return;
+
+	/* Appends of each process are atomic with O_APPEND */
+	errno = 0;
+	if (write(trace_fd, trace_buf, size) != (ssize_t) size)
+	{
+		/* If write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+
+		/* Tracing must never fail the write of data */
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not write trace file \"%s\": %m", trace_path),
+				 errdetail("Tracing is stopped in this process until ptrack.trace_file is changed.")));
+
+		close(trace_fd);
+		trace_fd = -1;
+		trace_failed = true;
+	}
+}
+
+static void
+ptrack_trace_close(void)
+{
+	if (trace_fd >= 0)
+	{
+		ptrack_trace_flush();
+		close(trace_fd);
+		trace_fd = -1;
+	}
+
+	trace_nrecs = 0;
+}
+
+static void
+ptrack_trace_atexit(int code, Datum arg)
+{
+	ptrack_trace_close();
+}
+
+/*
+ * Assign hook of ptrack.trace_file.  The file is reopened by the next mark
+ * of every process, which also flushes records buffered for the old one.
+ */
+void
+assign_ptrack_trace_file(const char *newval, void *extra)
+{
+	trace_reopen = true;
+	ptrack_trace_active = true;
+}
+
+/*
+ * Open the trace file if needed and append records buffered for it.  Never
+ * called inside critical sections.
+ */
+static void
+ptrack_trace_sync(void)
+{
+	if (trace_reopen)
+	{
+		ptrack_trace_close();
+		trace_reopen = false;
+		trace_failed = false;
+	}
+
+	if (ptrack_trace_file == NULL || ptrack_trace_file[0] == '\0')
+	{
+		/* Tracing is disabled, and buffered records are flushed above */
+		ptrack_trace_active = false;
+		trace_nrecs = 0;
+		return;
+	}
+
+	if (trace_failed)
+	{
+		trace_nrecs = 0;
+		return;
+	}
+
+	if (trace_fd < 0)
+	{
+		if (is_absolute_path(ptrack_trace_file))
+			strlcpy(trace_path, ptrack_trace_file, MAXPGPATH);
+		else
+			snprintf(trace_path, MAXPGPATH, "%s/%s", DataDir, ptrack_trace_file);
+
+		trace_fd = BasicOpenFilePerm(trace_path, O_WRONLY | O_CREAT | O_APPEND | PG_BINARY,
+									 pg_file_create_mode);
+		if (trace_fd < 0)
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not open trace file \"%s\": %m", trace_path),
+					 errdetail("Tracing is stopped in this process until ptrack.trace_file is changed.")));
+			trace_failed = true;
+			trace_nrecs = 0;
+			return;
+		}
+
+		if (!trace_exit_registered)
+		{
+			on_proc_exit(ptrack_trace_atexit, 0);
+			trace_exit_registered = true;
+		}
+	}
+
+	if (trace_dropped > 0)
+	{
+		elog(WARNING, "ptrack: " UINT64_FORMAT " marks made inside critical sections were not traced, since the trace buffer was full",
+			 trace_dropped);
+		trace_dropped = 0;
+	}
+
+	if (trace_nrecs >= PTRACK_TRACE_BUF_RECORDS)
+		ptrack_trace_flush();
+}
+
+/*
+ * Append mark of block 'bid' with 'lsn' to the trace.  Called by
+ * ptrack_mark_block() only while ptrack_trace_active is set.
+ */
+void
+ptrack_trace_mark(PtBlockId bid, XLogRecPtr lsn)
+{
+	if (trace_nrecs < PTRACK_TRACE_MAX_RECORDS)
+	{
+		PtrackTraceRecord *rec = &trace_buf[trace_nrecs++];
+
+		rec->bid = bid;
+		rec->magic = PTRACK_TRACE_MAGIC;
+		rec->lsn = lsn;
+	}
+	else
+		trace_dropped++;
+
+	/* File is opened and written only outside of critical sections */
+	if (CritSectionCount == 0 &&
+		(trace_reopen || trace_fd < 0 || trace_nrecs >= PTRACK_TRACE_BUF_RECORDS))
+		ptrack_trace_sync();
+}
+
+/*
+ * Entry of the exact set of changes of the trace.
+ */
+typedef struct PtrackSimBlock
+{
+	PtBlockId	bid;
+	XLogRecPtr	lsn;
+}			PtrackSimBlock;
+
+/*
+ * Read up to 'nrecs' records of the trace into 'buf' and return their
+ * number, or 0 at the end of file.
+ */
+static int
+ptrack_sim_read(PtrackSim * sim, int fd, PtrackTraceRecord * buf, int nrecs)
+{
+	size_t		size = nrecs * sizeof(PtrackTraceRecord);
+	size_t		len = 0;
+	int			i;
+
+	while (len < size)
+	{
+		int			r = read(fd, (char *) buf + len, size - len);
+
+		if (r < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not read trace file \"%s\": %m", sim->path)));
+		if (r == 0)
+			break;
+		len += r;
+	}
+
+	/* Process may have been killed in the middle of append */
+	if (len % sizeof(PtrackTraceRecord) != 0)
+		elog(WARNING, "ptrack: ignoring partial record at the end of trace file \"%s\"",
+			 sim->path);
+
+	nrecs = len / sizeof(PtrackTraceRecord);
+
+	for (i = 0; i < nrecs; i++)
+		if (buf[i].magic != PTRACK_TRACE_MAGIC)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("ptrack: invalid record in trace file \"%s\"", sim->path)));
+
+	return nrecs;
+}
+
+static int
+ptrack_sim_open(PtrackSim * sim)
+{
+	int			fd = OpenTransientFile(sim->path, O_RDONLY | PG_BINARY);
+
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not open trace file \"%s\": %m", sim->path)));
+
+	return fd;
+}
+
+/*
+ * Slot of the block in the simulated map.
+ */
+static uint64
+ptrack_sim_slot(PtrackSim * sim, PtBlockId bid)
+{
+	uint64		nslots = sim->nentries;
+	uint64		group = 1;
+	uint32		offset = 0;
+	uint64		h;
+
+	/* Adjacent blocks share a hash and go to adjacent slots */
+	if (sim->layout == PTRACK_SIM_LAYOUT_CONTIGUOUS)
+	{
+		group = PTRACK_SIM_GROUP_BLOCKS;
+		offset = bid.blocknum % group;
+		bid.blocknum /= group;
+		nslots /= group;
+	}
+	else if (sim->layout == PTRACK_SIM_LAYOUT_SEGMENT)
+	{
+		offset = bid.blocknum % RELSEG_SIZE;
+		bid.blocknum /= RELSEG_SIZE;
+	}
+
+	switch (sim->hash)
+	{
+		case PTRACK_SIM_HASH_ANY:
+			h = DatumGetUInt64(hash_any_extended((unsigned char *) &bid, sizeof(bid), 0));
+			break;
+		case PTRACK_SIM_HASH_CRC32C:
+			{
+				pg_crc32c	crc;
+
+				INIT_CRC32C(crc);
+				COMP_CRC32C(crc, &bid, sizeof(bid));
+				FIN_CRC32C(crc);
+				h = crc;
+				break;
+			}
+		case PTRACK_SIM_HASH_FNV1A:
+			{
+				const unsigned char *p = (const unsigned char *) &bid;
+				int			i;
+
+				h = UINT64CONST(0xcbf29ce484222325);
+				for (i = 0; i < (int) sizeof(bid); i++)
+					h = (h ^ p[i]) * UINT64CONST(0x100000001b3);
+				break;
+			}
+		default:
+			elog(ERROR, "ptrack: unknown hash function %d", (int) sim->hash);
+	}
+
+	/* Segment wraps around the end of the map, as in ptrack_bid_slot() */
+	if (sim->layout == PTRACK_SIM_LAYOUT_SEGMENT)
+		return (h % nslots + offset) % nslots;
+
+	return (h % nslots) * group + offset;
+}
+
+/*
+ * Load the trace at 'path' and collect the last LSN of every block in it.
+ * Blocks changed since 'start_lsn' are the exact set of changes reported by
+ * an ideal map.  Invalid 'start_lsn' means the oldest LSN of the trace.
+ */
+PtrackSim *
+ptrack_sim_begin(const char *path, XLogRecPtr start_lsn)
+{
+	PtrackSim  *sim = palloc0(sizeof(PtrackSim));
+	PtrackTraceRecord *buf;
+	HASHCTL		ctl;
+	XLogRecPtr	min_lsn = PG_UINT64_MAX;
+	int			fd;
+	int			nrecs;
+
+	sim->path = pstrdup(path);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(PtBlockId);
+	ctl.entrysize = sizeof(PtrackSimBlock);
+	ctl.hcxt = CurrentMemoryContext;
+	sim->blocks = hash_create("ptrack traced blocks", 1024, &ctl,
+							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	buf = palloc(PTRACK_IO_BUF_SIZE);
+	fd = ptrack_sim_open(sim);
+
+	while ((nrecs = ptrack_sim_read(sim, fd, buf,
+									PTRACK_IO_BUF_SIZE / sizeof(PtrackTraceRecord))) > 0)
+	{
+		int			i;
+
+		for (i = 0; i < nrecs; i++)
+		{
+			PtrackSimBlock *block;
+			bool		found;
+
+			block = hash_search(sim->blocks, &buf[i].bid, HASH_ENTER, &found);
+			if (!found || block->lsn < buf[i].lsn)
+				block->lsn = buf[i].lsn;
+
+			min_lsn = Min(min_lsn, buf[i].lsn);
+		}
+
+		sim->nmarks += nrecs;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	CloseTransientFile(fd);
+	pfree(buf);
+
+	if (sim->nmarks == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_NO_DATA),
+				 errmsg("ptrack: trace file \"%s\" is empty", path)));
+
+	sim->start_lsn = (start_lsn != InvalidXLogRecPtr) ? start_lsn : min_lsn;
+
+	return sim;
+}
+
+/*
+ * Replay all marks of the trace against an empty map of 'nentries' entries
+ * with given hash function and layout.  Returns time spent on marking in
+ * seconds, excluding reads of the trace.
+ */
+double
+ptrack_sim_replay(PtrackSim * sim, uint64 nentries, PtrackSimHash hash,
+				  PtrackSimLayout layout)
+{
+	PtrackTraceRecord *buf;
+	instr_time	elapsed;
+	int			fd;
+	int			nrecs;
+
+	if (nentries < PTRACK_SIM_GROUP_BLOCKS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ptrack: simulated map is too small")));
+
+	if (sim->map != NULL && sim->nentries != nentries)
+	{
+		pfree(sim->map);
+		sim->map = NULL;
+	}
+
+	if (sim->map == NULL)
+		sim->map = MemoryContextAllocExtended(CurrentMemoryContext,
+											  nentries * sizeof(uint64),
+											  MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	else
+		MemSet(sim->map, 0, nentries * sizeof(uint64));
+
+	sim->nentries = nentries;
+	sim->hash = hash;
+	sim->layout = layout;
+
+	INSTR_TIME_SET_ZERO(elapsed);
+
+	buf = palloc(PTRACK_IO_BUF_SIZE);
+	fd = ptrack_sim_open(sim);
+
+	while ((nrecs = ptrack_sim_read(sim, fd, buf,
+									PTRACK_IO_BUF_SIZE / sizeof(PtrackTraceRecord))) > 0)
+	{
+		instr_time	start;
+		instr_time	end;
+		int			i;
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		/* The same as ptrack_map_advance() does */
+		for (i = 0; i < nrecs; i++)
+		{
+			uint64		slot = ptrack_sim_slot(sim, buf[i].bid);
+
+			if (sim->map[slot] < buf[i].lsn)
+				sim->map[slot] = buf[i].lsn;
+		}
+
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(elapsed, end, start);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	CloseTransientFile(fd);
+	pfree(buf);
+
+	return INSTR_TIME_GET_DOUBLE(elapsed);
+}
+
+/*
+ * Return LSN of the block in the replayed map.
+ */
+XLogRecPtr
+ptrack_sim_lookup(PtrackSim * sim, PtBlockId bid)
+{
+	Assert(sim->map != NULL);
+
+	return sim->map[ptrack_sim_slot(sim, bid)];
+}
+
+bool
+ptrack_sim_is_traced(PtrackSim * sim, PtBlockId bid)
+{
+	return hash_search(sim->blocks, &bid, HASH_FIND, NULL) != NULL;
+}
+
+/*
+ * Count traced blocks changed since start LSN and those of them, which the
+ * replayed map reports as changed.  The difference are false positives.
+ */
+void
+ptrack_sim_count(PtrackSim * sim, uint64 *changed, uint64 *reported)
+{
+	HASH_SEQ_STATUS status;
+	PtrackSimBlock *block;
+
+	*changed = 0;
+	*reported = 0;
+
+	hash_seq_init(&status, sim->blocks);
+	while ((block = hash_seq_search(&status)) != NULL)
+	{
+		if (block->lsn >= sim->start_lsn)
+			(*changed)++;
+		if (ptrack_sim_lookup(sim, block->bid) >= sim->start_lsn)
+			(*reported)++;
+	}
+}
+
+void
+ptrack_sim_end(PtrackSim * sim)
+{
+	hash_destroy(sim->blocks);
+	if (sim->map != NULL)
+		pfree(sim->map);
+	pfree(sim->path);
+	pfree(sim);
+}
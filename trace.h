@@ -0,0 +1,92 @@
+/*-------------------------------------------------------------------------
+ *
+ * trace.h
+ *	  header for capture of block marks and their offline simulation
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/trace.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_TRACE_H
+#define PTRACK_TRACE_H
+
+#include "access/xlogdefs.h"
+#include "utils/hsearch.h"
+
+#include "ptrack.h"
+
+/* Every record of the trace starts its second half with these bytes */
+#define PTRACK_TRACE_MAGIC 0x63727470	/* "ptrc" */
+
+/* Number of records buffered by each process before they are appended */
+#define PTRACK_TRACE_BUF_RECORDS 128
+
+/* Number of records each process can buffer inside critical sections */
+#define PTRACK_TRACE_MAX_RECORDS 1024
+
+/* Number of adjacent blocks sharing a hash in contiguous layout */
+#define PTRACK_SIM_GROUP_BLOCKS 8
+
+/*
+ * Record of the trace.  Trace is a plain sequence of them appended by all
+ * processes concurrently, so there is no file header, but every record
+ * carries the magic to detect garbage.
+ */
+typedef struct PtrackTraceRecord
+{
+	PtBlockId	bid;
+	uint32		magic;
+	XLogRecPtr	lsn;
+}			PtrackTraceRecord;
+
+typedef enum PtrackSimHash
+{
+	PTRACK_SIM_HASH_ANY,		/* hash_any_extended(), as the map does */
+	PTRACK_SIM_HASH_CRC32C,
+	PTRACK_SIM_HASH_FNV1A
+}			PtrackSimHash;
+
+typedef enum PtrackSimLayout
+{
+	PTRACK_SIM_LAYOUT_HASHED,	/* every block is hashed, as ptrack.map_layout
+								 * = hashed does */
+	PTRACK_SIM_LAYOUT_CONTIGUOUS,	/* groups of adjacent blocks are hashed */
+	PTRACK_SIM_LAYOUT_SEGMENT	/* segments are hashed, as ptrack.map_layout
+								 * = segment does */
+}			PtrackSimLayout;
+
+/*
+ * Replay of a trace against a map of 'nentries' entries.  'blocks' holds
+ * the last LSN of every traced block, i.e. the exact set of changes.
+ */
+typedef struct PtrackSim
+{
+	char	   *path;
+	XLogRecPtr	start_lsn;
+	uint64		nmarks;
+	HTAB	   *blocks;
+	uint64		nentries;
+	uint64	   *map;
+	PtrackSimHash hash;
+	PtrackSimLayout layout;
+}			PtrackSim;
+
+extern char *ptrack_trace_file;
+extern bool ptrack_trace_active;
+
+extern void assign_ptrack_trace_file(const char *newval, void *extra);
+extern void ptrack_trace_mark(PtBlockId bid, XLogRecPtr lsn);
+
+extern PtrackSim * ptrack_sim_begin(const char *path, XLogRecPtr start_lsn);
+extern double ptrack_sim_replay(PtrackSim * sim, uint64 nentries,
+								PtrackSimHash hash, PtrackSimLayout layout);
+extern XLogRecPtr ptrack_sim_lookup(PtrackSim * sim, PtBlockId bid);
+extern bool ptrack_sim_is_traced(PtrackSim * sim, PtBlockId bid);
+extern void ptrack_sim_count(PtrackSim * sim, uint64 *changed, uint64 *reported);
+extern void ptrack_sim_end(PtrackSim * sim);
+
+#endif							/* PTRACK_TRACE_H */
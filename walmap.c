@@ -0,0 +1,284 @@
+/*
+ * walmap.c
+ *		WAL-logging of ptrack map changes for standbys
+ *
+ * Copyright (c) 2019-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/walmap.c
+ *
+ * Standby builds its own map from the blocks written during replay, so it
+ * differs from the primary's one in init_lsn and in the blocks changed
+ * without WAL.  Thus, incremental backups taken from standby cannot be
+ * chained with the ones taken from primary, and after failover the chain
+ * has to start from a full backup.
+ *
+ * With ptrack.wal_log_map enabled, checkpointer of the primary writes all
+ * map entries changed since its previous checkpoint to WAL, and standby
+ * merges them into its own map during replay.  There are no custom WAL
+ * resource managers before PostgreSQL 15, so entries are sent as
+ * non-transactional logical messages with PTRACK_WALMAP_PREFIX, which are
+ * intercepted by the redo hook of the core patch.  Messages are not bound
+ * to any database, so logical decoding skips them.
+ *
+ * The first round after checkpointer start (or after ptrack.wal_log_map is
+ * enabled) contains all non-zero entries of the map.  Once standby has
+ * replayed a complete full round, its map covers all changes since the
+ * primary's init_lsn, so it takes that init_lsn over.  Standby keeps marking
+ * blocks written by replay as usual, so marks of the primary, which are
+ * still in progress when checkpointer scans the map, are not lost.
+ *
+ * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrack_walmap_begin() --- start logging map changes by checkpoint
+ *	  ptrack_walmap_add()   --- log single map entry if it has changed
+ *	  ptrack_walmap_end()   --- finish logging map changes
+ *	  ptrack_walmap_redo()  --- apply map changes on standby
+ *
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "replication/message.h"
+
+#include "ptrack.h"
+#include "engine.h"
+#include "walmap.h"
+
+struct PtrackWalMap
+{
+	XLogRecPtr	from_lsn;
+	/* Entries changed after this LSN will be sent by the next checkpoint */
+	XLogRecPtr	next_from_lsn;
+	uint64		prev_slot;
+	size_t		len;
+	/* Message being built, starts with xl_ptrack_map_delta */
+	char		buf[PTRACK_WALMAP_MSG_SIZE];
+};
+
+bool		ptrack_wal_log_map = false;
+
+/* Checkpointer state: whether full round was sent and since which LSN */
+static bool walmap_full_sent = false;
+static XLogRecPtr walmap_from_lsn = InvalidXLogRecPtr;
+
+/* Startup process state: whether full round is being replayed */
+static bool walmap_full_round = false;
+static bool walmap_size_warned = false;
+
+static inline xl_ptrack_map_delta *
+ptrack_walmap_hdr(PtrackWalMap * walmap)
+{
+	return (xl_ptrack_map_delta *) walmap->buf;
+}
+
+static void
+ptrack_walmap_flush(PtrackWalMap * walmap, bool last)
+{
+	xl_ptrack_map_delta *hdr = ptrack_walmap_hdr(walmap);
+
+	if (last)
+		hdr->flags |= PTRACK_WALMAP_LAST;
+
+	LogLogicalMessage(PTRACK_WALMAP_PREFIX, walmap->buf, walmap->len, false);
+
+	elog(DEBUG1, "ptrack walmap: logged %u entries changed after %X/%X",
+		 hdr->count, (uint32) (hdr->from_lsn >> 32), (uint32) hdr->from_lsn);
+
+	hdr->flags &= ~PTRACK_WALMAP_FIRST;
+	hdr->count = 0;
+	walmap->prev_slot = 0;
+	walmap->len = sizeof(xl_ptrack_map_delta);
+}
+
+/*
+ * Start logging of the map changes by checkpoint.  Returns NULL if nothing
+ * should be logged.
+ */
+PtrackWalMap *
+ptrack_walmap_begin(XLogRecPtr init_lsn)
+{
+	PtrackWalMap *walmap;
+	xl_ptrack_map_delta *hdr;
+
+	/* Send full round again, once logging is re-enabled */
+	if (!ptrack_wal_log_map)
+	{
+		walmap_full_sent = false;
+		return NULL;
+	}
+
+	/* Standby logs nothing and there are no standbys with minimal WAL */
+	if (RecoveryInProgress() || !XLogStandbyInfoActive())
+		return NULL;
+
+	/*
+	 * Shutdown checkpoint PANICs, if any WAL is written between its redo
+	 * point and its record, and we cannot tell it from an online one here.
+	 * So no round is logged, if nothing was written since the redo point.
+	 * Skipping a round is safe: walmap_from_lsn is only advanced by
+	 * ptrack_walmap_end(), so the next round has all entries changed since
+	 * the last logged one, and checkpointer started after shutdown sends a
+	 * full round anyway.
+	 */
+	if (GetXLogInsertRecPtr() <= GetRedoRecPtr())
+		return NULL;
+
+	walmap = palloc(sizeof(PtrackWalMap));
+	walmap->from_lsn = walmap_full_sent ? walmap_from_lsn : InvalidXLogRecPtr;
+	walmap->next_from_lsn = GetXLogInsertRecPtr();
+	walmap->prev_slot = 0;
+	walmap->len = sizeof(xl_ptrack_map_delta);
+
+	hdr = ptrack_walmap_hdr(walmap);
+	MemSet(hdr, 0, sizeof(xl_ptrack_map_delta));
+	hdr->nentries = PtrackContentNblocks;
+	hdr->init_lsn = init_lsn;
+	hdr->from_lsn = walmap->from_lsn;
+	hdr->flags = PTRACK_WALMAP_FIRST;
+	if (ptrack_map_layout == PTRACK_LAYOUT_SEGMENT)
+		hdr->flags |= PTRACK_WALMAP_SEGMENT_LAYOUT;
+
+	return walmap;
+}
+
+/*
+ * Log map entry 'slot' with value 'lsn', if it has changed since the
+ * previous round.  Slots must be added in ascending order.
+ */
+void
+ptrack_walmap_add(PtrackWalMap * walmap, uint64 slot, XLogRecPtr lsn)
+{
+	xl_ptrack_map_delta *hdr = ptrack_walmap_hdr(walmap);
+
+	if (lsn == InvalidXLogRecPtr || lsn <= walmap->from_lsn)
+		return;
+
+	if (walmap->len + 2 * PTRACK_VARINT_MAX_SIZE > PTRACK_WALMAP_MSG_SIZE)
+		ptrack_walmap_flush(walmap, false);
+
+	walmap->len += ptrack_varint_encode(walmap->buf + walmap->len,
+										slot - walmap->prev_slot);
+	walmap->len += ptrack_varint_encode(walmap->buf + walmap->len,
+										lsn - walmap->from_lsn);
+	walmap->prev_slot = slot;
+	hdr->count++;
+}
+
+/*
+ * Finish logging of the map changes.  Round without changes is not logged
+ * at all (unless it is the full one), otherwise each checkpoint would make
+ * the next one non-skippable on idle system.
+ */
+void
+ptrack_walmap_end(PtrackWalMap * walmap)
+{
+	xl_ptrack_map_delta *hdr = ptrack_walmap_hdr(walmap);
+
+	if (hdr->count > 0 || !(hdr->flags & PTRACK_WALMAP_FIRST) ||
+		walmap->from_lsn == InvalidXLogRecPtr)
+		ptrack_walmap_flush(walmap, true);
+
+	walmap_full_sent = true;
+	walmap_from_lsn = walmap->next_from_lsn;
+
+	pfree(walmap);
+}
+
+/*
+ * Merge map changes logged by primary into our map.  Called for every
+ * logical message replayed, so skip foreign ones quickly.
+ */
+void
+ptrack_walmap_redo(XLogReaderState *record)
+{
+	xl_logical_message *xlrec = (xl_logical_message *) XLogRecGetData(record);
+	xl_ptrack_map_delta hdr;
+	const char *pos;
+	const char *end;
+	uint64		slot = 0;
+	uint32		i;
+
+	if (xlrec->prefix_size != sizeof(PTRACK_WALMAP_PREFIX) ||
+		strcmp(xlrec->message, PTRACK_WALMAP_PREFIX) != 0)
+		return;
+
+	if (ptrack_map == NULL)
+		return;
+
+	if (xlrec->message_size < sizeof(xl_ptrack_map_delta))
+	{
+		elog(WARNING, "ptrack walmap: message at %X/%X is too short",
+			 (uint32) (record->ReadRecPtr >> 32), (uint32) record->ReadRecPtr);
+		walmap_full_round = false;
+		return;
+	}
+
+	/* Message is not aligned in the record */
+	memcpy(&hdr, xlrec->message + xlrec->prefix_size, sizeof(xl_ptrack_map_delta));
+
+	if (hdr.nentries != PtrackContentNblocks)
+	{
+		if (!walmap_size_warned)
+			elog(WARNING, "ptrack walmap: map of primary has " UINT64_FORMAT " entries, but ours has " UINT64_FORMAT ", changes are not applied",
+				 hdr.nentries, (uint64) PtrackContentNblocks);
+		walmap_size_warned = true;
+		walmap_full_round = false;
+		return;
+	}
+
+	if (((hdr.flags & PTRACK_WALMAP_SEGMENT_LAYOUT) != 0) !=
+		(ptrack_map_layout == PTRACK_LAYOUT_SEGMENT))
+	{
+		if (!walmap_size_warned)
+			elog(WARNING, "ptrack walmap: map of primary has another ptrack.map_layout, changes are not applied");
+		walmap_size_warned = true;
+		walmap_full_round = false;
+		return;
+	}
+
+	if (hdr.flags & PTRACK_WALMAP_FIRST)
+		walmap_full_round = (hdr.from_lsn == InvalidXLogRecPtr);
+
+	pos = xlrec->message + xlrec->prefix_size + sizeof(xl_ptrack_map_delta);
+	end = xlrec->message + xlrec->prefix_size + xlrec->message_size;
+
+	for (i = 0; i < hdr.count; i++)
+	{
+		uint64		slot_delta;
+		uint64		lsn_delta;
+
+		pos = ptrack_varint_decode(pos, end, &slot_delta);
+		if (pos != NULL)
+			pos = ptrack_varint_decode(pos, end, &lsn_delta);
+
+		slot += slot_delta;
+		if (pos == NULL || slot >= PtrackContentNblocks || lsn_delta == 0)
+		{
+			elog(WARNING, "ptrack walmap: message at %X/%X is malformed",
+				 (uint32) (record->ReadRecPtr >> 32), (uint32) record->ReadRecPtr);
+			walmap_full_round = false;
+			return;
+		}
+
+		ptrack_map_advance(slot, hdr.from_lsn + lsn_delta);
+	}
+
+	/*
+	 * Map now has all changes of the primary since its init_lsn: the ones
+	 * made before the round are in the round itself and all later ones are
+	 * (or will be) marked by replay.
+	 */
+	if ((hdr.flags & PTRACK_WALMAP_LAST) && walmap_full_round)
+	{
+		XLogRecPtr	init_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
+
+		while ((init_lsn == InvalidXLogRecPtr || hdr.init_lsn < init_lsn) &&
+			   !pg_atomic_compare_exchange_u64(&ptrack_map->init_lsn, &init_lsn, hdr.init_lsn));
+
+		elog(DEBUG1, "ptrack walmap: init_lsn %X/%X of primary is taken over",
+			 (uint32) (hdr.init_lsn >> 32), (uint32) hdr.init_lsn);
+
+		walmap_full_round = false;
+	}
+}
@@ -0,0 +1,58 @@
+/*-------------------------------------------------------------------------
+ *
+ * walmap.h
+ *	  header for WAL-logging of ptrack map changes for standbys
+ *
+ *
+ * Portions Copyright (c) 1996-2019, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * ptrack/walmap.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_WALMAP_H
+#define PTRACK_WALMAP_H
+
+#include "access/xlogdefs.h"
+#include "access/xlogreader.h"
+
+/* Prefix of logical messages carrying ptrack map changes */
+#define PTRACK_WALMAP_PREFIX "ptrack"
+
+/* Maximal size of a single message, so that standby applies it quickly */
+#define PTRACK_WALMAP_MSG_SIZE (64 * 1024)
+
+/* Flags of the map changes message */
+#define PTRACK_WALMAP_FIRST	0x01	/* first message of the checkpoint */
+#define PTRACK_WALMAP_LAST	0x02	/* last message of the checkpoint */
+#define PTRACK_WALMAP_SEGMENT_LAYOUT 0x04	/* map of primary has segment layout */
+
+/*
+ * Content of the logical message with map changes.  It is followed by
+ * 'count' pairs of varints: slot delta against the previous slot of the
+ * message and LSN delta against 'from_lsn'.  Messages of a single
+ * checkpoint form a round, which contains all entries changed after
+ * 'from_lsn', or all non-zero entries if it is invalid (full round).
+ */
+typedef struct xl_ptrack_map_delta
+{
+	/* Number of entries of the primary's map, slots are meaningless otherwise */
+	uint64		nentries;
+	XLogRecPtr	init_lsn;
+	XLogRecPtr	from_lsn;
+	uint32		flags;
+	uint32		count;
+}			xl_ptrack_map_delta;
+
+/* Map changes being logged by checkpoint, see ptrack_walmap_begin() */
+typedef struct PtrackWalMap PtrackWalMap;
+
+extern bool ptrack_wal_log_map;
+
+extern PtrackWalMap * ptrack_walmap_begin(XLogRecPtr init_lsn);
+extern void ptrack_walmap_add(PtrackWalMap * walmap, uint64 slot, XLogRecPtr lsn);
+extern void ptrack_walmap_end(PtrackWalMap * walmap);
+extern void ptrack_walmap_redo(XLogReaderState *record);
+
+#endif							/* PTRACK_WALMAP_H */